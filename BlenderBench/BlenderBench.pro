@@ -0,0 +1,28 @@
+#-------------------------------------------------
+#
+# Checks MapTileBlender's kernels against each other and against QPainter's
+# source-over, and times them. Exits with 1 if any of them disagree.
+#
+#-------------------------------------------------
+CONFIG += c++17
+CONFIG += warn_on
+CONFIG += console
+CONFIG -= app_bundle
+
+QT       += core gui
+
+TARGET = BlenderBench
+TEMPLATE = app
+
+
+SOURCES += main.cpp
+
+DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x050F00
+
+#Linkage for MapGraphics shared library
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../MapGraphics/release/ -lMapGraphics
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../MapGraphics/debug/ -lMapGraphics
+else:unix:!symbian: LIBS += -L$$OUT_PWD/../MapGraphics/ -lMapGraphics
+
+INCLUDEPATH += $$PWD/../MapGraphics
+DEPENDPATH += $$PWD/../MapGraphics
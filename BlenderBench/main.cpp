@@ -0,0 +1,217 @@
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QPainter>
+#include <QRandomGenerator>
+#include <QTextStream>
+
+#include <functional>
+
+#include "guts/MapTileBlender.h"
+#include "MapLayerFilter.h"
+
+//The opacities every kernel is checked and timed at
+const QList<int> OPACITIES = QList<int>() << 255 << 192 << 128 << 64;
+
+namespace
+{
+/*
+  A tile with the mix of pixels map layers have: some fully opaque, some fully transparent (both of which the
+  kernels take shortcuts for) and the rest anywhere in between. Premultiplied, so no channel exceeds alpha.
+*/
+QImage makeLayer(int size, quint32 seed, qreal opaqueFraction, qreal transparentFraction)
+{
+    QRandomGenerator random(seed);
+    QImage toRet(size, size, QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < size; y++)
+    {
+        quint32 * line = reinterpret_cast<quint32 *>(toRet.scanLine(y));
+        for (int x = 0; x < size; x++)
+        {
+            const qreal kind = random.generateDouble();
+            quint32 alpha;
+            if (kind < opaqueFraction)
+                alpha = 255;
+            else if (kind < opaqueFraction + transparentFraction)
+                alpha = 0;
+            else
+                alpha = random.bounded(1, 255);
+
+            const quint32 r = random.bounded(256) * alpha / 255;
+            const quint32 g = random.bounded(256) * alpha / 255;
+            const quint32 b = random.bounded(256) * alpha / 255;
+            line[x] = (alpha << 24) | (r << 16) | (g << 8) | b;
+        }
+    }
+    return toRet;
+}
+
+//Returns the largest difference between two images in any channel of any pixel
+int maxDifference(const QImage& a, const QImage& b)
+{
+    int toRet = 0;
+    for (int y = 0; y < a.height(); y++)
+    {
+        const quint32 * lineA = reinterpret_cast<const quint32 *>(a.constScanLine(y));
+        const quint32 * lineB = reinterpret_cast<const quint32 *>(b.constScanLine(y));
+        for (int x = 0; x < a.width(); x++)
+        {
+            for (int shift = 0; shift < 32; shift += 8)
+            {
+                const int difference = qAbs((int)((lineA[x] >> shift) & 0xff) - (int)((lineB[x] >> shift) & 0xff));
+                toRet = qMax(toRet, difference);
+            }
+        }
+    }
+    return toRet;
+}
+
+//What CompositeTileSource did before MapTileBlender
+void painterBlend(QImage * dest, const QImage& layer, int opacity)
+{
+    QPainter painter(dest);
+    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    painter.setOpacity(opacity / 255.0);
+    painter.drawImage(0, 0, layer);
+}
+
+bool kernelBlend(const QString& kernel, QImage * dest, const QImage& layer, int opacity)
+{
+    //Our images have no padding, so each is one run of pixels
+    return MapTileBlender::blendSourceOverWith(kernel,
+                                               reinterpret_cast<quint32 *>(dest->bits()),
+                                               reinterpret_cast<const quint32 *>(layer.constBits()),
+                                               dest->width() * dest->height(),
+                                               opacity);
+}
+
+//Returns nanoseconds per tile
+qreal timeNsecs(int iterations, const std::function<void()>& work)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; i++)
+        work();
+    return (qreal)timer.nsecsElapsed() / iterations;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    //QPainter needs a QGuiApplication, but we only draw into QImages
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QGuiApplication a(argc, argv);
+    QCoreApplication::setApplicationName("BlenderBench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Checks MapTileBlender's kernels against each other and against QPainter's "
+                                     "source-over, then times them.");
+    parser.addHelpOption();
+
+    QCommandLineOption tileSizeOption("tile-size", "Tile size in pixels.", "pixels", "256");
+    QCommandLineOption iterationsOption("iterations", "Tiles blended per timing.", "count", "2000");
+    QCommandLineOption kernelToleranceOption("kernel-tolerance",
+                                             "Largest channel difference allowed between kernels.", "units", "1");
+    QCommandLineOption painterToleranceOption("painter-tolerance",
+                                              "Largest channel difference allowed from QPainter.", "units", "2");
+    parser.addOption(tileSizeOption);
+    parser.addOption(iterationsOption);
+    parser.addOption(kernelToleranceOption);
+    parser.addOption(painterToleranceOption);
+    parser.process(a);
+
+    const int tileSize = qBound<int>(1, parser.value(tileSizeOption).toInt(), 4096);
+    const int iterations = qMax<int>(1, parser.value(iterationsOption).toInt());
+    const int kernelTolerance = qMax<int>(0, parser.value(kernelToleranceOption).toInt());
+    const int painterTolerance = qMax<int>(0, parser.value(painterToleranceOption).toInt());
+
+    QTextStream out(stdout);
+    const QStringList kernels = MapTileBlender::kernelNames();
+    out << "Kernels on this machine: " << kernels.join(", ") << " (using " << MapTileBlender::kernelName() << ")\n";
+
+    //A mostly opaque basemap-like tile underneath and an overlay-like tile on top
+    const QImage base = makeLayer(tileSize, 1, 0.6, 0.1);
+    const QImage layer = makeLayer(tileSize, 2, 0.3, 0.4);
+    bool ok = true;
+
+    out << "\nSource-over, largest channel difference from QPainter and from the scalar kernel:\n";
+    foreach(int opacity, OPACITIES)
+    {
+        QImage reference = base.copy();
+        painterBlend(&reference, layer, opacity);
+
+        QImage scalar = base.copy();
+        kernelBlend("scalar", &scalar, layer, opacity);
+
+        foreach(const QString& kernel, kernels)
+        {
+            QImage result = base.copy();
+            kernelBlend(kernel, &result, layer, opacity);
+
+            const int fromPainter = maxDifference(result, reference);
+            const int fromScalar = maxDifference(result, scalar);
+            const bool kernelOk = fromPainter <= painterTolerance && fromScalar <= kernelTolerance;
+            ok = ok && kernelOk;
+            out << QString("  %1 opacity %2: %3 from QPainter, %4 from scalar%5\n")
+                   .arg(kernel, -8).arg(opacity, 3).arg(fromPainter).arg(fromScalar).arg(QString(kernelOk ? "" : "  FAILED"));
+        }
+    }
+
+    out << "\nColour filters, largest channel difference from the scalar kernel:\n";
+    MapLayerFilter inverted;
+    inverted.setInverted(true);
+    inverted.setSaturation(1.5);
+    const QList<MapLayerFilter> filters = QList<MapLayerFilter>() << MapLayerFilter::nightMode() << inverted;
+    const QStringList filterNames = QStringList() << "night mode" << "inverted";
+    for (int i = 0; i < filters.size(); i++)
+    {
+        QImage scalar = layer.copy();
+        MapTileBlender::filterPixelsWith("scalar", reinterpret_cast<quint32 *>(scalar.bits()),
+                                         tileSize * tileSize, filters.at(i).matrix());
+
+        foreach(const QString& kernel, kernels)
+        {
+            QImage result = layer.copy();
+            MapTileBlender::filterPixelsWith(kernel, reinterpret_cast<quint32 *>(result.bits()),
+                                             tileSize * tileSize, filters.at(i).matrix());
+
+            const int fromScalar = maxDifference(result, scalar);
+            const bool kernelOk = fromScalar <= kernelTolerance;
+            ok = ok && kernelOk;
+            out << QString("  %1 %2: %3%4\n")
+                   .arg(kernel, -8).arg(filterNames.at(i), -10).arg(fromScalar).arg(QString(kernelOk ? "" : "  FAILED"));
+        }
+    }
+
+    out << "\nTime per " << tileSize << "x" << tileSize << " tile, " << iterations << " tiles each:\n";
+    const qreal megapixels = (qreal)tileSize * tileSize / 1e6;
+    foreach(int opacity, OPACITIES)
+    {
+        QImage dest = base.copy();
+        const qreal painterNsecs = timeNsecs(iterations, [&]()
+        {
+            painterBlend(&dest, layer, opacity);
+        });
+        out << QString("  %1 opacity %2: %3 us, %4 Mpixel/s\n")
+               .arg(QString("QPainter"), -8).arg(opacity, 3).arg(painterNsecs / 1000.0, 8, 'f', 2)
+               .arg(megapixels / (painterNsecs / 1e9), 8, 'f', 1);
+
+        foreach(const QString& kernel, kernels)
+        {
+            dest = base.copy();
+            const qreal nsecs = timeNsecs(iterations, [&]()
+            {
+                kernelBlend(kernel, &dest, layer, opacity);
+            });
+            out << QString("  %1 opacity %2: %3 us, %4 Mpixel/s, %5x QPainter\n")
+                   .arg(kernel, -8).arg(opacity, 3).arg(nsecs / 1000.0, 8, 'f', 2)
+                   .arg(megapixels / (nsecs / 1e9), 8, 'f', 1).arg(painterNsecs / nsecs, 0, 'f', 2);
+        }
+    }
+
+    out << (ok ? "\nAll kernels agree.\n" : "\nSome kernels disagree.\n");
+    return ok ? 0 : 1;
+}
@@ -1,6 +1,13 @@
 TEMPLATE = subdirs
 
 SUBDIRS += MapGraphics \
-    TestApp
+    TestApp \
+    MockTileServer \
+    MapTileDaemon \
+    BlenderBench \
+    TileFetchBench
 
 TestApp.depends += MapGraphics
+MapTileDaemon.depends += MapGraphics
+BlenderBench.depends += MapGraphics
+TileFetchBench.depends += MapGraphics
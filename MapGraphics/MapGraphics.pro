@@ -38,7 +38,18 @@ SOURCES += MapGraphicsScene.cpp \
     guts/PrivateQGraphicsInfoSource.cpp \
     PolygonObject.cpp \
     Position.cpp \
-    LineObject.cpp
+    LineObject.cpp \
+    guts/MapGraphicsMemoryGovernor.cpp \
+    guts/MapTilePixmapCache.cpp \
+    guts/MapTileResampler.cpp \
+    guts/MapGraphicsNetworkReply.cpp \
+    guts/MapGraphicsNetworkTransport.cpp \
+    guts/MapMetatileSplitter.cpp \
+    guts/MapTileDaemonProtocol.cpp \
+    tileSources/DaemonTileSource.cpp \
+    guts/MapTileBlender.cpp \
+    MapLayerFilter.cpp \
+    guts/MapGraphicsExecutor.cpp
 
 HEADERS += MapGraphicsScene.h\
         MapGraphics_global.h \
@@ -61,7 +72,18 @@ HEADERS += MapGraphicsScene.h\
     guts/PrivateQGraphicsInfoSource.h \
     PolygonObject.h \
     Position.h \
-    LineObject.h
+    LineObject.h \
+    guts/MapGraphicsMemoryGovernor.h \
+    guts/MapTilePixmapCache.h \
+    guts/MapTileResampler.h \
+    guts/MapGraphicsNetworkReply.h \
+    guts/MapGraphicsNetworkTransport.h \
+    guts/MapMetatileSplitter.h \
+    guts/MapTileDaemonProtocol.h \
+    tileSources/DaemonTileSource.h \
+    guts/MapTileBlender.h \
+    MapLayerFilter.h \
+    guts/MapGraphicsExecutor.h
 
 symbian {
     MMP_RULES += EXPORTUNFROZEN
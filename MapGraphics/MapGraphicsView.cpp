@@ -8,12 +8,14 @@
 #include <QSet>
 #include <QWheelEvent>
 #include <QCoreApplication>
-#include <QThread>
 #include <QMenu>
 
 #include "guts/PrivateQGraphicsScene.h"
 #include "guts/PrivateQGraphicsView.h"
 #include "guts/Conversions.h"
+#include "guts/MapGraphicsExecutor.h"
+#include "guts/MapGraphicsMemoryGovernor.h"
+#include "guts/MapTilePixmapCache.h"
 
 #include <functional>    // для std::hash
 #include <QPointF>
@@ -40,7 +42,7 @@ namespace std
 }
 
 MapGraphicsView::MapGraphicsView(MapGraphicsScene *scene, QWidget *parent) :
-    QWidget(parent)
+    QWidget(parent), _pixmapCache(new MapTilePixmapCache())
 {
     //Setup the given scene and set the default zoomLevel to 3
     this->setScene(scene);
@@ -56,11 +58,18 @@ MapGraphicsView::MapGraphicsView(MapGraphicsScene *scene, QWidget *parent) :
             this,
             SLOT(renderTiles()));
     renderTimer->start(200);
+
+    //Give back memory held by hidden tiles when asked to
+    connect(MapGraphicsMemoryGovernor::getInstance(),
+            SIGNAL(trimRequested(int,qreal)),
+            this,
+            SLOT(handleMemoryTrim(int,qreal)));
 }
 
 MapGraphicsView::~MapGraphicsView()
 {
     qDebug() << this << "Destructing";
+    MapGraphicsMemoryGovernor::getInstance()->removeOwner(this);
     //When we die, take all of our tile objects with us...
     foreach(MapTileGraphicsObject * tileObject, _tileObjects)
     {
@@ -70,10 +79,12 @@ MapGraphicsView::~MapGraphicsView()
     }
     _tileObjects.clear();
 
+    delete _pixmapCache;
+    _pixmapCache = 0;
+
     if (!_tileSource.isNull())
     {
-        //Find the tileSource's thread
-        QPointer<QThread> tileSourceThread = _tileSource->thread();
+        QPointer<QObject> tileSource = _tileSource.data();
 
         /*
          Clear the QSharedPointer to the tilesource. Unless there's a serious problem, we should be the
@@ -81,17 +92,10 @@ MapGraphicsView::~MapGraphicsView()
         */
         _tileSource.clear();
 
-        //After the tilesource is deleted, we wait for the thread it was running in to shut down
-        int count = 0;
-        const int maxCount = 100;
-        while (!tileSourceThread.isNull() && !tileSourceThread->wait(100))
-        {
-            //We have to process events while it's shutting down in case it uses signals/slots to shut down
-            //Hint: it does
-            QCoreApplication::processEvents(QEventLoop::ExcludeSocketNotifiers | QEventLoop::ExcludeUserInputEvents);
-            if (++count == maxCount)
-                break;
-        }
+        //Wait for the tilesource to be deleted in its host thread, which saves its caches.
+        //We have to process events while it's shutting down in case it uses signals/slots to shut down
+        //Hint: it does
+        MapGraphicsExecutor::getInstance()->waitUntilDestroyed(tileSource, 10000, true);
     }
 }
 
@@ -244,24 +248,26 @@ QSharedPointer<MapTileSource> MapGraphicsView::tileSource() const
 
 void MapGraphicsView::setTileSource(QSharedPointer<MapTileSource> tSource)
 {
+    if (!_tileSource.isNull())
+        QObject::disconnect(_tileSource.data(),
+                            SIGNAL(allTilesInvalidated()),
+                            this,
+                            SLOT(handleTileSourceInvalidation()));
+
     _tileSource = tSource;
 
+    //Tiles from the old source are no good as placeholders for the new one
+    _pixmapCache->clear();
+
     if (!_tileSource.isNull())
     {
-        //Create a thread just for the tile source
-        QThread * tileSourceThread = new QThread();
-        tileSourceThread->start();
-        _tileSource->moveToThread(tileSourceThread);
+        //The tile source shares a thread with other tile sources, and does its heavy lifting on the executor
+        MapGraphicsExecutor::getInstance()->hostSource(_tileSource.data());
 
-        //Set it up so that the thread is destroyed when the tile source is!
         connect(_tileSource.data(),
-                SIGNAL(destroyed()),
-                tileSourceThread,
-                SLOT(quit()));
-        connect(tileSourceThread,
-                SIGNAL(finished()),
-                tileSourceThread,
-                SLOT(deleteLater()));
+                SIGNAL(allTilesInvalidated()),
+                this,
+                SLOT(handleTileSourceInvalidation()));
     }
 
     //Update our tile displays (if any) about the new tile source
@@ -289,7 +295,7 @@ void MapGraphicsView::setZoomLevel(quint8 nZoom, ZoomMode zMode)
     const QPointF offset = mousePoint - centerPos;
 
     //Change the zoom level
-    nZoom = qMin(_tileSource->maxZoomLevel(),qMax(_tileSource->minZoomLevel(),nZoom));
+    nZoom = qMin(_tileSource->effectiveMaxZoomLevel(),qMax(_tileSource->minZoomLevel(),nZoom));
 
     if (nZoom == _zoomLevel)
         return;
@@ -314,6 +320,9 @@ void MapGraphicsView::setZoomLevel(quint8 nZoom, ZoomMode zMode)
     else
         this->centerOn(centerGeoPos);
 
+    //Lay the tiles out right away rather than waiting for the timer so placeholders show up immediately
+    this->doTileLayout();
+
     //Make MapGraphicsObjects update
     this->zoomLevelChanged(nZoom);
 }
@@ -323,7 +332,7 @@ void MapGraphicsView::zoomIn(ZoomMode zMode)
     if (_tileSource.isNull())
         return;
 
-    if (this->zoomLevel() < _tileSource->maxZoomLevel())
+    if (this->zoomLevel() < _tileSource->effectiveMaxZoomLevel())
         this->setZoomLevel(this->zoomLevel()+1,zMode);
 }
 
@@ -418,6 +427,30 @@ void MapGraphicsView::renderTiles()
 
     //Layout the tile objects
     this->doTileLayout();
+    this->reportTileMemoryUsage();
+}
+
+//private slot
+void MapGraphicsView::handleMemoryTrim(int category, qreal keepFraction)
+{
+    if (category != MapGraphicsMemoryGovernor::DisplayPixmaps)
+        return;
+
+    //Placeholders are a luxury. We can't do without the tiles we're showing, but hidden ones can go.
+    _pixmapCache->trim(keepFraction);
+    foreach(MapTileGraphicsObject * tileObject, _tileObjects)
+    {
+        if (!tileObject->isVisible())
+            tileObject->releaseTile();
+    }
+    this->reportTileMemoryUsage();
+}
+
+//private slot
+void MapGraphicsView::handleTileSourceInvalidation()
+{
+    //Cached pixmaps may no longer look like what the tile source produces
+    _pixmapCache->clear();
 }
 
 //protected
@@ -482,10 +515,15 @@ void MapGraphicsView::doTileLayout()
             if (tileIsThere)
                 continue;
 
+            //Regional sources have nothing for most of the world. Don't ask them for it.
+            if (!_tileSource->tileInCoverage(x,y,this->zoomLevel()))
+                continue;
+
             //Just in case we're running low on free tiles, add one
             if (freeTiles.isEmpty())
             {
                 MapTileGraphicsObject * tileObject = new MapTileGraphicsObject(tileSize);
+                tileObject->setPixmapCache(_pixmapCache);
                 tileObject->setTileSource(_tileSource);
                 _tileObjects.insert(tileObject);
                 _childScene->addItem(tileObject);
@@ -512,6 +550,18 @@ void MapGraphicsView::doTileLayout()
 
 }
 
+//protected
+void MapGraphicsView::reportTileMemoryUsage()
+{
+    qint64 bytes = _pixmapCache->bytes();
+    foreach(MapTileGraphicsObject * tileObject, _tileObjects)
+        bytes += tileObject->tileBytes();
+
+    MapGraphicsMemoryGovernor::getInstance()->reportUsage(this,
+                                                          MapGraphicsMemoryGovernor::DisplayPixmaps,
+                                                          bytes);
+}
+
 //protected
 void MapGraphicsView::resetQGSSceneSize()
 {
@@ -20,6 +20,8 @@
 #include "guts/MapTileGraphicsObject.h"
 #include "guts/PrivateQGraphicsInfoSource.h"
 
+class MapTilePixmapCache;
+
 class MAPGRAPHICSSHARED_EXPORT MapGraphicsView : public QWidget, public PrivateQGraphicsInfoSource
 {
     Q_OBJECT
@@ -89,11 +91,16 @@ protected slots:
 
 private slots:
     void renderTiles();
+    void handleMemoryTrim(int category, qreal keepFraction);
+    void handleTileSourceInvalidation();
 
 protected:
     void doTileLayout();
     void resetQGSSceneSize();
 
+    //Tells the MapGraphicsMemoryGovernor how much memory our tile pixmaps are using
+    void reportTileMemoryUsage();
+
 private:
     QPointer<MapGraphicsScene> _scene;
     QPointer<QGraphicsView> _childView;
@@ -102,6 +109,9 @@ private:
 
     QSet<MapTileGraphicsObject *> _tileObjects;
 
+    //Recently displayed tiles, used for placeholders while tiles load
+    MapTilePixmapCache * _pixmapCache;
+
     quint8 _zoomLevel;
 
     DragMode _dragMode;
@@ -0,0 +1,200 @@
+#include "MapLayerFilter.h"
+
+//Rec. 709 luma weights, for desaturating
+const qreal LUMA_RED = 0.2126;
+const qreal LUMA_GREEN = 0.7152;
+const qreal LUMA_BLUE = 0.0722;
+
+namespace
+{
+//A 3x4 affine colour transform: three weights and an offset per output channel
+struct Affine
+{
+    qreal m[12];
+};
+
+Affine identity()
+{
+    Affine toRet = {{1,0,0,0, 0,1,0,0, 0,0,1,0}};
+    return toRet;
+}
+
+//Returns the transform that applies first, then second
+Affine then(const Affine& first, const Affine& second)
+{
+    Affine toRet;
+    for (int row = 0; row < 3; row++)
+    {
+        for (int col = 0; col < 4; col++)
+        {
+            qreal value = (col == 3) ? second.m[row*4 + 3] : 0.0;
+            for (int k = 0; k < 3; k++)
+                value += second.m[row*4 + k] * first.m[k*4 + col];
+            toRet.m[row*4 + col] = value;
+        }
+    }
+    return toRet;
+}
+}
+
+MapLayerFilter::MapLayerFilter() :
+    _brightness(1.0), _contrast(1.0), _saturation(1.0), _inverted(false)
+{
+    this->updateMatrix();
+}
+
+bool MapLayerFilter::operator ==(const MapLayerFilter &other) const
+{
+    return _brightness == other._brightness
+            && _contrast == other._contrast
+            && _saturation == other._saturation
+            && _inverted == other._inverted
+            && _colorMatrix == other._colorMatrix;
+}
+
+bool MapLayerFilter::operator !=(const MapLayerFilter &other) const
+{
+    return !(*this == other);
+}
+
+bool MapLayerFilter::isIdentity() const
+{
+    const Affine unchanged = identity();
+    for (int i = 0; i < 12; i++)
+    {
+        if (_matrix[i] != (float)unchanged.m[i])
+            return false;
+    }
+    return true;
+}
+
+qreal MapLayerFilter::brightness() const
+{
+    return _brightness;
+}
+
+void MapLayerFilter::setBrightness(qreal brightness)
+{
+    _brightness = qMax<qreal>(0.0, brightness);
+    this->updateMatrix();
+}
+
+qreal MapLayerFilter::contrast() const
+{
+    return _contrast;
+}
+
+void MapLayerFilter::setContrast(qreal contrast)
+{
+    _contrast = qMax<qreal>(0.0, contrast);
+    this->updateMatrix();
+}
+
+qreal MapLayerFilter::saturation() const
+{
+    return _saturation;
+}
+
+void MapLayerFilter::setSaturation(qreal saturation)
+{
+    _saturation = qMax<qreal>(0.0, saturation);
+    this->updateMatrix();
+}
+
+bool MapLayerFilter::inverted() const
+{
+    return _inverted;
+}
+
+void MapLayerFilter::setInverted(bool inverted)
+{
+    _inverted = inverted;
+    this->updateMatrix();
+}
+
+QList<qreal> MapLayerFilter::colorMatrix() const
+{
+    return _colorMatrix;
+}
+
+void MapLayerFilter::setColorMatrix(const QList<qreal> &matrix)
+{
+    if (matrix.size() == 12)
+        _colorMatrix = matrix;
+    else
+        _colorMatrix.clear();
+    this->updateMatrix();
+}
+
+const float *MapLayerFilter::matrix() const
+{
+    return _matrix;
+}
+
+//static
+MapLayerFilter MapLayerFilter::nightMode()
+{
+    MapLayerFilter toRet;
+    toRet.setSaturation(0.2);
+    toRet.setContrast(0.8);
+    toRet.setBrightness(0.45);
+    return toRet;
+}
+
+//private
+void MapLayerFilter::updateMatrix()
+{
+    Affine combined = identity();
+
+    if (_colorMatrix.size() == 12)
+    {
+        for (int i = 0; i < 12; i++)
+            combined.m[i] = _colorMatrix.at(i);
+    }
+
+    if (_saturation != 1.0)
+    {
+        const qreal s = _saturation;
+        const qreal luma[3] = {LUMA_RED, LUMA_GREEN, LUMA_BLUE};
+        Affine saturate = identity();
+        for (int row = 0; row < 3; row++)
+        {
+            for (int col = 0; col < 3; col++)
+                saturate.m[row*4 + col] = (1.0 - s) * luma[col] + (row == col ? s : 0.0);
+        }
+        combined = then(combined, saturate);
+    }
+
+    if (_contrast != 1.0)
+    {
+        Affine contrast = identity();
+        for (int row = 0; row < 3; row++)
+        {
+            contrast.m[row*4 + row] = _contrast;
+            contrast.m[row*4 + 3] = 0.5 * (1.0 - _contrast);
+        }
+        combined = then(combined, contrast);
+    }
+
+    if (_brightness != 1.0)
+    {
+        Affine brightness = identity();
+        for (int row = 0; row < 3; row++)
+            brightness.m[row*4 + row] = _brightness;
+        combined = then(combined, brightness);
+    }
+
+    if (_inverted)
+    {
+        Affine invert = identity();
+        for (int row = 0; row < 3; row++)
+        {
+            invert.m[row*4 + row] = -1.0;
+            invert.m[row*4 + 3] = 1.0;
+        }
+        combined = then(combined, invert);
+    }
+
+    for (int i = 0; i < 12; i++)
+        _matrix[i] = (float)combined.m[i];
+}
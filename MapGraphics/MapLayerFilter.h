@@ -0,0 +1,89 @@
+#ifndef MAPLAYERFILTER_H
+#define MAPLAYERFILTER_H
+
+#include <QList>
+
+#include "MapGraphics_global.h"
+
+/**
+ * @brief A colour transform for one layer of a CompositeTileSource, e.g. to dim and desaturate a basemap
+ * for night use. It's applied while the layer is blended, so changing it doesn't fetch anything again.
+ *
+ * The adjustments are applied in this order: colour matrix, saturation, contrast, brightness, invert.
+ * Alpha is never changed. A default-constructed filter changes nothing.
+ */
+class MAPGRAPHICSSHARED_EXPORT MapLayerFilter
+{
+public:
+    MapLayerFilter();
+
+    bool operator ==(const MapLayerFilter& other) const;
+    bool operator !=(const MapLayerFilter& other) const;
+
+    /**
+     * @brief Returns true if the filter leaves colours as they are
+     *
+     * @return bool
+     */
+    bool isIdentity() const;
+
+    //Multiplies every channel. 1.0 (the default) is unchanged, 0.0 is black.
+    qreal brightness() const;
+    void setBrightness(qreal brightness);
+
+    //Scales every channel away from (or towards) mid-grey. 1.0 (the default) is unchanged.
+    qreal contrast() const;
+    void setContrast(qreal contrast);
+
+    //1.0 (the default) is unchanged, 0.0 is grayscale and more than 1.0 is more colourful
+    qreal saturation() const;
+    void setSaturation(qreal saturation);
+
+    bool inverted() const;
+    void setInverted(bool inverted);
+
+    /**
+     * @brief Returns the custom colour matrix, or an empty list if there is none
+     *
+     * @return QList<qreal>
+     */
+    QList<qreal> colorMatrix() const;
+
+    /**
+     * @brief Sets a custom colour matrix, applied before the other adjustments. It has three rows (red,
+     * green, blue) of four values each, in row-major order: the weights of the red, green and blue inputs,
+     * then an offset from 0.0 to 1.0. Anything that isn't 12 values removes the custom matrix.
+     *
+     * @param matrix
+     */
+    void setColorMatrix(const QList<qreal>& matrix);
+
+    /**
+     * @brief Returns everything above as one 3x4 matrix in the same layout as colorMatrix(), which is what
+     * MapTileBlender applies
+     *
+     * @return const float *
+     */
+    const float * matrix() const;
+
+    /**
+     * @brief A dimmed, mostly gray filter meant for basemaps on consoles used at night
+     *
+     * @return MapLayerFilter
+     */
+    static MapLayerFilter nightMode();
+
+private:
+    //Combines the adjustments into _matrix
+    void updateMatrix();
+
+    qreal _brightness;
+    qreal _contrast;
+    qreal _saturation;
+    bool _inverted;
+    QList<qreal> _colorMatrix;
+
+    float _matrix[12];
+};
+
+#endif // MAPLAYERFILTER_H
@@ -1,19 +1,43 @@
 #include "MapTileSource.h"
 
+#include "guts/MapGraphicsMemoryGovernor.h"
+#include "guts/MapTileResampler.h"
+#include "guts/MapMetatileSplitter.h"
+#include "guts/MapTileBlender.h"
+#include "guts/MapGraphicsExecutor.h"
+
 #include <QStringBuilder>
 #include <QMutexLocker>
 #include <QtDebug>
 #include <QStringList>
 #include <QDataStream>
+#include <QTimer>
+#include <QLockFile>
+#include <QSaveFile>
+#include <algorithm>
 
 const QString MAPGRAPHICS_CACHE_FOLDER_NAME = ".MapGraphicsCache";
 const quint32 DEFAULT_CACHE_DAYS = 7;
 const quint64 MAX_DISK_CACHE_READ_ATTEMPTS = 100000;
+const int DEFAULT_WARM_START_TILES = 256;
+//How many tiles are preloaded per event loop iteration so regular requests aren't starved
+const int HOT_TILE_PRELOAD_BATCH = 8;
+//The hot tile file starts with this (and a version) so we can tell it from the old plain list of cacheIDs
+const quint32 HOT_TILES_MAGIC = 0x484F5454;
+const quint32 HOT_TILES_VERSION = 2;
+//Memory cache capacity in KiB. Enough for 100 256x256 32-bit tiles.
+const int DEFAULT_MEMORY_CACHE_KB = 100 * 256;
+//How long we wait for other applications to finish saving the cache expiration database
+const int CACHE_EXPIRATIONS_LOCK_MSECS = 5000;
 
 MapTileSource::MapTileSource() :
-    QObject(), _cacheExpirationsLoaded(false)
+    QObject(), _cacheExpirationsLoaded(false), _warmStartEnabled(false),
+    _warmStartTileCount(DEFAULT_WARM_START_TILES), _hotTilePreloadBudgetKB(0),
+    _maxOverzoomLevel(0), _underzoomMode(NoUnderzoom), _offline(false), _metatileSize(0), _workerJobs(new WorkerJobs()),
+    _serialQueue(new MapGraphicsSerialQueue())
 {
     this->setCacheMode(DiskAndMemCaching);
+    _memoryCache.setMaxCost(DEFAULT_MEMORY_CACHE_KB);
 
     //We connect this signal/slot pair to communicate across threads.
     connect(this,
@@ -21,6 +45,11 @@ MapTileSource::MapTileSource() :
             this,
             SLOT(startTileRequest(quint32,quint32,quint8)),
             Qt::QueuedConnection);
+    connect(this,
+            SIGNAL(hotTilePreloadRequested(QPointF,quint8)),
+            this,
+            SLOT(startHotTilePreload(QPointF,quint8)),
+            Qt::QueuedConnection);
 
     /*
       When all our tiles have been invalidated, we clear our temp cache so any misinformed clients
@@ -30,26 +59,48 @@ MapTileSource::MapTileSource() :
             SIGNAL(allTilesInvalidated()),
             this,
             SLOT(clearTempCache()));
+
+    //Give back memory when we're asked to
+    connect(MapGraphicsMemoryGovernor::getInstance(),
+            SIGNAL(trimRequested(int,qreal)),
+            this,
+            SLOT(handleMemoryTrim(int,qreal)));
 }
 
 MapTileSource::~MapTileSource()
 {
+    //Worker jobs post their results back to us, so wait for them to be done with us
+    QMutexLocker jobsLocker(&_workerJobs->mutex);
+    while (_workerJobs->active > 0)
+        _workerJobs->finished.wait(&_workerJobs->mutex);
+    jobsLocker.unlock();
+    delete _serialQueue;
+
+    MapGraphicsMemoryGovernor::getInstance()->removeOwner(this);
+    this->saveHotTilesToDisk();
     this->saveCacheExpirationsToDisk();
 }
 
 void MapTileSource::requestTile(quint32 x, quint32 y, quint8 z)
 {
-    /*We emit a signal to communicate across threads. MapTileSource (usually) runs in its own
-      thread, but this method will be called from a different thread (probably the GUI thread).
-      It's easy to communicate across threads with queued signals/slots.
+    /*We emit a signal to communicate across threads. MapTileSource (usually) runs in a host thread
+      shared with other sources, but this method will be called from a different thread (probably the
+      GUI thread). It's easy to communicate across threads with queued signals/slots.
     */
     this->tileRequested(x,y,z);
 }
 
-QImage *MapTileSource::getFinishedTile(quint32 x, quint32 y, quint8 z)
+QImage *MapTileSource::getFinishedTile(quint32 x, quint32 y, quint8 z, quint32 *version, bool *provisional)
 {
     const QString cacheID = MapTileSource::createCacheID(x,y,z);
     QMutexLocker lock(&_tempCacheLock);
+    const quint32 tileVersion = _tempCacheVersions.take(cacheID);
+    const bool tileProvisional = _tempCacheProvisional.remove(cacheID);
+    if (version != 0)
+        *version = tileVersion;
+    if (provisional != 0)
+        *provisional = tileProvisional;
+
     if (!_tempCache.contains(cacheID))
     {
         qWarning() << "getFinishedTile() called, but the tile is not present";
@@ -68,9 +119,148 @@ void MapTileSource::setCacheMode(MapTileSource::CacheMode nMode)
     _cacheMode = nMode;
 }
 
+bool MapTileSource::warmStartEnabled() const
+{
+    return _warmStartEnabled;
+}
+
+void MapTileSource::setWarmStartEnabled(bool enabled)
+{
+    _warmStartEnabled = enabled;
+}
+
+int MapTileSource::warmStartTileCount() const
+{
+    return _warmStartTileCount;
+}
+
+void MapTileSource::setWarmStartTileCount(int count)
+{
+    _warmStartTileCount = qMax<int>(0, count);
+}
+
+void MapTileSource::preloadHotTiles(const QPointF &centerLL, quint8 zoomLevel)
+{
+    if (!this->warmStartEnabled())
+        return;
+
+    //Like requestTile(), we use a queued signal so the work happens in the MapTileSource's thread
+    this->hotTilePreloadRequested(centerLL, zoomLevel);
+}
+
+quint8 MapTileSource::maxOverzoomLevel() const
+{
+    return (quint8)_maxOverzoomLevel.loadAcquire();
+}
+
+void MapTileSource::setMaxOverzoomLevel(quint8 zoomLevel)
+{
+    _maxOverzoomLevel.storeRelease(zoomLevel);
+}
+
+quint8 MapTileSource::effectiveMaxZoomLevel(QPointF ll)
+{
+    return qMax<quint8>(this->maxZoomLevel(ll), this->maxOverzoomLevel());
+}
+
+MapTileSource::UnderzoomMode MapTileSource::underzoomMode() const
+{
+    return _underzoomMode;
+}
+
+void MapTileSource::setUnderzoomMode(MapTileSource::UnderzoomMode mode)
+{
+    _underzoomMode = mode;
+}
+
+bool MapTileSource::isOffline() const
+{
+    return _offline;
+}
+
+void MapTileSource::setOffline(bool offline)
+{
+    _offline = offline;
+}
+
+int MapTileSource::metatileSize() const
+{
+    return _metatileSize;
+}
+
+void MapTileSource::setMetatileSize(int size)
+{
+    _metatileSize = (size > 1) ? size : 0;
+}
+
+void MapTileSource::addCoverage(const QPolygonF &polygonLL, quint8 minZoom, quint8 maxZoom)
+{
+    if (polygonLL.size() < 3 || minZoom > maxZoom)
+        return;
+
+    CoverageArea area;
+    area.polygon = polygonLL;
+    area.bounds = polygonLL.boundingRect();
+    area.minZoom = minZoom;
+    area.maxZoom = maxZoom;
+
+    QMutexLocker lock(&_coverageMutex);
+    _coverage.append(area);
+    lock.unlock();
+
+    //Tiles that used to be outside our coverage may not be any more
+    this->allTilesInvalidated();
+}
+
+void MapTileSource::addCoverage(const QRectF &boundsLL, quint8 minZoom, quint8 maxZoom)
+{
+    this->addCoverage(QPolygonF(boundsLL.normalized()), minZoom, maxZoom);
+}
+
+void MapTileSource::clearCoverage()
+{
+    QMutexLocker lock(&_coverageMutex);
+    _coverage.clear();
+    lock.unlock();
+
+    this->allTilesInvalidated();
+}
+
+bool MapTileSource::hasCoverage() const
+{
+    QMutexLocker lock(&_coverageMutex);
+    return !_coverage.isEmpty();
+}
+
+bool MapTileSource::tileInCoverage(quint32 x, quint32 y, quint8 z) const
+{
+    QMutexLocker lock(&_coverageMutex);
+    if (_coverage.isEmpty())
+        return true;
+
+    //The tile's corners in geo coordinates. North is up, so the top edge has the larger latitude.
+    const qreal tileSize = this->tileSize();
+    const QPointF topLeft = this->qgs2ll(QPointF(x * tileSize, y * tileSize), z);
+    const QPointF bottomRight = this->qgs2ll(QPointF((x + 1) * tileSize, (y + 1) * tileSize), z);
+    const QRectF tileLL = QRectF(topLeft, bottomRight).normalized();
+
+    foreach(const CoverageArea& area, _coverage)
+    {
+        if (z < area.minZoom || z > area.maxZoom || !area.bounds.intersects(tileLL))
+            continue;
+        if (area.polygon.intersects(QPolygonF(tileLL)))
+            return true;
+    }
+    return false;
+}
+
 //private slot
 void MapTileSource::startTileRequest(quint32 x, quint32 y, quint8 z)
 {
+    //Keep track of which tiles are popular so we can preload them next time
+    if (this->warmStartEnabled())
+        _tileHits[MapTileSource::createCacheID(x,y,z)]++;
+
     //Check caches for the tile first
     if (this->cacheMode() == DiskAndMemCaching)
     {
@@ -87,14 +277,150 @@ void MapTileSource::startTileRequest(quint32 x, quint32 y, quint8 z)
         }
     }
 
-    //If we get here, the tile was not cached and we must try to retrieve it
-    this->fetchTile(x,y,z);
+    //If we get here, the tile was not cached and we must try to retrieve it (or make it ourselves)
+    if (z > this->maxZoomLevel() && z <= this->maxOverzoomLevel())
+    {
+        this->startOverzoomRequest(x,y,z);
+        return;
+    }
+
+    //Maybe we can build it from its children, either instead of fetching it or while we fetch it
+    const UnderzoomMode underzoom = this->underzoomMode();
+    if (underzoom == UnderzoomFirstResponse
+            || (underzoom == UnderzoomWhenOffline && this->isOffline()))
+    {
+        if (this->startUnderzoomSynthesis(x,y,z) && underzoom == UnderzoomWhenOffline)
+            return;
+    }
+
+    this->startFetch(x,y,z);
 }
 
 //private slot
 void MapTileSource::clearTempCache()
 {
+    QMutexLocker lock(&_tempCacheLock);
     _tempCache.clear();
+    _tempCacheVersions.clear();
+    _tempCacheProvisional.clear();
+    _tileVersions.clear();
+}
+
+//protected slot
+void MapTileSource::handleMemoryTrim(int category, qreal keepFraction)
+{
+    if (category != MapGraphicsMemoryGovernor::TileMemoryCache)
+        return;
+
+    //Shrinking maxCost makes QCache evict its least-recently-used tiles
+    const int maxCost = _memoryCache.maxCost();
+    _memoryCache.setMaxCost((int)(_memoryCache.totalCost() * qBound<qreal>(0.0, keepFraction, 1.0)));
+    _memoryCache.setMaxCost(maxCost);
+
+    this->reportMemoryUsage();
+}
+
+//private slot
+void MapTileSource::startHotTilePreload(QPointF centerLL, quint8 zoomLevel)
+{
+    if (this->cacheMode() != DiskAndMemCaching)
+        return;
+
+    //Make sure we know where the snapshot lives
+    this->loadCacheExpirationsFromDisk();
+
+    const QHash<QString, quint32> hotTiles = this->loadHotTilesFromDisk();
+    if (hotTiles.isEmpty())
+        return;
+
+    //Figure out which tile the view will be centered on
+    const qreal tileSize = this->tileSize();
+    const QPointF centerQGS = this->ll2qgs(centerLL, zoomLevel);
+    const qint64 centerX = centerQGS.x() / tileSize;
+    const qint64 centerY = centerQGS.y() / tileSize;
+
+    /*
+      Viewport-first ordering: tiles on the requested zoom level sorted by distance from the center tile,
+      then the other zoom levels, nearest zoom level first. Tiles on other zoom levels are compared by
+      the distance of their center tile at that zoom level.
+    */
+    QList<QPair<quint64, QString> > ordered;
+    foreach(const QString& cacheID, hotTiles.keys())
+    {
+        quint32 x,y,z;
+        if (!MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
+            continue;
+
+        const int zoomDistance = qAbs((int)z - (int)zoomLevel);
+        qint64 zCenterX = centerX;
+        qint64 zCenterY = centerY;
+        if (z > zoomLevel)
+        {
+            zCenterX <<= (z - zoomLevel);
+            zCenterY <<= (z - zoomLevel);
+        }
+        else
+        {
+            zCenterX >>= (zoomLevel - z);
+            zCenterY >>= (zoomLevel - z);
+        }
+        const quint64 tileDistance = qMax(qAbs((qint64)x - zCenterX), qAbs((qint64)y - zCenterY));
+        const quint64 sortKey = ((quint64)zoomDistance << 48) | qMin<quint64>(tileDistance, 0xFFFFFFFFFFFFULL);
+        ordered.append(QPair<quint64, QString>(sortKey, cacheID));
+    }
+    //Equally close tiles go most-requested first
+    std::sort(ordered.begin(), ordered.end(),
+              [&hotTiles](const QPair<quint64, QString>& a, const QPair<quint64, QString>& b)
+    {
+        if (a.first != b.first)
+            return a.first < b.first;
+        return hotTiles.value(a.second) > hotTiles.value(b.second);
+    });
+
+    _hotTilePreloadQueue.clear();
+    for (int i = 0; i < ordered.size(); i++)
+        _hotTilePreloadQueue.append(ordered.at(i).second);
+
+    /*
+      The memory cache throws out the least recently used tiles first, so preloading more than fits would
+      have the far tiles push out the viewport tiles we loaded first. We stop when it's full.
+    */
+    _hotTilePreloadBudgetKB = _memoryCache.maxCost() - _memoryCache.totalCost();
+
+    this->continueHotTilePreload();
+}
+
+//private slot
+void MapTileSource::continueHotTilePreload()
+{
+    int loaded = 0;
+    while (!_hotTilePreloadQueue.isEmpty() && loaded < HOT_TILE_PRELOAD_BATCH)
+    {
+        const QString cacheID = _hotTilePreloadQueue.takeFirst();
+        if (_memoryCache.contains(cacheID))
+            continue;
+
+        QImage * image = this->fromDiskCache(cacheID);
+        if (!image)
+            continue;
+
+        const int costKB = qMax<int>(1, image->sizeInBytes() / 1024);
+        if (costKB > _hotTilePreloadBudgetKB)
+        {
+            delete image;
+            _hotTilePreloadQueue.clear();
+            break;
+        }
+        _hotTilePreloadBudgetKB -= costKB;
+
+        this->toMemCache(cacheID, image, this->getTileExpirationTime(cacheID));
+        delete image;
+        loaded++;
+    }
+
+    //Yield to the event loop between batches so real tile requests are handled in between
+    if (!_hotTilePreloadQueue.isEmpty())
+        QTimer::singleShot(0, this, SLOT(continueHotTilePreload()));
 }
 
 //protected static
@@ -139,6 +465,7 @@ QImage *MapTileSource::fromMemCache(const QString &cacheID)
         if (QDateTime::currentDateTimeUtc().secsTo(expireTime) <= 0)
         {
             _memoryCache.remove(cacheID);
+            this->reportMemoryUsage();
         }
         //Otherwise, make a copy of the cached tile and return it to the caller
         else
@@ -163,21 +490,31 @@ void MapTileSource::toMemCache(const QString &cacheID, QImage *toCache, const QD
 
     //Make a copy of the QImage
     QImage * copy = new QImage(*toCache);
-    _memoryCache.insert(cacheID,copy);
+    const int costKB = qMax<int>(1, copy->sizeInBytes() / 1024);
+    _memoryCache.insert(cacheID,copy,costKB);
+    this->reportMemoryUsage();
 }
 
 QImage *MapTileSource::fromDiskCache(const QString &cacheID)
+{
+    const QString path = this->freshDiskCacheFile(cacheID);
+    if (path.isEmpty())
+        return 0;
+    return MapTileSource::readDiskCacheFile(path);
+}
+
+//private
+QString MapTileSource::freshDiskCacheFile(const QString &cacheID)
 {
     //Figure out x,y,z based on the cacheID
     quint32 x,y,z;
     if (!MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
-        return 0;
+        return QString();
 
     //See if we've got it in the cache
     const QString path = this->getDiskCacheFile(x,y,z);
-    QFile fp(path);
-    if (!fp.exists())
-        return 0;
+    if (!QFile::exists(path))
+        return QString();
 
     //Figure out when the tile we're loading from cache was supposed to expire
     QDateTime expireTime = this->getTileExpirationTime(cacheID);
@@ -187,9 +524,16 @@ QImage *MapTileSource::fromDiskCache(const QString &cacheID)
     {
         if (!QFile::remove(path))
             qWarning() << "Failed to remove old cache file" << path;
-        return 0;
+        return QString();
     }
 
+    return path;
+}
+
+//private static
+QImage *MapTileSource::readDiskCacheFile(const QString &path)
+{
+    QFile fp(path);
     if (!fp.open(QFile::ReadOnly))
     {
         qWarning() << "Failed to open" << QFileInfo(fp.fileName()).baseName() << "from cache";
@@ -214,6 +558,7 @@ QImage *MapTileSource::fromDiskCache(const QString &cacheID)
         delete image;
         return 0;
     }
+    MapTileBlender::detectOpaque(image);
 
     return image;
 }
@@ -236,27 +581,61 @@ void MapTileSource::toDiskCache(const QString &cacheID, QImage *toCache, const Q
     //Note when the tile will expire
     this->setTileExpirationTime(cacheID, expireTime);
 
-    //Auto-detect file format
-    const char * format = 0;
-
-    //No compression for lossy file types!
-    const int quality = 100;
+    /*
+      Encoding and writing happen on our serial queue, in the order tiles were cached. The image is a shallow
+      copy, and QSaveFile makes sure fromDiskCache() never sees a half-written file.
+    */
+    const QImage image = *toCache;
+    const QString name = this->name();
+    const std::shared_ptr<WorkerJobs> jobs = this->startWorkerJob();
+    _serialQueue->run([this, jobs, filePath, image, name, x, y, z]()
+    {
+        //An earlier write may have beaten us to it
+        if (!QFile::exists(filePath))
+        {
+            //Format from the file extension. No compression for lossy file types!
+            const QByteArray format = QFileInfo(filePath).suffix().toLatin1();
+            const int quality = 100;
 
-    //Try to write the data
-    if (!toCache->save(filePath,format,quality))
-        qWarning() << "Failed to put" << this->name() << x << y << z << "into disk cache";
+            QSaveFile fp(filePath);
+            if (!fp.open(QIODevice::WriteOnly)
+                    || !image.save(&fp, format.isEmpty() ? 0 : format.constData(), quality)
+                    || !fp.commit())
+                qWarning() << "Failed to put" << name << x << y << z << "into disk cache";
+        }
+        MapTileSource::finishWorkerJob(jobs);
+    });
 }
 
-void MapTileSource::prepareRetrievedTile(quint32 x, quint32 y, quint8 z, QImage *image)
+void MapTileSource::prepareRetrievedTile(quint32 x, quint32 y, quint8 z, QImage *image, bool provisional)
 {
     //Do tile sanity check here optionally
     if (image == 0)
         return;
 
+    //If overzoomed tiles are waiting on this one, make them now
+    const QString cacheID = MapTileSource::createCacheID(x,y,z);
+    if (_overzoomWaiting.contains(cacheID))
+        this->startOverzoomResampling(cacheID, *image);
+
     //Put it into the "temporary retrieval cache" so the user can grab it
     QMutexLocker lock(&_tempCacheLock);
-    _tempCache.insert(MapTileSource::createCacheID(x,y,z),
+    _tempCache.insert(cacheID,
                       image);
+
+    //Every delivery of a tile gets a new version until the final one, after which we start over
+    const quint32 version = _tileVersions.value(cacheID, 0) + 1;
+    if (provisional)
+    {
+        _tileVersions.insert(cacheID, version);
+        _tempCacheProvisional.insert(cacheID);
+    }
+    else
+    {
+        _tileVersions.remove(cacheID);
+        _tempCacheProvisional.remove(cacheID);
+    }
+    _tempCacheVersions.insert(cacheID, version);
     /*
       We must explicitly unlock the mutex before emitting tileRetrieved in case
       we're running in the GUI thread (since the signal can trigger
@@ -272,6 +651,9 @@ void MapTileSource::prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, QIm
 {
     //Insert into caches when applicable
     const QString cacheID = MapTileSource::createCacheID(x,y,z);
+
+    //The real thing has arrived, so any tile still being synthesized for this spot is obsolete
+    _provisionalTiles.remove(cacheID);
     if (this->cacheMode() == DiskAndMemCaching)
     {
         this->toMemCache(cacheID, image, expireTime);
@@ -282,6 +664,129 @@ void MapTileSource::prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, QIm
     this->prepareRetrievedTile(x, y, z, image);
 }
 
+void MapTileSource::prepareProvisionalTile(quint32 x, quint32 y, quint8 z, QImage *image)
+{
+    this->prepareRetrievedTile(x, y, z, image, true);
+}
+
+void MapTileSource::prepareNewlyReceivedTileData(quint32 x, quint32 y, quint8 z, const QByteArray &data, QDateTime expireTime)
+{
+    const std::shared_ptr<WorkerJobs> jobs = this->startWorkerJob();
+    MapGraphicsExecutor::getInstance()->run([this, jobs, x, y, z, data, expireTime]()
+    {
+        QImage tile;
+        if (tile.loadFromData(data))
+        {
+            //Composites can skip whatever is underneath an opaque tile
+            MapTileBlender::detectOpaque(&tile);
+
+            QMetaObject::invokeMethod(this, [this, x, y, z, tile, expireTime]()
+            {
+                this->prepareNewlyReceivedTile(x, y, z, new QImage(tile), expireTime);
+            }, Qt::QueuedConnection);
+        }
+        else
+        {
+            //Whatever is waiting on the tile in our thread has to be told it isn't coming
+            qWarning() << "Failed to make QImage from tile data" << x << y << z;
+            QMetaObject::invokeMethod(this, [this, x, y, z]()
+            {
+                this->abandonTile(x, y, z);
+            }, Qt::QueuedConnection);
+        }
+        MapTileSource::finishWorkerJob(jobs);
+    });
+}
+
+void MapTileSource::prepareNewlyReceivedMetatile(quint32 x, quint32 y, quint8 z, const QByteArray &data, QDateTime expireTime)
+{
+    const QString metatileID = MapTileSource::createCacheID(x,y,z);
+    const int size = qMax<int>(1, this->metatileSize());
+    const quint16 tileSize = this->tileSize();
+
+    const std::shared_ptr<WorkerJobs> jobs = this->startWorkerJob();
+    MapGraphicsExecutor::getInstance()->run([this, jobs, metatileID, x, y, z, size, tileSize, data, expireTime]()
+    {
+        QList<MapMetatileSplitter::Tile> tiles;
+        if (!MapMetatileSplitter::split(data, x, y, z, size, tileSize, &tiles))
+            qWarning() << "Failed to split metatile" << metatileID;
+
+        //Back in our own thread, cache the tiles and hand out the ones somebody asked for
+        QMetaObject::invokeMethod(this, [this, metatileID, z, tiles, expireTime]()
+        {
+            QSet<QString> waiting = _metatileWaiting.take(metatileID);
+            foreach(const MapMetatileSplitter::Tile& tile, tiles)
+            {
+                const QString cacheID = MapTileSource::createCacheID(tile.x, tile.y, z);
+                if (waiting.remove(cacheID))
+                {
+                    this->prepareNewlyReceivedTile(tile.x, tile.y, z, new QImage(tile.image), expireTime);
+                    continue;
+                }
+
+                /*
+                  Nobody asked for this one (yet). Putting it in the memory cache or the temp cache would
+                  only push out tiles that are actually in use, so it goes to disk.
+                */
+                if (this->cacheMode() == DiskAndMemCaching)
+                {
+                    QImage image = tile.image;
+                    this->toDiskCache(cacheID, &image, expireTime);
+                }
+            }
+
+            //The split failed, or the metatile didn't have them
+            foreach(const QString& cacheID, waiting)
+            {
+                quint32 tileX, tileY, tileZ;
+                if (MapTileSource::cacheID2xyz(cacheID, &tileX, &tileY, &tileZ))
+                    this->abandonTile(tileX, tileY, tileZ);
+            }
+        }, Qt::QueuedConnection);
+        MapTileSource::finishWorkerJob(jobs);
+    });
+}
+
+void MapTileSource::abandonMetatile(quint32 x, quint32 y, quint8 z)
+{
+    const QSet<QString> waiting = _metatileWaiting.take(MapTileSource::createCacheID(x,y,z));
+    foreach(const QString& cacheID, waiting)
+    {
+        quint32 tileX, tileY, tileZ;
+        if (MapTileSource::cacheID2xyz(cacheID, &tileX, &tileY, &tileZ))
+            this->abandonTile(tileX, tileY, tileZ);
+    }
+}
+
+void MapTileSource::abandonTile(quint32 x, quint32 y, quint8 z)
+{
+    //Overzoomed tiles waiting on this one won't be getting it. They're requested again when next shown.
+    const QString cacheID = MapTileSource::createCacheID(x,y,z);
+    _overzoomWaiting.remove(cacheID);
+
+    //Nor will anyone who got a provisional version of it
+    QMutexLocker lock(&_tempCacheLock);
+    _tileVersions.remove(cacheID);
+    lock.unlock();
+
+    this->tileRetrievalFailed(x,y,z);
+}
+
+//protected
+void MapTileSource::fetchMetatile(quint32 x, quint32 y, quint8 z, int size)
+{
+    Q_UNUSED(size)
+
+    //We don't know how to fetch a metatile, so fetch whatever was requested from it tile by tile
+    const QSet<QString> waiting = _metatileWaiting.take(MapTileSource::createCacheID(x,y,z));
+    foreach(const QString& cacheID, waiting)
+    {
+        quint32 tileX, tileY, tileZ;
+        if (MapTileSource::cacheID2xyz(cacheID, &tileX, &tileY, &tileZ))
+            this->fetchTile(tileX, tileY, tileZ);
+    }
+}
+
 //protected
 QDateTime MapTileSource::getTileExpirationTime(const QString &cacheID)
 {
@@ -349,6 +854,7 @@ void MapTileSource::loadCacheExpirationsFromDisk()
     QDir dir = this->getDiskCacheDirectory(0,0,0);
     QString path = dir.absolutePath() % "/" % "cacheExpirations.db";
     _cacheExpirationsFile = path;
+    _hotTilesFile = dir.absolutePath() % "/" % "hotTiles.db";
 
     QFile fp(path);
     if (!fp.exists())
@@ -369,15 +875,326 @@ void MapTileSource::saveCacheExpirationsToDisk()
     if (!_cacheExpirationsLoaded || _cacheExpirationsFile.isEmpty())
         return;
 
-    QFile fp(_cacheExpirationsFile);
+    //Other applications using the same cache may be saving at the same time
+    QLockFile lock(_cacheExpirationsFile % ".lock");
+    if (!lock.tryLock(CACHE_EXPIRATIONS_LOCK_MSECS))
+    {
+        qWarning() << "Failed to lock cache expiration file:" << _cacheExpirationsFile;
+        return;
+    }
+
+    /*
+      They may also have saved since we loaded, so merge what's on disk now with what we know instead of
+      clobbering it. Where we disagree, the later expiration is the one from the more recent download.
+    */
+    QHash<QString, QDateTime> merged;
+    QFile existing(_cacheExpirationsFile);
+    if (existing.exists() && existing.open(QIODevice::ReadOnly))
+    {
+        QDataStream stream(&existing);
+        stream >> merged;
+        if (stream.status() != QDataStream::Ok)
+            merged.clear();
+        existing.close();
+    }
+
+    QHash<QString, QDateTime>::const_iterator iter;
+    for (iter = _cacheExpirations.constBegin(); iter != _cacheExpirations.constEnd(); iter++)
+    {
+        if (!merged.contains(iter.key()) || merged.value(iter.key()) < iter.value())
+            merged.insert(iter.key(), iter.value());
+    }
 
-    if (!fp.open(QIODevice::Truncate | QIODevice::WriteOnly))
+    //Write to a temporary file and rename it so nobody ever reads half a database
+    QSaveFile fp(_cacheExpirationsFile);
+    if (!fp.open(QIODevice::WriteOnly))
     {
         qWarning() << "Failed to open cache expiration file for writing:" << fp.errorString();
         return;
     }
 
     QDataStream stream(&fp);
-    stream << _cacheExpirations;
+    stream << merged;
+    if (!fp.commit())
+    {
+        qWarning() << "Failed to write cache expiration file:" << fp.errorString();
+        return;
+    }
     qDebug() << "Cache expirations saved to" << _cacheExpirationsFile;
 }
+
+//private
+void MapTileSource::reportMemoryUsage()
+{
+    MapGraphicsMemoryGovernor::getInstance()->reportUsage(this,
+                                                          MapGraphicsMemoryGovernor::TileMemoryCache,
+                                                          (qint64)_memoryCache.totalCost() * 1024);
+}
+
+//private
+void MapTileSource::startOverzoomRequest(quint32 x, quint32 y, quint8 z)
+{
+    //Find the deepest real ancestor
+    const quint8 nativeZoom = this->maxZoomLevel();
+    const int levels = z - nativeZoom;
+    const quint32 ancestorX = x >> levels;
+    const quint32 ancestorY = y >> levels;
+    const QString ancestorCacheID = MapTileSource::createCacheID(ancestorX, ancestorY, nativeZoom);
+
+    //Get in line for the ancestor
+    _overzoomWaiting[ancestorCacheID].insert(MapTileSource::createCacheID(x,y,z));
+
+    /*
+      Request the ancestor like any other tile. It may come from our caches right away or from
+      fetchTile() later, but either way it comes through prepareRetrievedTile(), which does the rest.
+      We request it even if someone is already waiting on it in case an earlier fetch failed;
+      fetchTile() implementations ignore duplicate requests.
+    */
+    this->startTileRequest(ancestorX, ancestorY, nativeZoom);
+}
+
+//private
+void MapTileSource::startOverzoomResampling(const QString &ancestorCacheID, const QImage &ancestor)
+{
+    const QSet<QString> waiting = _overzoomWaiting.take(ancestorCacheID);
+    if (waiting.isEmpty())
+        return;
+
+    quint32 ancestorX, ancestorY, ancestorZ;
+    if (!MapTileSource::cacheID2xyz(ancestorCacheID, &ancestorX, &ancestorY, &ancestorZ))
+        return;
+
+    //Synthesized tiles expire with the tile they were made from
+    QDateTime expireTime;
+    if (this->cacheMode() == DiskAndMemCaching)
+        expireTime = this->getTileExpirationTime(ancestorCacheID);
+
+    const quint16 tileSize = this->tileSize();
+
+    const std::shared_ptr<WorkerJobs> jobs = this->startWorkerJob();
+    MapGraphicsExecutor::getInstance()->run([this, jobs, waiting, ancestor, ancestorZ, tileSize, expireTime]()
+    {
+        foreach(const QString& cacheID, waiting)
+        {
+            quint32 x,y,z;
+            if (!MapTileSource::cacheID2xyz(cacheID, &x, &y, &z))
+                continue;
+
+            //Opaque ancestors make opaque tiles, which composites can stop at
+            QImage tile = MapTileResampler::overzoom(ancestor, x, y, z - ancestorZ, tileSize);
+            if (MapTileBlender::isOpaque(ancestor))
+                MapTileBlender::detectOpaque(&tile);
+
+            //Hand the result back to our own thread, where it's cached and delivered like a real tile
+            QMetaObject::invokeMethod(this, [this, x, y, z, tile, expireTime]()
+            {
+                this->prepareNewlyReceivedTile(x, y, z, new QImage(tile), expireTime);
+            }, Qt::QueuedConnection);
+        }
+        MapTileSource::finishWorkerJob(jobs);
+    });
+}
+
+//private
+bool MapTileSource::startUnderzoomSynthesis(quint32 x, quint32 y, quint8 z)
+{
+    if (this->cacheMode() != DiskAndMemCaching || z >= this->maxZoomLevel())
+        return false;
+
+    /*
+      We need all four children from the caches. The memory cache is checked here, but children that are
+      only on disk are just located; reading and decoding them is left to the worker.
+    */
+    QList<QImage> children;
+    QStringList childFiles;
+    for (int i = 0; i < 4; i++)
+    {
+        const QString childID = MapTileSource::createCacheID(x*2 + (i % 2), y*2 + (i / 2), z+1);
+        QImage * child = this->fromMemCache(childID);
+        if (child)
+        {
+            children.append(*child);
+            childFiles.append(QString());
+            delete child;
+            continue;
+        }
+
+        const QString path = this->freshDiskCacheFile(childID);
+        if (path.isEmpty())
+            return false;
+        children.append(QImage());
+        childFiles.append(path);
+    }
+
+    const QString cacheID = MapTileSource::createCacheID(x,y,z);
+    _provisionalTiles.insert(cacheID);
+
+    const quint16 tileSize = this->tileSize();
+
+    const std::shared_ptr<WorkerJobs> jobs = this->startWorkerJob();
+    MapGraphicsExecutor::getInstance()->run([this, jobs, x, y, z, cacheID, children, childFiles, tileSize]()
+    {
+        QList<QImage> loaded = children;
+        bool ok = true;
+        for (int i = 0; i < loaded.size() && ok; i++)
+        {
+            if (childFiles.at(i).isEmpty())
+                continue;
+            QImage * child = MapTileSource::readDiskCacheFile(childFiles.at(i));
+            ok = (child != 0);
+            if (ok)
+                loaded[i] = *child;
+            delete child;
+        }
+
+        QImage tile;
+        if (ok)
+            tile = MapTileResampler::underzoom(loaded.at(0), loaded.at(1), loaded.at(2), loaded.at(3), tileSize);
+
+        QMetaObject::invokeMethod(this, [this, x, y, z, cacheID, tile, ok]()
+        {
+            //Don't replace the real tile if it beat us here
+            if (!_provisionalTiles.remove(cacheID))
+                return;
+
+            //A child we counted on couldn't be read after all. Fetch the tile as if we'd never tried.
+            if (!ok)
+            {
+                if (this->underzoomMode() == UnderzoomWhenOffline)
+                    this->startFetch(x, y, z);
+                return;
+            }
+
+            //Synthesized tiles aren't cached so the real tile still gets fetched next time
+            if (this->underzoomMode() == UnderzoomFirstResponse)
+                this->prepareProvisionalTile(x, y, z, new QImage(tile));
+            else
+                this->prepareRetrievedTile(x, y, z, new QImage(tile));
+        }, Qt::QueuedConnection);
+        MapTileSource::finishWorkerJob(jobs);
+    });
+
+    return true;
+}
+
+//private
+void MapTileSource::startFetch(quint32 x, quint32 y, quint8 z)
+{
+    const int size = this->metatileSize();
+    if (size <= 1)
+    {
+        this->fetchTile(x,y,z);
+        return;
+    }
+
+    //Join the metatile that contains the tile, fetching it if nobody else has asked for it yet
+    const quint32 metaX = x - (x % size);
+    const quint32 metaY = y - (y % size);
+    const QString metatileID = MapTileSource::createCacheID(metaX, metaY, z);
+    const bool alreadyFetching = _metatileWaiting.contains(metatileID);
+    _metatileWaiting[metatileID].insert(MapTileSource::createCacheID(x,y,z));
+
+    if (!alreadyFetching)
+        this->fetchMetatile(metaX, metaY, z, size);
+}
+
+void MapTileSource::saveHotTilesToDisk()
+{
+    if (!this->warmStartEnabled() || _tileHits.isEmpty() || _hotTilesFile.isEmpty())
+        return;
+
+    /*
+      Start from what earlier sessions (or another instance) saved, aged a little so old favorites fade
+      out, and add this session's hits. A short session then doesn't wipe the history.
+    */
+    QHash<QString, quint32> merged = this->loadHotTilesFromDisk();
+    QHash<QString, quint32>::iterator mergedIter;
+    for (mergedIter = merged.begin(); mergedIter != merged.end(); mergedIter++)
+        mergedIter.value() -= mergedIter.value() / 4;
+
+    QHash<QString, quint32>::const_iterator iter;
+    for (iter = _tileHits.constBegin(); iter != _tileHits.constEnd(); iter++)
+        merged[iter.key()] += iter.value();
+
+    //Most-requested tiles first
+    QList<QPair<quint32, QString> > byHits;
+    for (iter = merged.constBegin(); iter != merged.constEnd(); iter++)
+        byHits.append(QPair<quint32, QString>(iter.value(), iter.key()));
+    std::sort(byHits.begin(), byHits.end(),
+              [](const QPair<quint32, QString>& a, const QPair<quint32, QString>& b)
+    {
+        return a.first > b.first;
+    });
+
+    QHash<QString, quint32> hotTiles;
+    for (int i = 0; i < byHits.size() && i < _warmStartTileCount; i++)
+        hotTiles.insert(byHits.at(i).second, byHits.at(i).first);
+
+    //Written to a temporary file that replaces the old one only once it's complete
+    QSaveFile fp(_hotTilesFile);
+    if (!fp.open(QIODevice::WriteOnly))
+    {
+        qWarning() << "Failed to open hot tile file for writing:" << fp.errorString();
+        return;
+    }
+
+    QDataStream stream(&fp);
+    stream << HOT_TILES_MAGIC << HOT_TILES_VERSION << hotTiles;
+    if (stream.status() != QDataStream::Ok || !fp.commit())
+        qWarning() << "Failed to write hot tile file" << _hotTilesFile;
+}
+
+//private
+std::shared_ptr<MapTileSource::WorkerJobs> MapTileSource::startWorkerJob()
+{
+    QMutexLocker lock(&_workerJobs->mutex);
+    _workerJobs->active++;
+    return _workerJobs;
+}
+
+//private static
+void MapTileSource::finishWorkerJob(const std::shared_ptr<MapTileSource::WorkerJobs> &jobs)
+{
+    //The job holds on to jobs, so this is safe even if our destructor returns the moment we unlock
+    QMutexLocker lock(&jobs->mutex);
+    if (--jobs->active == 0)
+        jobs->finished.wakeAll();
+}
+
+//private
+QHash<QString, quint32> MapTileSource::loadHotTilesFromDisk() const
+{
+    QHash<QString, quint32> toRet;
+
+    QFile fp(_hotTilesFile);
+    if (_hotTilesFile.isEmpty() || !fp.exists())
+        return toRet;
+
+    if (!fp.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "Failed to open hot tile file for reading:" << fp.errorString();
+        return toRet;
+    }
+
+    QDataStream stream(&fp);
+    quint32 magic = 0, version = 0;
+    stream >> magic >> version;
+    if (magic == HOT_TILES_MAGIC && version == HOT_TILES_VERSION)
+    {
+        stream >> toRet;
+        if (stream.status() != QDataStream::Ok)
+            toRet.clear();
+        return toRet;
+    }
+
+    //Older files are just the cacheIDs, most-requested first. Their rank has to do for a hit count.
+    fp.seek(0);
+    stream.resetStatus();
+    QStringList hotTiles;
+    stream >> hotTiles;
+    if (stream.status() != QDataStream::Ok)
+        return toRet;
+    for (int i = 0; i < hotTiles.size(); i++)
+        toRet.insert(hotTiles.at(i), hotTiles.size() - i);
+    return toRet;
+}
@@ -11,9 +11,20 @@
 #include <QDir>
 #include <QFile>
 #include <QHash>
+#include <QStringList>
+#include <QSet>
+#include <QAtomicInt>
+#include <QWaitCondition>
+#include <QPolygonF>
+#include <QRectF>
+#include <QList>
+
+#include <memory>
 
 #include "MapGraphics_global.h"
 
+class MapGraphicsSerialQueue;
+
 class MAPGRAPHICSSHARED_EXPORT MapTileSource : public QObject
 {
     Q_OBJECT
@@ -29,6 +40,20 @@ public:
         DiskAndMemCaching
     };
 
+    /**
+     * @brief Enum used to describe when a MapTileSource should build a tile that isn't cached from its
+     * four cached children. NoUnderzoom never does. UnderzoomWhenOffline does it instead of fetching when
+     * the source is offline. UnderzoomFirstResponse always does it and delivers the result right away,
+     * then fetches the real tile as usual and delivers that too when it arrives.
+     *
+     */
+    enum UnderzoomMode
+    {
+        NoUnderzoom,
+        UnderzoomWhenOffline,
+        UnderzoomFirstResponse
+    };
+
 public:
     explicit MapTileSource();
     virtual ~MapTileSource();
@@ -49,17 +74,173 @@ public:
      * tileRetrieved signal before calling this method. Returns a QImage pointer on success, null on failure.
      * The caller takes ownership of the QImage pointer - i.e., the caller is responsible for deleting it.
      *
+     * Some sources deliver a tile more than once for a single request: provisional versions first (e.g. a
+     * tile synthesized from its children, or a composite that's still missing layers), then the real tile.
+     * Each delivery has a higher version number than the one before it, and only the last one isn't
+     * provisional. Clients that need the real thing can simply skip provisional tiles.
+     *
      * @param x
      * @param y
      * @param z
+     * @param version if not null, set to the version of the tile, counting from 1
+     * @param provisional if not null, set to true if a better version of the tile will follow
      * @return QImage
      */
-    QImage * getFinishedTile(quint32 x, quint32 y, quint8 z);
+    QImage * getFinishedTile(quint32 x, quint32 y, quint8 z, quint32 * version = 0, bool * provisional = 0);
 
     MapTileSource::CacheMode cacheMode() const;
 
     void setCacheMode(MapTileSource::CacheMode);
 
+    /**
+     * @brief Returns true if this MapTileSource remembers its most-requested tiles across restarts
+     * so they can be preloaded with preloadHotTiles(). Disabled by default.
+     *
+     * @return bool
+     */
+    bool warmStartEnabled() const;
+
+    /**
+     * @brief Enables or disables the warm-start snapshot. When enabled, the cacheIDs of the most
+     * frequently requested tiles are written next to the cache expiration database when the source is
+     * destroyed. Only useful in combination with DiskAndMemCaching.
+     *
+     * @param enabled
+     */
+    void setWarmStartEnabled(bool enabled);
+
+    /**
+     * @brief Returns the maximum number of tiles remembered by the warm-start snapshot.
+     *
+     * @return int
+     */
+    int warmStartTileCount() const;
+
+    /**
+     * @brief Sets the maximum number of tiles remembered by the warm-start snapshot.
+     *
+     * @param count
+     */
+    void setWarmStartTileCount(int count);
+
+    /**
+     * @brief Asynchronously loads the tiles remembered by the warm-start snapshot from the disk cache
+     * into the memory cache. Tiles on the given zoom level closest to the given geo position are loaded
+     * first, so the first screen is ready as early as possible. Does nothing if warm start is disabled.
+     *
+     * @param centerLL the geo (lon,lat) position the view will initially be centered on
+     * @param zoomLevel the zoom level the view will initially show
+     */
+    virtual void preloadHotTiles(const QPointF& centerLL, quint8 zoomLevel);
+
+    /**
+     * @brief Returns the deepest zoom level this MapTileSource will synthesize tiles for by resampling
+     * tiles from maxZoomLevel(). 0 (the default) means overzoom is disabled.
+     *
+     * @return quint8
+     */
+    quint8 maxOverzoomLevel() const;
+
+    /**
+     * @brief Enables local overzoom down to the given zoom level. Tiles deeper than maxZoomLevel() are
+     * then built on a worker thread by cropping and scaling up their deepest real ancestor, and cached
+     * like real tiles. No requests are ever made for zoom levels deeper than maxZoomLevel().
+     * Thread-safe.
+     *
+     * @param zoomLevel the deepest zoom level to synthesize, or 0 to disable overzoom
+     */
+    void setMaxOverzoomLevel(quint8 zoomLevel);
+
+    /**
+     * @brief Returns the maximum zoom level a view can actually show at a given lat/lon, which is
+     * maxZoomLevel() or maxOverzoomLevel(), whichever is deeper.
+     *
+     * @param ll
+     * @return quint8
+     */
+    quint8 effectiveMaxZoomLevel(QPointF ll = QPointF());
+
+    MapTileSource::UnderzoomMode underzoomMode() const;
+
+    /**
+     * @brief Sets when tiles that aren't cached may be synthesized by downsampling their four children
+     * from the caches. Synthesized tiles are never cached themselves. Needs DiskAndMemCaching.
+     *
+     * @param mode
+     */
+    void setUnderzoomMode(MapTileSource::UnderzoomMode mode);
+
+    /**
+     * @brief Returns true if the source has been told it's offline with setOffline()
+     *
+     * @return bool
+     */
+    bool isOffline() const;
+
+    /**
+     * @brief Tells the source whether it's offline. While offline, UnderzoomWhenOffline synthesis is used
+     * instead of fetchTile() whenever possible.
+     *
+     * @param offline
+     */
+    void setOffline(bool offline);
+
+    /**
+     * @brief Returns the number of tiles along each edge of the blocks tiles are fetched in, or 0 if
+     * tiles are fetched one by one (the default).
+     *
+     * @return int
+     */
+    int metatileSize() const;
+
+    /**
+     * @brief Enables metatile fetching. Requests for tiles that aren't cached are then grouped into
+     * size x size blocks (aligned to multiples of size) and fetched with fetchMetatile(), one request per
+     * block. The tiles of a block that weren't requested go into the disk cache only, so a metatile
+     * doesn't push recently used tiles out of the memory cache. 0 or 1 disables metatile fetching.
+     *
+     * @param size the number of tiles along each edge of a metatile, usually 8
+     */
+    void setMetatileSize(int size);
+
+    /**
+     * @brief Declares that the source has tiles for the given area on zoom levels minZoom to maxZoom.
+     * Once a source has coverage areas, tiles outside all of them are considered empty: views don't show
+     * them and CompositeTileSource doesn't ask for them. A source without coverage areas covers the world.
+     *
+     * @param polygonLL the area in geo (lon,lat) coordinates
+     * @param minZoom the most zoomed-out level the area has tiles on
+     * @param maxZoom the most zoomed-in level the area has tiles on
+     */
+    void addCoverage(const QPolygonF& polygonLL, quint8 minZoom = 0, quint8 maxZoom = 255);
+
+    /**
+     * @brief Convenience version of addCoverage() for a bounding box in geo (lon,lat) coordinates
+     *
+     * @param boundsLL
+     * @param minZoom
+     * @param maxZoom
+     */
+    void addCoverage(const QRectF& boundsLL, quint8 minZoom = 0, quint8 maxZoom = 255);
+
+    /**
+     * @brief Removes all coverage areas, so the source covers the world again
+     */
+    void clearCoverage();
+
+    bool hasCoverage() const;
+
+    /**
+     * @brief Returns true if the source may have a (non-empty) tile x,y on zoom level z. The default
+     * implementation checks the areas given to addCoverage(). Can be called from any thread.
+     *
+     * @param x
+     * @param y
+     * @param z
+     * @return bool
+     */
+    virtual bool tileInCoverage(quint32 x, quint32 y, quint8 z) const;
+
     /**
      * @brief Converst from geo (lat,lon) coordinates into QGraphicsScene coordinates. A MapTileSource
      * implementation has to implement this method.
@@ -141,6 +322,16 @@ signals:
      */
     void tileRetrieved(quint32 x, quint32 y, quint8 z);
 
+    /**
+     * @brief Signal emitted when a tile that was requested with requestTile() couldn't be fetched. No
+     * tileRetrieved signal will follow unless the tile is requested again.
+     *
+     * @param x
+     * @param y
+     * @param z
+     */
+    void tileRetrievalFailed(quint32 x, quint32 y, quint8 z);
+
     /**
      * @brief Signal emitted when a tile is requested using requestTile().
      *
@@ -156,12 +347,32 @@ signals:
 
     */
     void allTilesInvalidated();
+
+    /**
+     * @brief Signal emitted by preloadHotTiles() to start the preload in the MapTileSource's thread.
+     *
+     * @param centerLL
+     * @param zoomLevel
+     */
+    void hotTilePreloadRequested(QPointF centerLL, quint8 zoomLevel);
     
 public slots:
 
 private slots:
     void startTileRequest(quint32 x, quint32 y, quint8 z);
     void clearTempCache();
+    void startHotTilePreload(QPointF centerLL, quint8 zoomLevel);
+    void continueHotTilePreload();
+
+protected slots:
+    /**
+     * @brief Called when the MapGraphicsMemoryGovernor asks everyone to give back memory. The default
+     * implementation shrinks the memory cache when category is MapGraphicsMemoryGovernor::TileMemoryCache.
+     *
+     * @param category a MapGraphicsMemoryGovernor::MemoryCategory
+     * @param keepFraction the fraction of currently-held memory that may be kept
+     */
+    virtual void handleMemoryTrim(int category, qreal keepFraction);
 
 protected:
     /**
@@ -220,7 +431,7 @@ protected:
      * @brief Given a cacheID and a pointer to a QImage, inserts the QImage pointed to by the pointer into
      * the disk cache using cacheID as the key.
      * Optionally, takes a QDateTime object that specifies the time that the QImage should be kept cached 
-     * until. Defaults to 7 days.
+     * until. Defaults to 7 days. The file is written in the background.
      *
      * @param cacheID
      * @param toCache
@@ -231,7 +442,7 @@ protected:
     /**
      * @brief Fetches (from MapQuest or OSM or whatever) or generates the tile if it isn't cached.
      * This is where the rubber hits the road, so to speak, for a MapTileSource. When successful, this method
-     * should just call prepareRetrievedTile. On failure, do nothing.
+     * should just call prepareNewlyReceivedTile. On failure, call abandonTile().
      *
      * @param x x-coordinate of the tile
      * @param y y-coordinate of the tile
@@ -242,9 +453,85 @@ protected:
                            quint32 y,
                            quint8 z)=0;
 
+    /**
+     * @brief Fetches the metatile whose top-left tile is x,y on zoom level z. Only called when
+     * metatileSize() is greater than 1. When successful, implementations should call
+     * prepareNewlyReceivedMetatile(). On failure, they should call abandonMetatile().
+     * The default implementation falls back to fetchTile() for each requested tile in the block.
+     *
+     * @param x x-coordinate of the metatile's top-left tile (a multiple of size)
+     * @param y y-coordinate of the metatile's top-left tile (a multiple of size)
+     * @param z zoom-level of the metatile
+     * @param size the number of tiles along each edge of the metatile
+     */
+    virtual void fetchMetatile(quint32 x,
+                               quint32 y,
+                               quint8 z,
+                               int size);
+
     //Call only for tiles which were newly-generated or newly-acquired from the network (i.e., not cached)
     void prepareNewlyReceivedTile(quint32 x, quint32 y, quint8 z, QImage * image, QDateTime expireTime = QDateTime());
 
+    /**
+     * @brief Delivers a provisional version of tile x,y,z that will be superseded by a later call to
+     * prepareNewlyReceivedTile() for the same tile. Provisional tiles aren't cached.
+     *
+     * @param x
+     * @param y
+     * @param z
+     * @param image the provisional tile. We take ownership.
+     */
+    void prepareProvisionalTile(quint32 x, quint32 y, quint8 z, QImage * image);
+
+    /**
+     * @brief Decodes a newly-received tile on a worker thread, then caches and delivers it like
+     * prepareNewlyReceivedTile(). Use this rather than decoding in fetchTile() implementations, so
+     * decoding doesn't hold up the other tile sources sharing our thread.
+     *
+     * @param x x-coordinate of the tile
+     * @param y y-coordinate of the tile
+     * @param z zoom-level of the tile
+     * @param data the encoded tile as received
+     * @param expireTime when the tile should expire from the caches
+     */
+    void prepareNewlyReceivedTileData(quint32 x, quint32 y, quint8 z, const QByteArray& data,
+                                      QDateTime expireTime = QDateTime());
+
+    /**
+     * @brief Splits a newly-received metatile into tiles on a worker thread, then caches every tile and
+     * delivers the ones that were requested. Understands mod_tile's META container as well as a single
+     * image covering the whole metatile. Call only from fetchMetatile() implementations.
+     *
+     * @param x x-coordinate of the metatile's top-left tile
+     * @param y y-coordinate of the metatile's top-left tile
+     * @param z zoom-level of the metatile
+     * @param data the metatile as received
+     * @param expireTime when the tiles should expire from the caches
+     */
+    void prepareNewlyReceivedMetatile(quint32 x, quint32 y, quint8 z, const QByteArray& data,
+                                      QDateTime expireTime = QDateTime());
+
+    /**
+     * @brief Forgets that the metatile whose top-left tile is x,y on zoom level z is being fetched, so
+     * the next request for one of its tiles fetches it again. Call when fetchMetatile() fails.
+     *
+     * @param x
+     * @param y
+     * @param z
+     */
+    void abandonMetatile(quint32 x, quint32 y, quint8 z);
+
+    /**
+     * @brief Tells the MapTileSource that tile x,y,z couldn't be fetched, so anything waiting on it (like
+     * tiles being overzoomed from it) stops waiting, and emits tileRetrievalFailed. The next request for the
+     * tile fetches it again.
+     *
+     * @param x
+     * @param y
+     * @param z
+     */
+    void abandonTile(quint32 x, quint32 y, quint8 z);
+
     /**
      * @brief Returns the time when the tile is supposed to expire from any caches.
      * This should only be called on tiles which are actually cached!
@@ -265,7 +552,7 @@ private:
      * @brief prepareRetrievedTile prepares a generated/retrieve tile for retrieval by the client
      * and notifies the client that the tile is ready.
      */
-    void prepareRetrievedTile(quint32 x, quint32 y, quint8 z, QImage * image);
+    void prepareRetrievedTile(quint32 x, quint32 y, quint8 z, QImage * image, bool provisional = false);
 
     /**
      * @brief Given the x,y, and z of a tile, returns the directory where it should be cached on disk
@@ -288,13 +575,97 @@ private:
      */
     QString getDiskCacheFile(quint32 x, quint32 y, quint8 z) const;
 
+    /*!
+     \brief Returns the disk cache file of the tile with the given cacheID, or an empty string if it isn't
+     cached or has expired. Expired files are removed.
+    */
+    QString freshDiskCacheFile(const QString& cacheID);
+
+    /*!
+     \brief Reads and decodes a disk cache file. Doesn't touch any of our state, so it's safe to call from
+     a worker. Caller takes responsibility for deleting the returned QImage.
+    */
+    static QImage * readDiskCacheFile(const QString& path);
+
     /*!
      \brief Loads cache expiration times from disk if necessary
     */
     void loadCacheExpirationsFromDisk();
 
+    /*!
+     \brief Merges our cache expiration times into the database on disk, which other applications using
+     the same cache may have updated since we loaded it
+    */
     void saveCacheExpirationsToDisk();
 
+    /*!
+     \brief Writes the cacheIDs of the most-requested tiles to disk for the next warm start
+    */
+    void saveHotTilesToDisk();
+
+    /*!
+     \brief Reads the hot tile snapshot: cacheIDs and how often they've been requested. Empty if there is none.
+    */
+    QHash<QString, quint32> loadHotTilesFromDisk() const;
+
+    /*!
+     \brief Counts the jobs we've handed to worker threads. Each job shares it, so the last one can tell our
+     destructor it's done without touching us.
+    */
+    struct WorkerJobs
+    {
+        WorkerJobs() : active(0) {}
+
+        QMutex mutex;
+        QWaitCondition finished;
+        int active;
+    };
+
+    /*!
+     \brief Counts a job we're about to hand to a worker. The job must pass what this returns to
+     finishWorkerJob() once it's done with us.
+    */
+    std::shared_ptr<WorkerJobs> startWorkerJob();
+    static void finishWorkerJob(const std::shared_ptr<WorkerJobs>& jobs);
+
+    /*!
+     \brief Tells the MapGraphicsMemoryGovernor how much memory the memory cache is using
+    */
+    void reportMemoryUsage();
+
+    /*!
+     \brief Handles a request for a tile deeper than maxZoomLevel() by getting its deepest real
+     ancestor and resampling it
+    */
+    void startOverzoomRequest(quint32 x, quint32 y, quint8 z);
+
+    /*!
+     \brief Resamples the given ancestor on a worker thread into every tile waiting on it
+    */
+    void startOverzoomResampling(const QString& ancestorCacheID, const QImage& ancestor);
+
+    /*!
+     \brief Tries to build tile x,y,z from its four children in the caches. Returns true if all four
+     children were cached and the tile is being built on a worker thread.
+    */
+    bool startUnderzoomSynthesis(quint32 x, quint32 y, quint8 z);
+
+    /*!
+     \brief Fetches tile x,y,z that isn't cached, on its own or as part of a metatile
+    */
+    void startFetch(quint32 x, quint32 y, quint8 z);
+
+    /*!
+     \brief An area given to addCoverage(), with its bounding box for quick rejects
+    */
+    struct CoverageArea
+    {
+        QPolygonF polygon;
+        QRectF bounds;
+        quint8 minZoom;
+        quint8 maxZoom;
+    };
+
     bool _cacheExpirationsLoaded;
 
     /*
@@ -310,10 +681,59 @@ private:
     QCache<QString, QImage> _tempCache;
     QMutex _tempCacheLock;
 
-    //The "real" cache, where tiles are saved in memory so we don't download them again
+    //Versions of the tiles in _tempCache, and which of them are provisional. Guarded by _tempCacheLock.
+    QHash<QString, quint32> _tempCacheVersions;
+    QSet<QString> _tempCacheProvisional;
+
+    //Latest version delivered of tiles that have only been delivered provisionally so far
+    QHash<QString, quint32> _tileVersions;
+
+    //The "real" cache, where tiles are saved in memory so we don't download them again. Cost is in KiB.
     QCache<QString, QImage> _memoryCache;
 
     QHash<QString, QDateTime> _cacheExpirations;
+
+    bool _warmStartEnabled;
+    int _warmStartTileCount;
+
+    //Like _cacheExpirationsFile, remembered so we don't need name() in the destructor
+    QString _hotTilesFile;
+
+    //How often each tile has been requested. Only tracked while warm start is enabled.
+    QHash<QString, quint32> _tileHits;
+
+    //cacheIDs still waiting to be preloaded, in the order they'll be loaded
+    QStringList _hotTilePreloadQueue;
+
+    //How much more the preload may put in the memory cache, in KiB
+    int _hotTilePreloadBudgetKB;
+
+    //Set by CompositeTileSources from their own threads, so it's atomic
+    QAtomicInt _maxOverzoomLevel;
+
+    //cacheIDs of overzoomed tiles, keyed by the cacheID of the ancestor they're waiting on
+    QHash<QString, QSet<QString> > _overzoomWaiting;
+
+    MapTileSource::UnderzoomMode _underzoomMode;
+    bool _offline;
+
+    //cacheIDs of tiles being synthesized from their children that the real tile hasn't superseded yet
+    QSet<QString> _provisionalTiles;
+
+    int _metatileSize;
+
+    //cacheIDs of requested tiles, keyed by the cacheID of the top-left tile of the metatile being fetched
+    QHash<QString, QSet<QString> > _metatileWaiting;
+
+    //Coverage is checked from the views' threads as well as ours
+    mutable QMutex _coverageMutex;
+    QList<CoverageArea> _coverage;
+
+    //Jobs we've handed to worker threads that haven't finished yet
+    std::shared_ptr<WorkerJobs> _workerJobs;
+
+    //Disk cache writes, which must happen in order
+    MapGraphicsSerialQueue * _serialQueue;
     
 };
 
@@ -0,0 +1,264 @@
+#include "MapGraphicsExecutor.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+#include <QThread>
+
+//Tile sources mostly wait on the network, so a few host threads are plenty however many sources there are
+const int MIN_HOST_THREADS = 2;
+const int MAX_HOST_THREADS = 4;
+
+//How often waitUntilDestroyed() checks on the object
+const int DESTROYED_POLL_MSECS = 5;
+
+namespace
+{
+//Which of the pool's workers the current thread is, or -1 if it isn't one
+thread_local int currentWorker = -1;
+}
+
+//static
+MapGraphicsExecutor * MapGraphicsExecutor::_instance = 0;
+QMutex MapGraphicsExecutor::_instanceMutex;
+
+//static
+MapGraphicsExecutor *MapGraphicsExecutor::getInstance()
+{
+    //Like the threads it owns, the executor lives as long as the process
+    QMutexLocker lock(&_instanceMutex);
+    if (_instance == 0)
+        _instance = new MapGraphicsExecutor();
+    return _instance;
+}
+
+int MapGraphicsExecutor::workerCount() const
+{
+    return _workers.size();
+}
+
+void MapGraphicsExecutor::run(MapGraphicsExecutor::Task task)
+{
+    if (!task)
+        return;
+
+    //Workers keep what they spawn, which is likely to use what they just touched. Everyone else takes turns.
+    int index = currentWorker;
+    if (index < 0)
+        index = (int)((quint32)_nextWorker.fetchAndAddRelaxed(1) % (quint32)_workers.size());
+
+    //Counted before it's queued so the count never drops below zero when it's taken right away
+    _queued.ref();
+    Worker * worker = _workers.at(index);
+    QMutexLocker lock(&worker->mutex);
+    worker->tasks.push_back(std::move(task));
+    lock.unlock();
+
+    //Sleeping workers check _queued with _sleepMutex held, so they can't miss this
+    QMutexLocker sleepLock(&_sleepMutex);
+    _wakeUp.wakeOne();
+}
+
+void MapGraphicsExecutor::hostSource(QObject *source)
+{
+    if (source == 0)
+        return;
+
+    //Several views may share a source
+    QMutexLocker lock(&_hostMutex);
+    if (_hostedSources.contains(source))
+        return;
+
+    int host = 0;
+    for (int i = 1; i < _hosts.size(); i++)
+    {
+        if (_hostLoads.at(i) < _hostLoads.at(host))
+            host = i;
+    }
+    _hostLoads[host]++;
+    _hostedSources.insert(source, host);
+    lock.unlock();
+
+    source->moveToThread(_hosts.at(host));
+
+    //Sources are destroyed in their host thread, so this runs there
+    QObject::connect(source,
+                     &QObject::destroyed,
+                     [this, source, host]()
+    {
+        QMutexLocker lock(&_hostMutex);
+        _hostLoads[host]--;
+        _hostedSources.remove(source);
+    });
+}
+
+bool MapGraphicsExecutor::isHostThread(QThread *thread) const
+{
+    //The host threads never change after we're constructed
+    return _hosts.contains(thread);
+}
+
+bool MapGraphicsExecutor::waitUntilDestroyed(const QPointer<QObject> &object, int msecs, bool processEvents)
+{
+    QList<QPointer<QObject> > objects;
+    objects.append(object);
+    return this->waitUntilDestroyed(objects, msecs, processEvents);
+}
+
+bool MapGraphicsExecutor::waitUntilDestroyed(const QList<QPointer<QObject> > &objects, int msecs, bool processEvents)
+{
+    /*
+      Sources hosted in the calling thread can't be destroyed while we wait, and the others on it would
+      stall. Sources deleted from a host thread finish their own shutdown, caches and all, without us.
+    */
+    const bool mayWait = !this->isHostThread(QThread::currentThread());
+
+    QElapsedTimer timer;
+    timer.start();
+    forever
+    {
+        bool allGone = true;
+        foreach(const QPointer<QObject>& object, objects)
+            allGone = allGone && object.isNull();
+        if (allGone)
+            return true;
+        if (!mayWait || timer.elapsed() >= msecs)
+            return false;
+
+        if (processEvents)
+            QCoreApplication::processEvents(QEventLoop::ExcludeSocketNotifiers | QEventLoop::ExcludeUserInputEvents);
+        QThread::msleep(DESTROYED_POLL_MSECS);
+    }
+}
+
+//private
+MapGraphicsExecutor::MapGraphicsExecutor() :
+    _nextWorker(0), _queued(0)
+{
+    const int cores = qMax<int>(1, QThread::idealThreadCount());
+
+    for (int i = 0; i < cores; i++)
+        _workers.append(new Worker());
+
+    for (int i = 0; i < cores; i++)
+    {
+        QThread * thread = QThread::create([this, i]()
+        {
+            this->workerLoop(i);
+        });
+        thread->setObjectName(QString("MapGraphics worker %1").arg(i));
+        thread->start();
+    }
+
+    const int hostCount = qBound<int>(MIN_HOST_THREADS, cores / 2, MAX_HOST_THREADS);
+    for (int i = 0; i < hostCount; i++)
+    {
+        QThread * host = new QThread();
+        host->setObjectName(QString("MapGraphics tile sources %1").arg(i));
+        host->start();
+        _hosts.append(host);
+        _hostLoads.append(0);
+    }
+}
+
+//private
+void MapGraphicsExecutor::workerLoop(int index)
+{
+    currentWorker = index;
+
+    forever
+    {
+        Task task;
+        if (this->takeTask(index, &task))
+        {
+            task();
+            continue;
+        }
+
+        QMutexLocker lock(&_sleepMutex);
+        while (_queued.loadAcquire() == 0)
+            _wakeUp.wait(&_sleepMutex);
+    }
+}
+
+//private
+bool MapGraphicsExecutor::takeTask(int index, MapGraphicsExecutor::Task *task)
+{
+    Worker * own = _workers.at(index);
+    QMutexLocker lock(&own->mutex);
+    if (!own->tasks.empty())
+    {
+        *task = std::move(own->tasks.back());
+        own->tasks.pop_back();
+        _queued.deref();
+        return true;
+    }
+    lock.unlock();
+
+    //Steal, starting with our neighbour so thieves don't all go for the same worker
+    for (int i = 1; i < _workers.size(); i++)
+    {
+        Worker * victim = _workers.at((index + i) % _workers.size());
+        QMutexLocker victimLock(&victim->mutex);
+        if (victim->tasks.empty())
+            continue;
+
+        *task = std::move(victim->tasks.front());
+        victim->tasks.pop_front();
+        _queued.deref();
+        return true;
+    }
+    return false;
+}
+
+MapGraphicsSerialQueue::MapGraphicsSerialQueue(MapGraphicsExecutor *executor) :
+    _executor(executor), _state(std::make_shared<State>())
+{
+    _state->scheduled = false;
+    _state->cancelled = false;
+}
+
+MapGraphicsSerialQueue::~MapGraphicsSerialQueue()
+{
+    QMutexLocker lock(&_state->mutex);
+    _state->cancelled = true;
+    _state->tasks.clear();
+}
+
+void MapGraphicsSerialQueue::run(MapGraphicsExecutor::Task task)
+{
+    if (!task)
+        return;
+
+    QMutexLocker lock(&_state->mutex);
+    _state->tasks.push_back(std::move(task));
+    if (_state->scheduled)
+        return;
+    _state->scheduled = true;
+    lock.unlock();
+
+    const std::shared_ptr<State> state = _state;
+    _executor->run([state]()
+    {
+        MapGraphicsSerialQueue::drain(state);
+    });
+}
+
+//static
+void MapGraphicsSerialQueue::drain(const std::shared_ptr<MapGraphicsSerialQueue::State> &state)
+{
+    forever
+    {
+        QMutexLocker lock(&state->mutex);
+        if (state->cancelled || state->tasks.empty())
+        {
+            state->scheduled = false;
+            return;
+        }
+        MapGraphicsExecutor::Task task = std::move(state->tasks.front());
+        state->tasks.pop_front();
+        lock.unlock();
+
+        task();
+    }
+}
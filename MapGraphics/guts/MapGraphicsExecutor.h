@@ -0,0 +1,150 @@
+#ifndef MAPGRAPHICSEXECUTOR_H
+#define MAPGRAPHICSEXECUTOR_H
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QPointer>
+#include <QList>
+#include <QHash>
+
+#include <deque>
+#include <functional>
+#include <memory>
+
+#include "MapGraphics_global.h"
+
+class QThread;
+
+/*!
+ \brief The process-wide place where tile sources live and do their work.
+
+ Heavy work (decoding, resampling, splitting metatiles, writing the disk cache) goes to a work-stealing
+ pool with one worker per core. Each worker runs its own tasks newest first and steals the oldest tasks of
+ the others when it runs dry. Tasks from outside the pool are spread over the workers round-robin.
+
+ Tile sources themselves need an event loop, so instead of a thread each they share a few "host" threads.
+ They only do bookkeeping there; anything expensive is handed to the pool. Use MapGraphicsSerialQueue for
+ work that has to run in order.
+*/
+class MAPGRAPHICSSHARED_EXPORT MapGraphicsExecutor
+{
+public:
+    typedef std::function<void()> Task;
+
+public:
+    static MapGraphicsExecutor * getInstance();
+
+    /*!
+     \brief Returns the number of worker threads in the pool
+    */
+    int workerCount() const;
+
+    /*!
+     \brief Runs task on one of the workers, in no particular order. Thread-safe.
+    */
+    void run(Task task);
+
+    /*!
+     \brief Moves source (which must not have a parent) to the least busy of the host threads. Call from
+     the thread source currently lives in. Sources that are hosted already stay where they are. The source
+     gives its place up when it's destroyed.
+    */
+    void hostSource(QObject * source);
+
+    /*!
+     \brief Returns true if thread is one of the host threads
+    */
+    bool isHostThread(QThread * thread) const;
+
+    /*!
+     \brief Waits up to msecs for object to be destroyed, for owners that just let go of a hosted source
+     and want it (and its caches) saved before they go on. Returns right away when called from a host
+     thread: blocking it would stall every source it hosts, and the object may need it to shut down.
+
+     \param object the object to wait for
+     \param msecs how long to wait at most
+     \param processEvents process the calling thread's events while waiting, for GUI threads whose object
+     needs signals delivered to shut down
+     \return bool true if the object is gone
+    */
+    bool waitUntilDestroyed(const QPointer<QObject>& object, int msecs, bool processEvents = false);
+
+    /*!
+     \brief Like waitUntilDestroyed() for a single object, but waits for all of objects with msecs as the
+     deadline for all of them together
+
+     \return bool true if the objects are all gone
+    */
+    bool waitUntilDestroyed(const QList<QPointer<QObject> >& objects, int msecs, bool processEvents = false);
+
+private:
+    MapGraphicsExecutor();
+
+    struct Worker
+    {
+        QMutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void workerLoop(int index);
+
+    //Takes the newest of our own tasks, or steals the oldest of someone else's
+    bool takeTask(int index, Task * task);
+
+    static MapGraphicsExecutor * _instance;
+    static QMutex _instanceMutex;
+
+    QList<Worker *> _workers;
+    QAtomicInt _nextWorker;
+
+    //Queued tasks across all workers. Idle workers sleep on _wakeUp until there are some.
+    QAtomicInt _queued;
+    QMutex _sleepMutex;
+    QWaitCondition _wakeUp;
+
+    //Host threads, how many sources each of them has, and which host each source is on
+    QMutex _hostMutex;
+    QList<QThread *> _hosts;
+    QList<int> _hostLoads;
+    QHash<const QObject *, int> _hostedSources;
+};
+
+/*!
+ \brief Runs tasks on the MapGraphicsExecutor one at a time, in the order they were queued. Several queues
+ share the pool, so each object can keep its own work in order without a thread of its own.
+
+ Deleting the queue drops the tasks that haven't started yet; the one running (if any) finishes.
+*/
+class MAPGRAPHICSSHARED_EXPORT MapGraphicsSerialQueue
+{
+public:
+    explicit MapGraphicsSerialQueue(MapGraphicsExecutor * executor = MapGraphicsExecutor::getInstance());
+    ~MapGraphicsSerialQueue();
+
+    /*!
+     \brief Queues task to run after every task queued before it. Thread-safe.
+    */
+    void run(MapGraphicsExecutor::Task task);
+
+private:
+    struct State
+    {
+        QMutex mutex;
+        std::deque<MapGraphicsExecutor::Task> tasks;
+
+        //Whether a task draining the queue is on the executor
+        bool scheduled;
+
+        bool cancelled;
+    };
+
+    static void drain(const std::shared_ptr<State>& state);
+
+    MapGraphicsExecutor * _executor;
+
+    //Shared with the draining task, which may outlive us briefly
+    std::shared_ptr<State> _state;
+};
+
+#endif // MAPGRAPHICSEXECUTOR_H
@@ -0,0 +1,216 @@
+#include "MapGraphicsMemoryGovernor.h"
+
+#include <QCoreApplication>
+#include <QMutexLocker>
+#include <QThread>
+#include <QTimer>
+#include <QFile>
+#include <QtDebug>
+
+const qint64 DEFAULT_HIGH_WATER_MARK = 512 * 1024 * 1024;
+const qint64 DEFAULT_LOW_SYSTEM_MEMORY = 256 * 1024 * 1024;
+
+//When we trim because of the high-water mark, we trim down to this fraction of it so we don't trim constantly
+const qreal TRIM_TARGET_FRACTION = 0.75;
+
+//When the system is under memory pressure, every category is trimmed down to this fraction
+const qreal PRESSURE_KEEP_FRACTION = 0.25;
+
+const int SYSTEM_MEMORY_POLL_MSECS = 2000;
+
+//static
+MapGraphicsMemoryGovernor * MapGraphicsMemoryGovernor::_instance = 0;
+QMutex MapGraphicsMemoryGovernor::_instanceMutex;
+
+//static
+MapGraphicsMemoryGovernor *MapGraphicsMemoryGovernor::getInstance()
+{
+    QMutexLocker lock(&_instanceMutex);
+    if (_instance == 0)
+    {
+        _instance = new MapGraphicsMemoryGovernor();
+
+        //We might be created from a tile source's thread, but we want to live as long as the application
+        QCoreApplication * app = QCoreApplication::instance();
+        if (app != 0 && app->thread() != QThread::currentThread())
+            _instance->moveToThread(app->thread());
+    }
+    return _instance;
+}
+
+MapGraphicsMemoryGovernor::~MapGraphicsMemoryGovernor()
+{
+}
+
+qint64 MapGraphicsMemoryGovernor::highWaterMark() const
+{
+    QMutexLocker lock(&_usageMutex);
+    return _highWaterMark;
+}
+
+void MapGraphicsMemoryGovernor::setHighWaterMark(qint64 bytes)
+{
+    QMutexLocker lock(&_usageMutex);
+    _highWaterMark = qMax<qint64>(0, bytes);
+    lock.unlock();
+
+    QMetaObject::invokeMethod(this, "checkUsage", Qt::QueuedConnection);
+}
+
+qint64 MapGraphicsMemoryGovernor::lowSystemMemoryThreshold() const
+{
+    QMutexLocker lock(&_usageMutex);
+    return _lowSystemMemoryThreshold;
+}
+
+void MapGraphicsMemoryGovernor::setLowSystemMemoryThreshold(qint64 bytes)
+{
+    QMutexLocker lock(&_usageMutex);
+    _lowSystemMemoryThreshold = qMax<qint64>(0, bytes);
+}
+
+void MapGraphicsMemoryGovernor::reportUsage(const void *owner, MapGraphicsMemoryGovernor::MemoryCategory category, qint64 bytes)
+{
+    if (category < 0 || category >= NumMemoryCategories)
+        return;
+
+    QMutexLocker lock(&_usageMutex);
+    if (bytes <= 0)
+        _usage[category].remove(owner);
+    else
+        _usage[category].insert(owner, bytes);
+
+    if (_checkScheduled || _highWaterMark == 0)
+        return;
+
+    qint64 total = 0;
+    for (int i = 0; i < NumMemoryCategories; i++)
+    {
+        foreach(qint64 used, _usage[i])
+            total += used;
+    }
+
+    if (total <= _highWaterMark)
+        return;
+
+    /*
+      We're probably being called from a tile source's thread, possibly from within a trim. Do the
+      actual work later in our own thread so nobody ends up trimming recursively.
+    */
+    _checkScheduled = true;
+    lock.unlock();
+    QMetaObject::invokeMethod(this, "checkUsage", Qt::QueuedConnection);
+}
+
+void MapGraphicsMemoryGovernor::removeOwner(const void *owner)
+{
+    QMutexLocker lock(&_usageMutex);
+    for (int i = 0; i < NumMemoryCategories; i++)
+        _usage[i].remove(owner);
+}
+
+qint64 MapGraphicsMemoryGovernor::totalBytes() const
+{
+    qint64 total = 0;
+    for (int i = 0; i < NumMemoryCategories; i++)
+        total += this->bytesUsed((MemoryCategory)i);
+    return total;
+}
+
+qint64 MapGraphicsMemoryGovernor::bytesUsed(MapGraphicsMemoryGovernor::MemoryCategory category) const
+{
+    if (category < 0 || category >= NumMemoryCategories)
+        return 0;
+
+    QMutexLocker lock(&_usageMutex);
+    qint64 total = 0;
+    foreach(qint64 used, _usage[category])
+        total += used;
+    return total;
+}
+
+//public slot
+void MapGraphicsMemoryGovernor::handleMemoryPressure()
+{
+    qDebug() << "Memory pressure --- trimming tile memory from" << this->totalBytes() << "bytes";
+    for (int i = 0; i < NumMemoryCategories; i++)
+        this->trimRequested(i, PRESSURE_KEEP_FRACTION);
+}
+
+//private slot
+void MapGraphicsMemoryGovernor::checkUsage()
+{
+    QMutexLocker lock(&_usageMutex);
+    _checkScheduled = false;
+    const qint64 highWaterMark = _highWaterMark;
+    lock.unlock();
+
+    if (highWaterMark == 0)
+        return;
+
+    const qint64 total = this->totalBytes();
+    if (total <= highWaterMark)
+        return;
+
+    //Shrink categories in priority order until we've made up the difference
+    qint64 excess = total - (qint64)(highWaterMark * TRIM_TARGET_FRACTION);
+    for (int i = 0; i < NumMemoryCategories && excess > 0; i++)
+    {
+        const qint64 used = this->bytesUsed((MemoryCategory)i);
+        if (used <= 0)
+            continue;
+
+        const qint64 toFree = qMin<qint64>(used, excess);
+        const qreal keepFraction = (qreal)(used - toFree) / (qreal)used;
+        this->trimRequested(i, keepFraction);
+        excess -= toFree;
+    }
+}
+
+//private slot
+void MapGraphicsMemoryGovernor::checkSystemMemory()
+{
+    const qint64 threshold = this->lowSystemMemoryThreshold();
+    if (threshold == 0)
+        return;
+
+#ifdef Q_OS_LINUX
+    QFile fp("/proc/meminfo");
+    if (!fp.open(QIODevice::ReadOnly))
+        return;
+
+    qint64 available = -1;
+    while (!fp.atEnd())
+    {
+        const QByteArray line = fp.readLine();
+        if (!line.startsWith("MemAvailable:"))
+            continue;
+
+        //The line looks like "MemAvailable:    1234567 kB"
+        const QList<QByteArray> parts = line.simplified().split(' ');
+        bool ok = false;
+        if (parts.size() >= 2)
+            available = parts.at(1).toLongLong(&ok) * 1024;
+        if (!ok)
+            available = -1;
+        break;
+    }
+
+    if (available >= 0 && available < threshold)
+        this->handleMemoryPressure();
+#endif
+}
+
+//protected
+MapGraphicsMemoryGovernor::MapGraphicsMemoryGovernor() :
+    QObject(), _highWaterMark(DEFAULT_HIGH_WATER_MARK), _lowSystemMemoryThreshold(DEFAULT_LOW_SYSTEM_MEMORY),
+    _checkScheduled(false)
+{
+    //Poll the system's memory situation. The timer moves with us if we're moved to another thread.
+    _systemMemoryTimer = new QTimer(this);
+    connect(_systemMemoryTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(checkSystemMemory()));
+    _systemMemoryTimer->start(SYSTEM_MEMORY_POLL_MSECS);
+}
@@ -0,0 +1,117 @@
+#ifndef MAPGRAPHICSMEMORYGOVERNOR_H
+#define MAPGRAPHICSMEMORYGOVERNOR_H
+
+#include <QObject>
+#include <QMutex>
+#include <QHash>
+
+#include "MapGraphics_global.h"
+
+class QTimer;
+
+/*!
+ \brief Process-wide bookkeeping of the memory held by tile caches, display pixmaps and the layer
+ tiles of composites.
+
+ Everything that holds on to tiles reports how many bytes it is using with reportUsage(). When the
+ total crosses the high-water mark, or when the system runs low on memory, the governor emits
+ trimRequested() for one category at a time, cheapest-to-rebuild first, until enough has been freed.
+ Owners listen to trimRequested() and shrink themselves in their own thread.
+*/
+class MAPGRAPHICSSHARED_EXPORT MapGraphicsMemoryGovernor : public QObject
+{
+    Q_OBJECT
+public:
+    /*!
+     \brief What kind of memory is being reported. Categories are trimmed in this order.
+    */
+    enum MemoryCategory
+    {
+        TileMemoryCache = 0,
+        RetainedLayerTiles,
+        DisplayPixmaps,
+        PendingCompositeTiles,
+        NumMemoryCategories
+    };
+
+public:
+    static MapGraphicsMemoryGovernor * getInstance();
+
+    ~MapGraphicsMemoryGovernor();
+
+    /*!
+     \brief Returns the number of bytes above which the governor starts trimming
+    */
+    qint64 highWaterMark() const;
+
+    /*!
+     \brief Sets the number of bytes above which the governor starts trimming. 0 disables trimming
+     based on our own usage (system memory pressure is still handled).
+    */
+    void setHighWaterMark(qint64 bytes);
+
+    /*!
+     \brief Returns the amount of available system memory below which we consider the system to be
+     under memory pressure.
+    */
+    qint64 lowSystemMemoryThreshold() const;
+
+    /*!
+     \brief Sets the amount of available system memory below which we consider the system to be under
+     memory pressure. Only polled on platforms where we know how to (currently Linux). 0 disables polling.
+    */
+    void setLowSystemMemoryThreshold(qint64 bytes);
+
+    /*!
+     \brief Records that owner is currently holding bytes of memory in the given category. Thread-safe.
+    */
+    void reportUsage(const void * owner, MapGraphicsMemoryGovernor::MemoryCategory category, qint64 bytes);
+
+    /*!
+     \brief Forgets everything reported by owner. Call this when the owner is destroyed. Thread-safe.
+    */
+    void removeOwner(const void * owner);
+
+    qint64 totalBytes() const;
+    qint64 bytesUsed(MapGraphicsMemoryGovernor::MemoryCategory category) const;
+
+signals:
+    /*!
+     \brief Emitted when owners of memory in the given category should shrink to keepFraction of
+     what they are holding now.
+
+     \param category a MapGraphicsMemoryGovernor::MemoryCategory
+     \param keepFraction 0.0 (free everything possible) to 1.0 (keep everything)
+    */
+    void trimRequested(int category, qreal keepFraction);
+
+public slots:
+    /*!
+     \brief Trims every category hard. Call this from platform-specific low memory notifications.
+    */
+    void handleMemoryPressure();
+
+private slots:
+    void checkUsage();
+    void checkSystemMemory();
+
+protected:
+    MapGraphicsMemoryGovernor();
+
+private:
+    static MapGraphicsMemoryGovernor * _instance;
+    static QMutex _instanceMutex;
+
+    mutable QMutex _usageMutex;
+    QHash<const void *, qint64> _usage[NumMemoryCategories];
+
+    qint64 _highWaterMark;
+    qint64 _lowSystemMemoryThreshold;
+
+    //Set while a checkUsage() call is queued so we don't flood the event loop
+    bool _checkScheduled;
+
+    QTimer * _systemMemoryTimer;
+};
+
+#endif // MAPGRAPHICSMEMORYGOVERNOR_H
@@ -1,53 +1,854 @@
 #include "MapGraphicsNetwork.h"
 
+#include "MapGraphicsNetworkReply.h"
+#include "MapGraphicsNetworkTransport.h"
+
+#include <QCoreApplication>
 #include <QMutexLocker>
-#include <QNetworkRequest>
+#include <QNetworkReply>
 #include <QThread>
+#include <QTimer>
+#include <QRandomGenerator>
 #include <QtDebug>
 
+#include <algorithm>
+#include <cmath>
+
+#if QT_CONFIG(ssl)
+#include <QSslConfiguration>
+#endif
+
 const QByteArray DEFAULT_USER_AGENT = "MapGraphics";
 
+//Until we've seen some replies, guess that they're about the size of a typical PNG tile
+const qreal INITIAL_AVERAGE_REPLY_BYTES = 16 * 1024;
+
+//Weight given to each new reply in the running average of reply sizes
+const qreal AVERAGE_REPLY_WEIGHT = 0.1;
+
+//The window over which utilization is measured. Buckets also hold at most this much burst.
+const qint64 UTILIZATION_WINDOW_MSECS = 1000;
+
+const int DEFAULT_TIMEOUT_MSECS = 30000;
+const int DEFAULT_MAX_RETRIES = 2;
+
+//How often we look for stalled replies
+const int TIMEOUT_CHECK_MSECS = 250;
+
+//The first retry waits about this long. Each further retry waits twice as long, up to the maximum.
+const int RETRY_BASE_DELAY_MSECS = 500;
+const int RETRY_MAX_DELAY_MSECS = 8000;
+
+//Network errors that may go away by themselves, so are worth a retry. TLS, proxy and protocol errors won't.
+const QSet<int> TRANSIENT_NETWORK_ERRORS = QSet<int>() << QNetworkReply::RemoteHostClosedError
+                                                       << QNetworkReply::TimeoutError
+                                                       << QNetworkReply::TemporaryNetworkFailureError
+                                                       << QNetworkReply::NetworkSessionFailedError
+                                                       << QNetworkReply::UnknownNetworkError
+                                                       << QNetworkReply::HostNotFoundError
+                                                       << QNetworkReply::ConnectionRefusedError;
+
+//Points every host somewhere else, e.g. at a local MockTileServer
+const char * HOST_REDIRECT_VARIABLE = "MAPGRAPHICS_HOST_REDIRECT";
+
+//The host name setHostRedirect() files catch-all redirects under
+const QString ANY_HOST = "*";
+
 //static
-QHash<QThread *, MapGraphicsNetwork *> MapGraphicsNetwork::_instances = QHash<QThread *, MapGraphicsNetwork*>();
+MapGraphicsNetwork * MapGraphicsNetwork::_instance = 0;
 QMutex MapGraphicsNetwork::_mutex;
 
 //static
 MapGraphicsNetwork *MapGraphicsNetwork::getInstance()
 {
     QMutexLocker lock(&_mutex);
-    QThread * current = QThread::currentThread();
-    if (!MapGraphicsNetwork::_instances.contains(current))
-        MapGraphicsNetwork::_instances.insert(current, new MapGraphicsNetwork());
-    return MapGraphicsNetwork::_instances.value(current);
+    if (MapGraphicsNetwork::_instance == 0)
+    {
+        MapGraphicsNetwork::_instance = new MapGraphicsNetwork();
+        qAddPostRoutine(MapGraphicsNetwork::cleanup);
+    }
+    return MapGraphicsNetwork::_instance;
 }
 
 MapGraphicsNetwork::~MapGraphicsNetwork()
 {
-    delete _manager;
-    _manager = 0;
+    delete _networkThread;
+    _networkThread = 0;
 }
 
-QNetworkReply *MapGraphicsNetwork::get(QNetworkRequest &request)
+MapGraphicsNetworkReply *MapGraphicsNetwork::get(QNetworkRequest &request)
 {
     request.setRawHeader("User-Agent",
-                         _userAgent);
-    QNetworkReply * toRet = _manager->get(request);
+                         this->userAgent());
+
+#if QT_CONFIG(ssl)
+    //Let TLS sessions be resumed across connections (and therefore across tile sources)
+    QSslConfiguration sslConfig = request.sslConfiguration();
+    sslConfig.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    request.setSslConfiguration(sslConfig);
+#endif
+
+    QMutexLocker lock(&_clientMutex);
+    const quint64 id = ++_nextID;
+    MapGraphicsNetworkReply * toRet = new MapGraphicsNetworkReply(id, request);
+    _clients.insert(id, toRet);
+    lock.unlock();
+
+    const QUrl url = request.url();
+    const QString host = url.host() + ":" + QString::number(url.port(url.scheme() == "https" ? 443 : 80));
+    QMutexLocker statisticsLock(&_statisticsMutex);
+    _statistics.requestsStarted++;
+    _statistics.requestsPerHost[host]++;
+    statisticsLock.unlock();
+
+    //The real work happens in the network thread
+    const QNetworkRequest toSend = request;
+    QMetaObject::invokeMethod(this, [this, id, toSend]()
+    {
+        this->startRequest(id, toSend);
+    }, Qt::QueuedConnection);
+
     return toRet;
 }
 
 void MapGraphicsNetwork::setUserAgent(const QByteArray &agent)
 {
+    QMutexLocker lock(&_clientMutex);
     _userAgent = agent;
 }
 
 QByteArray MapGraphicsNetwork::userAgent() const
 {
+    QMutexLocker lock(&_clientMutex);
     return _userAgent;
 }
 
+void MapGraphicsNetwork::setTransport(MapGraphicsNetworkTransport *transport)
+{
+    if (transport == 0)
+        return;
+
+    //Transports are only ever used in the network thread, so swap it there
+    QMetaObject::invokeMethod(this, [this, transport]()
+    {
+        delete _transport;
+        _transport = transport;
+    }, Qt::QueuedConnection);
+}
+
+void MapGraphicsNetwork::setRateLimit(const QString &budget, qreal requestsPerSecond, qreal bytesPerSecond)
+{
+    QMutexLocker lock(&_budgetMutex);
+    requestsPerSecond = qMax<qreal>(0.0, requestsPerSecond);
+    bytesPerSecond = qMax<qreal>(0.0, bytesPerSecond);
+
+    if (requestsPerSecond == 0.0 && bytesPerSecond == 0.0)
+        _buckets.remove(budget);
+    else
+    {
+        //New budgets start out full
+        const bool isNew = !_buckets.contains(budget);
+        TokenBucket& bucket = _buckets[budget];
+        if (isNew)
+        {
+            bucket.requestTokens = qMax<qreal>(1.0, requestsPerSecond);
+            bucket.byteTokens = bytesPerSecond;
+            bucket.lastRefill = _clock.elapsed();
+        }
+        bucket.requestsPerSecond = requestsPerSecond;
+        bucket.bytesPerSecond = bytesPerSecond;
+    }
+    lock.unlock();
+
+    //Requests that were waiting may be allowed to go now
+    QMetaObject::invokeMethod(this, "startWaitingRequests", Qt::QueuedConnection);
+}
+
+qreal MapGraphicsNetwork::utilization(const QString &budget) const
+{
+    QMutexLocker lock(&_budgetMutex);
+    if (!_buckets.contains(budget))
+        return 0.0;
+
+    const TokenBucket& bucket = _buckets[budget];
+    const qint64 windowStart = _clock.elapsed() - UTILIZATION_WINDOW_MSECS;
+
+    qreal toRet = 0.0;
+    if (bucket.requestsPerSecond > 0.0)
+    {
+        int requests = 0;
+        foreach(qint64 when, bucket.recentRequests)
+        {
+            if (when >= windowStart)
+                requests++;
+        }
+        toRet = qMax<qreal>(toRet, requests / bucket.requestsPerSecond);
+    }
+    if (bucket.bytesPerSecond > 0.0)
+    {
+        qint64 bytes = 0;
+        for (int i = 0; i < bucket.recentBytes.size(); i++)
+        {
+            if (bucket.recentBytes.at(i).first >= windowStart)
+                bytes += bucket.recentBytes.at(i).second;
+        }
+        toRet = qMax<qreal>(toRet, bytes / bucket.bytesPerSecond);
+    }
+    return toRet;
+}
+
+MapGraphicsNetwork::SchedulingProfile MapGraphicsNetwork::schedulingProfile() const
+{
+    QMutexLocker lock(&_budgetMutex);
+    return _profile;
+}
+
+void MapGraphicsNetwork::setSchedulingProfile(MapGraphicsNetwork::SchedulingProfile profile)
+{
+    QMutexLocker lock(&_budgetMutex);
+    _profile = profile;
+}
+
+int MapGraphicsNetwork::defaultTimeout() const
+{
+    QMutexLocker lock(&_clientMutex);
+    return _defaultTimeout;
+}
+
+void MapGraphicsNetwork::setDefaultTimeout(int msecs)
+{
+    QMutexLocker lock(&_clientMutex);
+    _defaultTimeout = qMax<int>(0, msecs);
+}
+
+int MapGraphicsNetwork::defaultMaxRetries() const
+{
+    QMutexLocker lock(&_clientMutex);
+    return _defaultMaxRetries;
+}
+
+void MapGraphicsNetwork::setDefaultMaxRetries(int retries)
+{
+    QMutexLocker lock(&_clientMutex);
+    _defaultMaxRetries = qMax<int>(0, retries);
+}
+
+void MapGraphicsNetwork::setHostRedirect(const QString &host, const QUrl &target)
+{
+    const QString key = host.isEmpty() ? ANY_HOST : host.toLower();
+    QMutexLocker lock(&_clientMutex);
+    if (target.isValid() && !target.host().isEmpty())
+        _hostRedirects.insert(key, target);
+    else
+        _hostRedirects.remove(key);
+}
+
+MapGraphicsNetwork::Statistics MapGraphicsNetwork::statistics() const
+{
+    QMutexLocker lock(&_statisticsMutex);
+    return _statistics;
+}
+
+void MapGraphicsNetwork::resetStatistics()
+{
+    QMutexLocker lock(&_statisticsMutex);
+    _statistics.requestsStarted = 0;
+    _statistics.requestsFinished = 0;
+    _statistics.failures = 0;
+    _statistics.retries = 0;
+    _statistics.timeouts = 0;
+    _statistics.bytesReceived = 0;
+    _statistics.totalLatencyMsecs = 0;
+    _statistics.http2Responses = 0;
+    _statistics.requestsPerHost.clear();
+}
+
 //protected
-MapGraphicsNetwork::MapGraphicsNetwork()
+MapGraphicsNetwork::MapGraphicsNetwork() :
+    QObject(), _manager(0), _transport(new MapGraphicsNetworkTransport()), _defaultTimeout(DEFAULT_TIMEOUT_MSECS),
+    _defaultMaxRetries(DEFAULT_MAX_RETRIES), _nextID(0), _profile(Unmetered),
+    _averageReplyBytes(INITIAL_AVERAGE_REPLY_BYTES), _waitTimer(0), _timeoutTimer(0)
+{
+    _userAgent = DEFAULT_USER_AGENT;
+    _clock.start();
+    this->resetStatistics();
+
+    const QUrl redirect(QString::fromLocal8Bit(qgetenv(HOST_REDIRECT_VARIABLE)));
+    if (!redirect.isEmpty())
+    {
+        if (redirect.isValid() && !redirect.host().isEmpty())
+            _hostRedirects.insert(ANY_HOST, redirect);
+        else
+            qWarning() << "Ignoring invalid" << HOST_REDIRECT_VARIABLE << redirect;
+    }
+
+    //All network I/O happens in a thread of its own
+    _networkThread = new QThread();
+    _networkThread->setObjectName("MapGraphicsNetwork");
+    this->moveToThread(_networkThread);
+    _networkThread->start();
+}
+
+//private slot
+void MapGraphicsNetwork::handleReplyFinished()
+{
+    QNetworkReply * reply = qobject_cast<QNetworkReply *>(QObject::sender());
+    if (reply == 0)
+    {
+        qWarning() << "QNetworkReply cast failure";
+        return;
+    }
+    reply->deleteLater();
+
+    const bool timedOut = _timedOut.remove(reply);
+    _activity.remove(reply);
+
+    if (!_inFlight.contains(reply))
+        return;
+    const quint64 id = _inFlight.take(reply);
+    _inFlightByID.remove(id);
+
+    MapGraphicsNetworkReply::Result result;
+    result.error = reply->error();
+    result.errorString = reply->errorString();
+    result.httpStatusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
+    result.http2WasUsed = reply->attribute(QNetworkRequest::Http2WasUsedAttribute).toBool();
+    result.rawHeaders = reply->rawHeaderPairs();
+    result.body = reply->readAll();
+
+    //We aborted it because it stalled, not because anyone asked us to
+    if (timedOut)
+    {
+        result.error = QNetworkReply::TimeoutError;
+        result.errorString = "No data received for too long";
+    }
+
+    QMutexLocker statisticsLock(&_statisticsMutex);
+    _statistics.bytesReceived += result.body.size();
+    if (timedOut)
+        _statistics.timeouts++;
+    statisticsLock.unlock();
+
+    //Charge the budgets for what the request really cost instead of what we guessed when starting it
+    if (_inFlightEstimates.contains(id))
+    {
+        const QPair<QString, qreal> estimate = _inFlightEstimates.take(id);
+        qint64 actualBytes = result.body.size();
+        foreach(const QNetworkReply::RawHeaderPair& pair, result.rawHeaders)
+            actualBytes += pair.first.size() + pair.second.size() + 4;
+
+        QMutexLocker budgetLock(&_budgetMutex);
+        this->settle(QString(), _clock.elapsed(), estimate.second, actualBytes);
+        if (!estimate.first.isEmpty())
+            this->settle(estimate.first, _clock.elapsed(), estimate.second, actualBytes);
+        _averageReplyBytes += AVERAGE_REPLY_WEIGHT * (actualBytes - _averageReplyBytes);
+        budgetLock.unlock();
+
+        this->startWaitingRequests();
+    }
+
+    //Give it another try if that might help. Otherwise, this is the final answer.
+    if (this->retryRequest(id, result))
+        return;
+    this->deliverResult(id, result);
+}
+
+//private slot
+void MapGraphicsNetwork::shutdown()
 {
-    _manager = new QNetworkAccessManager();
-    this->setUserAgent(DEFAULT_USER_AGENT);
+    //Runs in the network thread so the manager and replies are deleted where they live
+    foreach(QNetworkReply * reply, _inFlight.keys())
+    {
+        reply->disconnect(this);
+        reply->abort();
+        delete reply;
+    }
+    _inFlight.clear();
+    _inFlightByID.clear();
+    _inFlightEstimates.clear();
+    _waiting.clear();
+    _requests.clear();
+    _retries.clear();
+    _retryPending.clear();
+    _activity.clear();
+    _timedOut.clear();
+    _startTimes.clear();
+
+    delete _waitTimer;
+    _waitTimer = 0;
+    delete _timeoutTimer;
+    _timeoutTimer = 0;
+
+    delete _manager;
+    _manager = 0;
+    delete _transport;
+    _transport = 0;
+
+    this->moveToThread(QCoreApplication::instance() ? QCoreApplication::instance()->thread() : 0);
+}
+
+//private static
+void MapGraphicsNetwork::cleanup()
+{
+    QMutexLocker lock(&_mutex);
+    MapGraphicsNetwork * network = MapGraphicsNetwork::_instance;
+    MapGraphicsNetwork::_instance = 0;
+    lock.unlock();
+
+    if (network == 0)
+        return;
+
+    QMetaObject::invokeMethod(network, "shutdown", Qt::BlockingQueuedConnection);
+    network->_networkThread->quit();
+    network->_networkThread->wait();
+    delete network;
+}
+
+//private static
+void MapGraphicsNetwork::forgetReply(quint64 id, bool abortRequest)
+{
+    QMutexLocker lock(&_mutex);
+    MapGraphicsNetwork * network = MapGraphicsNetwork::_instance;
+    if (network == 0)
+        return;
+
+    QMutexLocker clientLock(&network->_clientMutex);
+    network->_clients.remove(id);
+    clientLock.unlock();
+
+    if (abortRequest)
+        network->abortReply(id);
+}
+
+//private
+void MapGraphicsNetwork::abortReply(quint64 id)
+{
+    QMetaObject::invokeMethod(this, [this, id]()
+    {
+        this->abortRequest(id);
+    }, Qt::QueuedConnection);
+}
+
+//private slot
+void MapGraphicsNetwork::startWaitingRequests()
+{
+    if (_waiting.isEmpty())
+        return;
+
+    //Forget about requests whose clients have lost interest so they don't use up any budget
+    QMutexLocker clientLock(&_clientMutex);
+    QList<quint64> abandoned;
+    for (int i = _waiting.size() - 1; i >= 0; i--)
+    {
+        if (!_clients.contains(_waiting.at(i).id))
+            abandoned.append(_waiting.takeAt(i).id);
+    }
+    clientLock.unlock();
+
+    foreach(quint64 id, abandoned)
+        this->forgetRequest(id);
+
+    QMutexLocker lock(&_budgetMutex);
+
+    //IDs only ever grow, so a larger ID is a newer request
+    if (_profile == MeteredLink)
+        std::stable_sort(_waiting.begin(), _waiting.end(), [](const WaitingRequest& a, const WaitingRequest& b)
+        {
+            if (a.priority != b.priority)
+                return a.priority < b.priority;
+            return a.id > b.id;
+        });
+    else
+        std::stable_sort(_waiting.begin(), _waiting.end(), [](const WaitingRequest& a, const WaitingRequest& b)
+        {
+            return a.id > b.id;
+        });
+
+    const qint64 now = _clock.elapsed();
+    qint64 nextAttempt = -1;
+    QList<WaitingRequest> toSend;
+    for (int i = 0; i < _waiting.size();)
+    {
+        const WaitingRequest& waiting = _waiting.at(i);
+
+        //Once the global budget is exhausted nobody gets to go
+        const qint64 globalWait = this->msecsUntilAvailable(QString(), now);
+        if (globalWait > 0)
+        {
+            nextAttempt = (nextAttempt < 0) ? globalWait : qMin<qint64>(nextAttempt, globalWait);
+            break;
+        }
+
+        //A request whose own budget is exhausted lets the others by
+        const qint64 budgetWait = waiting.budget.isEmpty() ? 0 : this->msecsUntilAvailable(waiting.budget, now);
+        if (budgetWait > 0)
+        {
+            nextAttempt = (nextAttempt < 0) ? budgetWait : qMin<qint64>(nextAttempt, budgetWait);
+            i++;
+            continue;
+        }
+
+        this->spend(QString(), now, _averageReplyBytes);
+        if (!waiting.budget.isEmpty())
+            this->spend(waiting.budget, now, _averageReplyBytes);
+        _inFlightEstimates.insert(waiting.id, QPair<QString, qreal>(waiting.budget, _averageReplyBytes));
+        toSend.append(_waiting.takeAt(i));
+    }
+    lock.unlock();
+
+    foreach(const WaitingRequest& waiting, toSend)
+        this->sendRequest(waiting.id, waiting.request);
+
+    //Come back when the budget that stopped us should have refilled
+    if (nextAttempt >= 0)
+    {
+        if (_waitTimer == 0)
+        {
+            _waitTimer = new QTimer(this);
+            _waitTimer->setSingleShot(true);
+            connect(_waitTimer,
+                    SIGNAL(timeout()),
+                    this,
+                    SLOT(startWaitingRequests()));
+        }
+        if (!_waitTimer->isActive() || _waitTimer->remainingTime() > nextAttempt)
+            _waitTimer->start((int)qMax<qint64>(1, nextAttempt));
+    }
+}
+
+//private
+void MapGraphicsNetwork::startRequest(quint64 id, const QNetworkRequest &request)
+{
+    //Don't bother if the client has already lost interest
+    QMutexLocker lock(&_clientMutex);
+    if (!_clients.contains(id))
+    {
+        lock.unlock();
+        this->forgetRequest(id);
+        return;
+    }
+    lock.unlock();
+
+    //Remember the original request in case we have to retry it
+    if (!_requests.contains(id))
+        _requests.insert(id, request);
+    if (!_startTimes.contains(id))
+        _startTimes.insert(id, _clock.elapsed());
+
+    //Requests that count against a budget have to wait their turn
+    const QString budget = request.attribute(MapGraphicsNetwork::BudgetAttribute).toString();
+    QMutexLocker budgetLock(&_budgetMutex);
+    const bool limited = this->isRateLimited(QString()) || (!budget.isEmpty() && this->isRateLimited(budget));
+    budgetLock.unlock();
+
+    if (!limited)
+    {
+        this->sendRequest(id, request);
+        return;
+    }
+
+    WaitingRequest waiting;
+    waiting.id = id;
+    waiting.request = request;
+    waiting.budget = budget;
+    waiting.priority = request.attribute(MapGraphicsNetwork::PriorityAttribute).toInt();
+    _waiting.append(waiting);
+    this->startWaitingRequests();
+}
+
+//private
+void MapGraphicsNetwork::sendRequest(quint64 id, const QNetworkRequest &request)
+{
+    //Don't leave the client hanging if the transport couldn't even start the request
+    QNetworkRequest toSend = request;
+    toSend.setUrl(this->redirectedUrl(request.url()));
+    QNetworkReply * reply = _transport->get(this->manager(), toSend);
+    if (reply == 0)
+    {
+        MapGraphicsNetworkReply::Result result;
+        result.error = QNetworkReply::UnknownNetworkError;
+        result.errorString = "Request could not be started";
+        result.http2WasUsed = false;
+        this->deliverResult(id, result);
+        return;
+    }
+
+    _inFlight.insert(reply, id);
+    _inFlightByID.insert(id, reply);
+    connect(reply,
+            SIGNAL(finished()),
+            this,
+            SLOT(handleReplyFinished()));
+
+    //Watch for stalls
+    QMutexLocker lock(&_clientMutex);
+    const int defaultTimeout = _defaultTimeout;
+    lock.unlock();
+
+    Activity activity;
+    activity.last = _clock.elapsed();
+    activity.timeout = request.attribute(MapGraphicsNetwork::TimeoutAttribute, defaultTimeout).toInt();
+    if (activity.timeout <= 0)
+        return;
+    _activity.insert(reply, activity);
+    connect(reply,
+            SIGNAL(downloadProgress(qint64,qint64)),
+            this,
+            SLOT(handleReplyProgress()));
+
+    if (_timeoutTimer == 0)
+    {
+        _timeoutTimer = new QTimer(this);
+        connect(_timeoutTimer,
+                SIGNAL(timeout()),
+                this,
+                SLOT(checkTimeouts()));
+    }
+    if (!_timeoutTimer->isActive())
+        _timeoutTimer->start(TIMEOUT_CHECK_MSECS);
+}
+
+//private
+void MapGraphicsNetwork::abortRequest(quint64 id)
+{
+    QNetworkReply * reply = _inFlightByID.value(id, 0);
+    if (reply != 0)
+    {
+        reply->abort();
+        return;
+    }
+
+    //Cancelled requests that are waiting to be retried or waiting for their budget never go out at all
+    MapGraphicsNetworkReply::Result canceled;
+    canceled.error = QNetworkReply::OperationCanceledError;
+    canceled.errorString = "Operation canceled";
+    canceled.http2WasUsed = false;
+
+    if (_retryPending.remove(id))
+    {
+        this->deliverResult(id, canceled);
+        return;
+    }
+
+    for (int i = 0; i < _waiting.size(); i++)
+    {
+        if (_waiting.at(i).id != id)
+            continue;
+        _waiting.removeAt(i);
+        this->deliverResult(id, canceled);
+        return;
+    }
+}
+
+//private
+void MapGraphicsNetwork::deliverResult(quint64 id, const MapGraphicsNetworkReply::Result &result)
+{
+    QMutexLocker statisticsLock(&_statisticsMutex);
+    _statistics.requestsFinished++;
+    if (result.error != QNetworkReply::NoError)
+        _statistics.failures++;
+    if (_startTimes.contains(id))
+        _statistics.totalLatencyMsecs += _clock.elapsed() - _startTimes.value(id);
+    if (result.http2WasUsed)
+        _statistics.http2Responses++;
+    statisticsLock.unlock();
+
+    //Whatever happens now, we're done with the request
+    this->forgetRequest(id);
+
+    /*
+      Hand the result to the client in its own thread. We hold the lock while posting so the client
+      can't be destroyed in between; if it's destroyed after, the posted event is discarded with it.
+    */
+    QMutexLocker lock(&_clientMutex);
+    MapGraphicsNetworkReply * client = _clients.take(id);
+    if (client == 0)
+        return;
+
+    QMetaObject::invokeMethod(client, [client, result]()
+    {
+        client->setResult(result);
+    }, Qt::QueuedConnection);
+}
+
+//private
+QNetworkAccessManager *MapGraphicsNetwork::manager()
+{
+    if (_manager == 0)
+        _manager = new QNetworkAccessManager();
+    return _manager;
+}
+
+//private slot
+void MapGraphicsNetwork::handleReplyProgress()
+{
+    QNetworkReply * reply = qobject_cast<QNetworkReply *>(QObject::sender());
+    if (reply != 0 && _activity.contains(reply))
+        _activity[reply].last = _clock.elapsed();
+}
+
+//private slot
+void MapGraphicsNetwork::checkTimeouts()
+{
+    const qint64 now = _clock.elapsed();
+    QList<QNetworkReply *> stalled;
+    QHash<QNetworkReply *, Activity>::const_iterator iter;
+    for (iter = _activity.constBegin(); iter != _activity.constEnd(); iter++)
+    {
+        if (now - iter.value().last >= iter.value().timeout)
+            stalled.append(iter.key());
+    }
+
+    //Aborting makes the reply finish, and handleReplyFinished() takes it from there
+    foreach(QNetworkReply * reply, stalled)
+    {
+        _timedOut.insert(reply);
+        reply->abort();
+    }
+
+    if (_activity.isEmpty())
+        _timeoutTimer->stop();
+}
+
+//private
+bool MapGraphicsNetwork::retryRequest(quint64 id, const MapGraphicsNetworkReply::Result &result)
+{
+    if (!_requests.contains(id))
+        return false;
+
+    //Only retry failures that may go away by themselves. Cancellations were asked for.
+    const int status = result.httpStatusCode.toInt();
+    const bool connectionTrouble = TRANSIENT_NETWORK_ERRORS.contains(result.error);
+    const bool serverTrouble = (status == 408 || status == 429 || (status >= 500 && status <= 599));
+    if (!connectionTrouble && !serverTrouble)
+        return false;
+
+    const QNetworkRequest request = _requests.value(id);
+    QMutexLocker lock(&_clientMutex);
+    const int maxRetries = request.attribute(MapGraphicsNetwork::MaxRetriesAttribute, _defaultMaxRetries).toInt();
+    const bool wanted = _clients.contains(id);
+    lock.unlock();
+
+    const int retries = _retries.value(id);
+    if (!wanted || retries >= maxRetries)
+        return false;
+    _retries.insert(id, retries + 1);
+
+    QMutexLocker statisticsLock(&_statisticsMutex);
+    _statistics.retries++;
+    statisticsLock.unlock();
+
+    //Back off exponentially, with jitter so a burst of failures doesn't come back as a burst of retries
+    const int ceiling = qMin<int>(RETRY_MAX_DELAY_MSECS, RETRY_BASE_DELAY_MSECS << qMin<int>(retries, 16));
+    const int delay = ceiling / 2 + (int)QRandomGenerator::global()->bounded(ceiling / 2 + 1);
+
+    _retryPending.insert(id);
+    QTimer::singleShot(delay, this, [this, id, request]()
+    {
+        //Cancelled while we were waiting
+        if (!_retryPending.remove(id))
+            return;
+        this->startRequest(id, request);
+    });
+    return true;
+}
+
+//private
+void MapGraphicsNetwork::forgetRequest(quint64 id)
+{
+    _requests.remove(id);
+    _retries.remove(id);
+    _retryPending.remove(id);
+    _startTimes.remove(id);
+}
+
+//private
+QUrl MapGraphicsNetwork::redirectedUrl(const QUrl &url) const
+{
+    QMutexLocker lock(&_clientMutex);
+    if (_hostRedirects.isEmpty())
+        return url;
+
+    const QString host = url.host().toLower();
+    QUrl target;
+    if (_hostRedirects.contains(host))
+        target = _hostRedirects.value(host);
+    else if (_hostRedirects.contains(ANY_HOST))
+        target = _hostRedirects.value(ANY_HOST);
+    else
+        return url;
+    lock.unlock();
+
+    QUrl toRet = url;
+    toRet.setScheme(target.scheme());
+    toRet.setHost(target.host());
+    toRet.setPort(target.port());
+    return toRet;
+}
+
+//private
+bool MapGraphicsNetwork::isRateLimited(const QString &budget) const
+{
+    return _buckets.contains(budget);
+}
+
+//private
+qint64 MapGraphicsNetwork::msecsUntilAvailable(const QString &budget, qint64 now)
+{
+    if (!_buckets.contains(budget))
+        return 0;
+    TokenBucket& bucket = _buckets[budget];
+
+    //Top the bucket up for the time that has passed. It holds at most a second's worth of tokens.
+    const qreal seconds = (now - bucket.lastRefill) / 1000.0;
+    bucket.lastRefill = now;
+    if (bucket.requestsPerSecond > 0.0)
+        bucket.requestTokens = qMin<qreal>(qMax<qreal>(1.0, bucket.requestsPerSecond),
+                                           bucket.requestTokens + seconds * bucket.requestsPerSecond);
+    if (bucket.bytesPerSecond > 0.0)
+        bucket.byteTokens = qMin<qreal>(bucket.bytesPerSecond,
+                                        bucket.byteTokens + seconds * bucket.bytesPerSecond);
+
+    /*
+      A request needs a whole request token. For bytes we only insist that we aren't in debt: replies
+      are charged their estimated size up front, which keeps the link busy without going over budget.
+    */
+    qint64 toRet = 0;
+    if (bucket.requestsPerSecond > 0.0 && bucket.requestTokens < 1.0)
+        toRet = qMax<qint64>(toRet, (qint64)ceil((1.0 - bucket.requestTokens) * 1000.0 / bucket.requestsPerSecond));
+    if (bucket.bytesPerSecond > 0.0 && bucket.byteTokens < 0.0)
+        toRet = qMax<qint64>(toRet, (qint64)ceil(-bucket.byteTokens * 1000.0 / bucket.bytesPerSecond));
+    return toRet;
+}
+
+//private
+void MapGraphicsNetwork::spend(const QString &budget, qint64 now, qreal bytes)
+{
+    if (!_buckets.contains(budget))
+        return;
+    TokenBucket& bucket = _buckets[budget];
+
+    if (bucket.requestsPerSecond > 0.0)
+        bucket.requestTokens -= 1.0;
+    if (bucket.bytesPerSecond > 0.0)
+        bucket.byteTokens -= bytes;
+
+    bucket.recentRequests.append(now);
+    while (!bucket.recentRequests.isEmpty() && bucket.recentRequests.first() < now - UTILIZATION_WINDOW_MSECS)
+        bucket.recentRequests.removeFirst();
+}
+
+//private
+void MapGraphicsNetwork::settle(const QString &budget, qint64 now, qreal estimatedBytes, qint64 actualBytes)
+{
+    if (!_buckets.contains(budget))
+        return;
+    TokenBucket& bucket = _buckets[budget];
+
+    if (bucket.bytesPerSecond > 0.0)
+        bucket.byteTokens -= actualBytes - estimatedBytes;
+
+    bucket.recentBytes.append(QPair<qint64, qint64>(now, actualBytes));
+    while (!bucket.recentBytes.isEmpty() && bucket.recentBytes.first().first < now - UTILIZATION_WINDOW_MSECS)
+        bucket.recentBytes.removeFirst();
 }
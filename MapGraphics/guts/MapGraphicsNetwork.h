@@ -1,31 +1,266 @@
 #ifndef MAPGRAPHICSNETWORK_H
 #define MAPGRAPHICSNETWORK_H
 
+#include <QObject>
 #include <QMutex>
 #include <QNetworkAccessManager>
+#include <QNetworkRequest>
 #include <QHash>
+#include <QElapsedTimer>
+#include <QList>
+#include <QSet>
+#include <QUrl>
 
-class MapGraphicsNetwork
+#include "MapGraphics_global.h"
+#include "MapGraphicsNetworkReply.h"
+
+class QThread;
+class QTimer;
+class MapGraphicsNetworkTransport;
+
+/*!
+ \brief The network stack shared by every tile source.
+
+ MapGraphicsNetwork owns a single QNetworkAccessManager, running in a network I/O thread of its own, so
+ every source shares one connection pool, DNS cache and TLS session cache. Requests can be made from any
+ thread with get(); the returned MapGraphicsNetworkReply lives in the calling thread.
+
+ Requests can be throttled with token buckets (requests/sec and bytes/sec): a global budget that every
+ request counts against, plus named budgets (usually one per tile source) that requests opt into with
+ BudgetAttribute. Requests that would exceed a budget wait in the network thread until it refills.
+
+ A request that receives no data for its timeout is aborted and finishes with QNetworkReply::TimeoutError.
+ Requests that time out or fail in a way that may go away by itself (connection trouble, 408, 429, 5xx)
+ are retried a limited number of times with jittered exponential backoff before the failure is reported.
+
+ For testing, requests to a host can be redirected somewhere else (such as the MockTileServer) with
+ setHostRedirect() or the MAPGRAPHICS_HOST_REDIRECT environment variable, and statistics() tells how
+ the requests went.
+*/
+class MAPGRAPHICSSHARED_EXPORT MapGraphicsNetwork : public QObject
 {
+    Q_OBJECT
+public:
+    /*!
+     \brief The order in which requests that are waiting for a budget are started. Unmetered starts the
+     newest first. MeteredLink starts the lowest PriorityAttribute first (tile sources use the zoom level,
+     so coarse tiles that cover the most screen arrive first) and the newest first among equals.
+    */
+    enum SchedulingProfile
+    {
+        Unmetered,
+        MeteredLink
+    };
+
+    //QString: the name of the budget the request counts against, in addition to the global one
+    static const QNetworkRequest::Attribute BudgetAttribute = (QNetworkRequest::Attribute)(QNetworkRequest::User + 1);
+
+    //int: lower values are started first by the MeteredLink profile
+    static const QNetworkRequest::Attribute PriorityAttribute = (QNetworkRequest::Attribute)(QNetworkRequest::User + 2);
+
+    //int: milliseconds without receiving data before the request is aborted. 0 disables the timeout.
+    static const QNetworkRequest::Attribute TimeoutAttribute = (QNetworkRequest::Attribute)(QNetworkRequest::User + 3);
+
+    //int: how many times the request may be retried
+    static const QNetworkRequest::Attribute MaxRetriesAttribute = (QNetworkRequest::Attribute)(QNetworkRequest::User + 4);
+
+    struct Statistics
+    {
+        //Requests made with get(), and how many of them have been given a final answer
+        quint64 requestsStarted;
+        quint64 requestsFinished;
+
+        //Final answers that were errors, retries made along the way, and attempts that stalled
+        quint64 failures;
+        quint64 retries;
+        quint64 timeouts;
+
+        //Body bytes of every attempt, and the sum over finished requests of the time from get() to the answer
+        quint64 bytesReceived;
+        quint64 totalLatencyMsecs;
+
+        //Finished requests whose answer came over HTTP/2
+        quint64 http2Responses;
+
+        //Requests made with get(), by the "host:port" they were made to (before any host redirect)
+        QHash<QString, quint64> requestsPerHost;
+    };
+
 public:
     static MapGraphicsNetwork * getInstance();
 
     ~MapGraphicsNetwork();
 
-    QNetworkReply * get(QNetworkRequest& request);
+    /*!
+     \brief Starts a GET request. Can be called from any thread. The caller takes ownership of the
+     returned reply, which emits finished() in the caller's thread.
+    */
+    MapGraphicsNetworkReply * get(QNetworkRequest& request);
 
     void setUserAgent(const QByteArray& agent);
     QByteArray userAgent() const;
 
+    /*!
+     \brief Replaces the transport used to start requests. MapGraphicsNetwork takes ownership. Requests
+     that have already been started are not affected.
+    */
+    void setTransport(MapGraphicsNetworkTransport * transport);
+
+    /*!
+     \brief Limits the requests counting against budget to requestsPerSecond and bytesPerSecond. An empty
+     budget name is the global budget. A rate of 0 means unlimited; setting both to 0 removes the budget.
+     Can be called from any thread.
+    */
+    void setRateLimit(const QString& budget, qreal requestsPerSecond, qreal bytesPerSecond);
+
+    /*!
+     \brief Returns how much of the budget was used over the last second, from 0.0 to (about) 1.0. For
+     budgets limiting both requests and bytes, the busier of the two is reported. Unlimited budgets report 0.
+    */
+    qreal utilization(const QString& budget = QString()) const;
+
+    MapGraphicsNetwork::SchedulingProfile schedulingProfile() const;
+    void setSchedulingProfile(MapGraphicsNetwork::SchedulingProfile profile);
+
+    int defaultTimeout() const;
+
+    /*!
+     \brief Sets the timeout for requests that don't set TimeoutAttribute: how many milliseconds may pass
+     without receiving any data before a request is aborted. 0 disables the timeout. Defaults to 30 seconds.
+    */
+    void setDefaultTimeout(int msecs);
+
+    int defaultMaxRetries() const;
+
+    /*!
+     \brief Sets how many times requests that don't set MaxRetriesAttribute are retried. Defaults to 2.
+    */
+    void setDefaultMaxRetries(int retries);
+
+    /*!
+     \brief Sends requests for host to target's scheme, host and port instead, keeping the path and query.
+     An empty host or "*" redirects every host. An invalid target removes the redirect. Replies still
+     report the original URL. The MAPGRAPHICS_HOST_REDIRECT environment variable sets the catch-all
+     redirect at startup, e.g. MAPGRAPHICS_HOST_REDIRECT=http://127.0.0.1:8080
+    */
+    void setHostRedirect(const QString& host, const QUrl& target);
+
+    MapGraphicsNetwork::Statistics statistics() const;
+    void resetStatistics();
+
 protected:
     MapGraphicsNetwork();
 
+private slots:
+    void handleReplyFinished();
+    void shutdown();
+    void startWaitingRequests();
+    void handleReplyProgress();
+    void checkTimeouts();
+
 private:
-    static QHash<QThread *, MapGraphicsNetwork *> _instances;
+    friend class MapGraphicsNetworkReply;
+
+    //Tears the network thread down when the application exits
+    static void cleanup();
+
+    //Called by MapGraphicsNetworkReply's destructor. Safe to call after cleanup().
+    static void forgetReply(quint64 id, bool abortRequest);
+
+    //Called by MapGraphicsNetworkReply::abort()
+    void abortReply(quint64 id);
+
+    //These run in the network thread
+    void startRequest(quint64 id, const QNetworkRequest& request);
+    void sendRequest(quint64 id, const QNetworkRequest& request);
+    void abortRequest(quint64 id);
+    void deliverResult(quint64 id, const MapGraphicsNetworkReply::Result& result);
+    bool retryRequest(quint64 id, const MapGraphicsNetworkReply::Result& result);
+    void forgetRequest(quint64 id);
+    QUrl redirectedUrl(const QUrl& url) const;
+    QNetworkAccessManager * manager();
+
+    struct TokenBucket
+    {
+        qreal requestsPerSecond;
+        qreal bytesPerSecond;
+        qreal requestTokens;
+        qreal byteTokens;
+        qint64 lastRefill;
+
+        //When requests were started and how many bytes finished when, over about the last second
+        QList<qint64> recentRequests;
+        QList<QPair<qint64, qint64> > recentBytes;
+    };
+
+    struct WaitingRequest
+    {
+        quint64 id;
+        QNetworkRequest request;
+        QString budget;
+        int priority;
+    };
+
+    //These expect _budgetMutex to be held
+    bool isRateLimited(const QString& budget) const;
+    qint64 msecsUntilAvailable(const QString& budget, qint64 now);
+    void spend(const QString& budget, qint64 now, qreal bytes);
+    void settle(const QString& budget, qint64 now, qreal estimatedBytes, qint64 actualBytes);
+
+    static MapGraphicsNetwork * _instance;
     static QMutex _mutex;
+
+    QThread * _networkThread;
+
+    //Created lazily in the network thread
     QNetworkAccessManager * _manager;
+    MapGraphicsNetworkTransport * _transport;
 
+    //Guards _userAgent and _clients, which are used from all threads
+    mutable QMutex _clientMutex;
     QByteArray _userAgent;
+    int _defaultTimeout;
+    int _defaultMaxRetries;
+    quint64 _nextID;
+    QHash<quint64, MapGraphicsNetworkReply *> _clients;
+    QHash<QString, QUrl> _hostRedirects;
+
+    //Network thread only
+    QHash<QNetworkReply *, quint64> _inFlight;
+    QHash<quint64, QNetworkReply *> _inFlightByID;
+
+    //Guards the budgets, which are configured from any thread
+    mutable QMutex _budgetMutex;
+    QHash<QString, TokenBucket> _buckets;
+    SchedulingProfile _profile;
+    QElapsedTimer _clock;
+    qreal _averageReplyBytes;
+
+    //Network thread only
+    QList<WaitingRequest> _waiting;
+    QHash<quint64, QPair<QString, qreal> > _inFlightEstimates;
+    QTimer * _waitTimer;
+
+    //Network thread only. Every request we haven't given a final answer for, and how often it was retried.
+    QHash<quint64, QNetworkRequest> _requests;
+    QHash<quint64, int> _retries;
+    QSet<quint64> _retryPending;
+
+    //Network thread only. When each reply last received data, and how long it may go without.
+    struct Activity
+    {
+        qint64 last;
+        int timeout;
+    };
+    QHash<QNetworkReply *, Activity> _activity;
+    QSet<QNetworkReply *> _timedOut;
+    QTimer * _timeoutTimer;
+
+    //Network thread only. When each request we haven't answered yet was first started.
+    QHash<quint64, qint64> _startTimes;
+
+    mutable QMutex _statisticsMutex;
+    Statistics _statistics;
 };
 
 #endif // MAPGRAPHICSNETWORK_H
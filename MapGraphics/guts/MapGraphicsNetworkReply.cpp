@@ -0,0 +1,92 @@
+#include "MapGraphicsNetworkReply.h"
+
+#include "MapGraphicsNetwork.h"
+
+MapGraphicsNetworkReply::~MapGraphicsNetworkReply()
+{
+    //Make sure the network doesn't try to talk to us anymore, and stop the request if it's still running
+    MapGraphicsNetwork::forgetReply(_id, !_finished);
+}
+
+const QNetworkRequest &MapGraphicsNetworkReply::request() const
+{
+    return _request;
+}
+
+bool MapGraphicsNetworkReply::isFinished() const
+{
+    return _finished;
+}
+
+QNetworkReply::NetworkError MapGraphicsNetworkReply::error() const
+{
+    return _result.error;
+}
+
+QString MapGraphicsNetworkReply::errorString() const
+{
+    return _result.errorString;
+}
+
+QVariant MapGraphicsNetworkReply::httpStatusCode() const
+{
+    return _result.httpStatusCode;
+}
+
+bool MapGraphicsNetworkReply::http2WasUsed() const
+{
+    return _result.http2WasUsed;
+}
+
+bool MapGraphicsNetworkReply::hasRawHeader(const QByteArray &headerName) const
+{
+    foreach(const QNetworkReply::RawHeaderPair& pair, _result.rawHeaders)
+    {
+        if (pair.first.compare(headerName, Qt::CaseInsensitive) == 0)
+            return true;
+    }
+    return false;
+}
+
+QByteArray MapGraphicsNetworkReply::rawHeader(const QByteArray &headerName) const
+{
+    foreach(const QNetworkReply::RawHeaderPair& pair, _result.rawHeaders)
+    {
+        if (pair.first.compare(headerName, Qt::CaseInsensitive) == 0)
+            return pair.second;
+    }
+    return QByteArray();
+}
+
+QByteArray MapGraphicsNetworkReply::readAll()
+{
+    QByteArray toRet = _result.body;
+    _result.body.clear();
+    return toRet;
+}
+
+void MapGraphicsNetworkReply::abort()
+{
+    if (_finished)
+        return;
+    MapGraphicsNetwork::getInstance()->abortReply(_id);
+}
+
+//private
+MapGraphicsNetworkReply::MapGraphicsNetworkReply(quint64 id, const QNetworkRequest &request) :
+    QObject(), _id(id), _request(request), _finished(false)
+{
+    _result.error = QNetworkReply::NoError;
+    _result.http2WasUsed = false;
+}
+
+//private
+void MapGraphicsNetworkReply::setResult(const MapGraphicsNetworkReply::Result &result)
+{
+    if (_finished)
+        return;
+
+    _result = result;
+    _finished = true;
+    this->finished();
+}
@@ -0,0 +1,80 @@
+#ifndef MAPGRAPHICSNETWORKREPLY_H
+#define MAPGRAPHICSNETWORKREPLY_H
+
+#include <QObject>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QByteArray>
+#include <QHash>
+#include <QVariant>
+
+#include "MapGraphics_global.h"
+
+/*!
+ \brief The result of a request made through MapGraphicsNetwork.
+
+ The real QNetworkReply lives in MapGraphicsNetwork's thread. This object lives in the thread that made
+ the request, so it is safe to use there: finished() is emitted in that thread once the response has been
+ completely received, after which the accessors return the response. Deleting the reply before it has
+ finished cancels the request.
+*/
+class MAPGRAPHICSSHARED_EXPORT MapGraphicsNetworkReply : public QObject
+{
+    Q_OBJECT
+public:
+    /*!
+     \brief Everything we keep from a finished QNetworkReply
+    */
+    struct Result
+    {
+        QNetworkReply::NetworkError error;
+        QString errorString;
+        QVariant httpStatusCode;
+        bool http2WasUsed;
+        QList<QNetworkReply::RawHeaderPair> rawHeaders;
+        QByteArray body;
+    };
+
+public:
+    ~MapGraphicsNetworkReply();
+
+    const QNetworkRequest& request() const;
+
+    bool isFinished() const;
+
+    QNetworkReply::NetworkError error() const;
+    QString errorString() const;
+
+    //The HTTP status code, or an invalid QVariant if there wasn't one
+    QVariant httpStatusCode() const;
+
+    //True if the response came over an HTTP/2 connection
+    bool http2WasUsed() const;
+
+    bool hasRawHeader(const QByteArray& headerName) const;
+    QByteArray rawHeader(const QByteArray& headerName) const;
+
+    //Returns the body of the response. Like QNetworkReply::readAll(), the body can only be read once.
+    QByteArray readAll();
+
+    //Cancels the request. finished() will still be emitted, with QNetworkReply::OperationCanceledError.
+    void abort();
+
+signals:
+    void finished();
+
+private:
+    //Only MapGraphicsNetwork makes replies
+    friend class MapGraphicsNetwork;
+    MapGraphicsNetworkReply(quint64 id, const QNetworkRequest& request);
+
+    //Called in our thread by MapGraphicsNetwork when the response is in
+    void setResult(const MapGraphicsNetworkReply::Result& result);
+
+    quint64 _id;
+    QNetworkRequest _request;
+    bool _finished;
+    Result _result;
+};
+
+#endif // MAPGRAPHICSNETWORKREPLY_H
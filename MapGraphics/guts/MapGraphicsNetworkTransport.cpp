@@ -0,0 +1,14 @@
+#include "MapGraphicsNetworkTransport.h"
+
+MapGraphicsNetworkTransport::MapGraphicsNetworkTransport()
+{
+}
+
+MapGraphicsNetworkTransport::~MapGraphicsNetworkTransport()
+{
+}
+
+QNetworkReply *MapGraphicsNetworkTransport::get(QNetworkAccessManager *manager, const QNetworkRequest &request)
+{
+    return manager->get(request);
+}
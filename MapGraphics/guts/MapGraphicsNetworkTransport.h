@@ -0,0 +1,33 @@
+#ifndef MAPGRAPHICSNETWORKTRANSPORT_H
+#define MAPGRAPHICSNETWORKTRANSPORT_H
+
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+
+#include "MapGraphics_global.h"
+
+/*!
+ \brief Starts the actual network requests for MapGraphicsNetwork.
+
+ The default implementation just hands requests to MapGraphicsNetwork's QNetworkAccessManager. Subclass
+ it and pass it to MapGraphicsNetwork::setTransport() to send requests somewhere else, e.g. to rewrite
+ URLs so they point at a local stand-in server, or to answer them with custom QNetworkReply subclasses.
+*/
+class MAPGRAPHICSSHARED_EXPORT MapGraphicsNetworkTransport
+{
+public:
+    MapGraphicsNetworkTransport();
+    virtual ~MapGraphicsNetworkTransport();
+
+    /*!
+     \brief Starts request and returns the reply, which MapGraphicsNetwork takes ownership of.
+     Always called in MapGraphicsNetwork's thread.
+
+     \param manager the network's shared QNetworkAccessManager
+     \param request the request to start
+    */
+    virtual QNetworkReply * get(QNetworkAccessManager * manager, const QNetworkRequest& request);
+};
+
+#endif // MAPGRAPHICSNETWORKTRANSPORT_H
@@ -0,0 +1,106 @@
+#include "MapMetatileSplitter.h"
+
+#include "MapTileBlender.h"
+
+#include <QtEndian>
+
+//Magic number at the start of mod_tile's metatile files
+const QByteArray META_MAGIC = "META";
+
+//magic, count, x, y, z
+const int META_HEADER_BYTES = 4 + 4 * 4;
+
+//Each index entry is an offset and a size
+const int META_ENTRY_BYTES = 2 * 4;
+
+//static
+bool MapMetatileSplitter::split(const QByteArray &data, quint32 x, quint32 y, quint8 z, int size, quint16 tileSize,
+                                QList<MapMetatileSplitter::Tile> *tiles)
+{
+    if (tiles == 0 || size < 1 || data.isEmpty())
+        return false;
+
+    if (data.startsWith(META_MAGIC))
+        return MapMetatileSplitter::splitContainer(data, x, y, z, size, tiles);
+    return MapMetatileSplitter::splitImage(data, x, y, z, size, tileSize, tiles);
+}
+
+//private static
+bool MapMetatileSplitter::splitContainer(const QByteArray &data, quint32 x, quint32 y, quint8 z, int size,
+                                         QList<MapMetatileSplitter::Tile> *tiles)
+{
+    if (data.size() < META_HEADER_BYTES)
+        return false;
+
+    //All of mod_tile's integers are little-endian
+    const uchar * bytes = reinterpret_cast<const uchar *>(data.constData());
+    const qint32 count = qFromLittleEndian<qint32>(bytes + 4);
+    if (count < size * size || data.size() < META_HEADER_BYTES + count * META_ENTRY_BYTES)
+        return false;
+
+    //Near the top of the pyramid there are fewer tiles than fit in a metatile
+    const quint32 tilesPerSide = (quint32)1 << qMin<int>(z, 31);
+
+    bool foundAny = false;
+    for (int dx = 0; dx < size; dx++)
+    {
+        for (int dy = 0; dy < size; dy++)
+        {
+            if (x + dx >= tilesPerSide || y + dy >= tilesPerSide)
+                continue;
+
+            //Entries are in column-major order
+            const uchar * entry = bytes + META_HEADER_BYTES + (dx * size + dy) * META_ENTRY_BYTES;
+            const qint32 offset = qFromLittleEndian<qint32>(entry);
+            const qint32 length = qFromLittleEndian<qint32>(entry + 4);
+            if (offset < 0 || length <= 0 || (qint64)offset + length > data.size())
+                continue;
+
+            Tile tile;
+            tile.x = x + dx;
+            tile.y = y + dy;
+            if (!tile.image.loadFromData(bytes + offset, length))
+                continue;
+            MapTileBlender::detectOpaque(&tile.image);
+
+            tiles->append(tile);
+            foundAny = true;
+        }
+    }
+
+    return foundAny;
+}
+
+//private static
+bool MapMetatileSplitter::splitImage(const QByteArray &data, quint32 x, quint32 y, quint8 z, int size, quint16 tileSize,
+                                     QList<MapMetatileSplitter::Tile> *tiles)
+{
+    QImage image;
+    if (!image.loadFromData(data) || tileSize == 0)
+        return false;
+
+    //Near the top of the pyramid the image only covers the tiles that exist
+    const quint32 tilesPerSide = (quint32)1 << qMin<int>(z, 31);
+    const int across = qMin<int>(size, image.width() / tileSize);
+    const int down = qMin<int>(size, image.height() / tileSize);
+
+    bool foundAny = false;
+    for (int dx = 0; dx < across; dx++)
+    {
+        for (int dy = 0; dy < down; dy++)
+        {
+            if (x + dx >= tilesPerSide || y + dy >= tilesPerSide)
+                continue;
+
+            Tile tile;
+            tile.x = x + dx;
+            tile.y = y + dy;
+            tile.image = image.copy(dx * tileSize, dy * tileSize, tileSize, tileSize);
+            MapTileBlender::detectOpaque(&tile.image);
+            tiles->append(tile);
+            foundAny = true;
+        }
+    }
+
+    return foundAny;
+}
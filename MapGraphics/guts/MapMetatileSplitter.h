@@ -0,0 +1,45 @@
+#ifndef MAPMETATILESPLITTER_H
+#define MAPMETATILESPLITTER_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QList>
+
+/*!
+ \brief Splits a metatile (a block of size x size tiles fetched in one request) into its tiles.
+
+ Two kinds of metatiles are understood: the "META" container written by mod_tile/renderd, which holds
+ each tile as a separately encoded image, and a single image covering the whole block. Everything here
+ is reentrant, so it can be used from worker threads.
+*/
+class MapMetatileSplitter
+{
+public:
+    struct Tile
+    {
+        quint32 x;
+        quint32 y;
+        QImage image;
+    };
+
+public:
+    /*!
+     \brief Splits the metatile whose top-left tile is x,y on zoom level z into its tiles and appends
+     them to *tiles. Tiles that would be off the edge of the world are skipped. Returns false if data
+     isn't a metatile we understand.
+
+     \param data the metatile as received
+     \param size the number of tiles along each edge of the metatile
+     \param tileSize the length/width of a single tile, used to cut up single-image metatiles
+    */
+    static bool split(const QByteArray& data, quint32 x, quint32 y, quint8 z, int size, quint16 tileSize,
+                      QList<MapMetatileSplitter::Tile> * tiles);
+
+private:
+    static bool splitContainer(const QByteArray& data, quint32 x, quint32 y, quint8 z, int size,
+                               QList<MapMetatileSplitter::Tile> * tiles);
+    static bool splitImage(const QByteArray& data, quint32 x, quint32 y, quint8 z, int size, quint16 tileSize,
+                           QList<MapMetatileSplitter::Tile> * tiles);
+};
+
+#endif // MAPMETATILESPLITTER_H
@@ -0,0 +1,480 @@
+#include "MapTileBlender.h"
+
+#include <QVarLengthArray>
+#include <QList>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MAPGRAPHICS_BLENDER_SSE2
+#include <emmintrin.h>
+//GCC and Clang can build an AVX2 kernel without the rest of the library needing AVX2
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MAPGRAPHICS_BLENDER_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MAPGRAPHICS_BLENDER_NEON
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+typedef void (*BlendKernel)(quint32 *, const quint32 *, int, int);
+typedef void (*FilterKernel)(quint32 *, int, const float *);
+
+//Multiplies each 8-bit channel of x by a/255, two channels at a time
+inline quint32 byteMul(quint32 x, quint32 a)
+{
+    quint32 t = (x & 0xff00ff) * a;
+    t = (t + ((t >> 8) & 0xff00ff) + 0x800080) >> 8;
+    t &= 0xff00ff;
+
+    x = ((x >> 8) & 0xff00ff) * a;
+    x = (x + ((x >> 8) & 0xff00ff) + 0x800080);
+    x &= 0xff00ff00;
+    return x | t;
+}
+
+void blendScalar(quint32 * dst, const quint32 * src, int count, int opacity)
+{
+    for (int i = 0; i < count; i++)
+    {
+        quint32 s = src[i];
+        if (opacity != 255)
+            s = byteMul(s, opacity);
+
+        //Opaque and fully transparent pixels are common in map tiles, and cheap
+        const quint32 alpha = s >> 24;
+        if (alpha == 255)
+            dst[i] = s;
+        else if (s != 0)
+            dst[i] = s + byteMul(dst[i], 255 - alpha);
+    }
+}
+
+/*
+  Colour filters work on premultiplied pixels, so the matrix offsets are scaled by alpha, and results are
+  clamped to [0, alpha] to stay valid premultiplied colours. Alpha itself is left alone.
+*/
+void filterScalar(quint32 * pixels, int count, const float * m)
+{
+    for (int i = 0; i < count; i++)
+    {
+        const quint32 p = pixels[i];
+        const float a = (float)(p >> 24);
+        if (a == 0.0f)
+            continue;
+
+        const float r = (float)((p >> 16) & 0xff);
+        const float g = (float)((p >> 8) & 0xff);
+        const float b = (float)(p & 0xff);
+
+        quint32 out = p & 0xff000000;
+        for (int row = 0; row < 3; row++)
+        {
+            const float v = m[row*4]*r + m[row*4 + 1]*g + m[row*4 + 2]*b + m[row*4 + 3]*a;
+            out |= (quint32)(qBound(0.0f, v, a) + 0.5f) << (16 - 8*row);
+        }
+        pixels[i] = out;
+    }
+}
+
+#ifdef MAPGRAPHICS_BLENDER_SSE2
+//x / 255, rounded, for 16-bit lanes holding products of two bytes
+inline __m128i div255SSE2(__m128i x)
+{
+    const __m128i t = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+void blendSSE2(quint32 * dst, const quint32 * src, int count, int opacity)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i opacity16 = _mm_set1_epi16((short)opacity);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+
+        //Two pixels per register, one channel per 16-bit lane
+        __m128i sLo = _mm_unpacklo_epi8(s, zero);
+        __m128i sHi = _mm_unpackhi_epi8(s, zero);
+        if (opacity != 255)
+        {
+            sLo = div255SSE2(_mm_mullo_epi16(sLo, opacity16));
+            sHi = div255SSE2(_mm_mullo_epi16(sHi, opacity16));
+        }
+
+        //Spread each pixel's alpha (lane 3 of its four) over all of its lanes
+        const __m128i invLo = _mm_sub_epi16(max, _mm_shufflehi_epi16(_mm_shufflelo_epi16(sLo, 0xFF), 0xFF));
+        const __m128i invHi = _mm_sub_epi16(max, _mm_shufflehi_epi16(_mm_shufflelo_epi16(sHi, 0xFF), 0xFF));
+
+        const __m128i dLo = _mm_add_epi16(sLo, div255SSE2(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), invLo)));
+        const __m128i dHi = _mm_add_epi16(sHi, div255SSE2(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), invHi)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(dLo, dHi));
+    }
+
+    blendScalar(dst + i, src + i, count - i, opacity);
+}
+
+//The colour filter in single precision floats, four pixels at a time, one channel per register
+void filterSSE2(quint32 * pixels, int count, const float * m)
+{
+    const __m128i mask = _mm_set1_epi32(0xff);
+    const __m128 zero = _mm_setzero_ps();
+    __m128 coefficients[12];
+    for (int k = 0; k < 12; k++)
+        coefficients[k] = _mm_set1_ps(m[k]);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + i));
+        const __m128i alpha = _mm_srli_epi32(p, 24);
+        const __m128 a = _mm_cvtepi32_ps(alpha);
+        const __m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 16), mask));
+        const __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(p, 8), mask));
+        const __m128 b = _mm_cvtepi32_ps(_mm_and_si128(p, mask));
+
+        __m128i out = _mm_slli_epi32(alpha, 24);
+        for (int row = 0; row < 3; row++)
+        {
+            __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(coefficients[row*4], r),
+                                             _mm_mul_ps(coefficients[row*4 + 1], g)),
+                                  _mm_add_ps(_mm_mul_ps(coefficients[row*4 + 2], b),
+                                             _mm_mul_ps(coefficients[row*4 + 3], a)));
+            v = _mm_min_ps(_mm_max_ps(v, zero), a);
+            out = _mm_or_si128(out, _mm_sll_epi32(_mm_cvtps_epi32(v), _mm_cvtsi32_si128(16 - 8*row)));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(pixels + i), out);
+    }
+
+    filterScalar(pixels + i, count - i, m);
+}
+#endif
+
+#ifdef MAPGRAPHICS_BLENDER_AVX2
+__attribute__((target("avx2")))
+inline __m256i div255AVX2(__m256i x)
+{
+    const __m256i t = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+//Same as the SSE2 kernel, eight pixels at a time. Unpacking and packing work within 128-bit lanes, so
+//pixels end up back where they started.
+__attribute__((target("avx2")))
+void blendAVX2(quint32 * dst, const quint32 * src, int count, int opacity)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi16(255);
+    const __m256i opacity16 = _mm256_set1_epi16((short)opacity);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+
+        __m256i sLo = _mm256_unpacklo_epi8(s, zero);
+        __m256i sHi = _mm256_unpackhi_epi8(s, zero);
+        if (opacity != 255)
+        {
+            sLo = div255AVX2(_mm256_mullo_epi16(sLo, opacity16));
+            sHi = div255AVX2(_mm256_mullo_epi16(sHi, opacity16));
+        }
+
+        const __m256i invLo = _mm256_sub_epi16(max, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(sLo, 0xFF), 0xFF));
+        const __m256i invHi = _mm256_sub_epi16(max, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(sHi, 0xFF), 0xFF));
+
+        const __m256i dLo = _mm256_add_epi16(sLo, div255AVX2(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), invLo)));
+        const __m256i dHi = _mm256_add_epi16(sHi, div255AVX2(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), invHi)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_packus_epi16(dLo, dHi));
+    }
+
+    blendSSE2(dst + i, src + i, count - i, opacity);
+}
+
+__attribute__((target("avx2")))
+void filterAVX2(quint32 * pixels, int count, const float * m)
+{
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 coefficients[12];
+    for (int k = 0; k < 12; k++)
+        coefficients[k] = _mm256_set1_ps(m[k]);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pixels + i));
+        const __m256i alpha = _mm256_srli_epi32(p, 24);
+        const __m256 a = _mm256_cvtepi32_ps(alpha);
+        const __m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 16), mask));
+        const __m256 g = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 8), mask));
+        const __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(p, mask));
+
+        __m256i out = _mm256_slli_epi32(alpha, 24);
+        for (int row = 0; row < 3; row++)
+        {
+            __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(coefficients[row*4], r),
+                                                   _mm256_mul_ps(coefficients[row*4 + 1], g)),
+                                     _mm256_add_ps(_mm256_mul_ps(coefficients[row*4 + 2], b),
+                                                   _mm256_mul_ps(coefficients[row*4 + 3], a)));
+            v = _mm256_min_ps(_mm256_max_ps(v, zero), a);
+            out = _mm256_or_si256(out, _mm256_sll_epi32(_mm256_cvtps_epi32(v), _mm_cvtsi32_si128(16 - 8*row)));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(pixels + i), out);
+    }
+
+    filterSSE2(pixels + i, count - i, m);
+}
+#endif
+
+#ifdef MAPGRAPHICS_BLENDER_NEON
+//x / 255, rounded, narrowed back to bytes
+inline uint8x8_t div255NEON(uint16x8_t x)
+{
+    return vraddhn_u16(x, vrshrq_n_u16(x, 8));
+}
+
+void blendNEON(quint32 * dst, const quint32 * src, int count, int opacity)
+{
+    const uint8x8_t opacity8 = vdup_n_u8((uint8_t)opacity);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        //Eight pixels, one channel per register. Alpha is the last byte of each pixel.
+        uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(src + i));
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<const uint8_t *>(dst + i));
+        if (opacity != 255)
+        {
+            for (int c = 0; c < 4; c++)
+                s.val[c] = div255NEON(vmull_u8(s.val[c], opacity8));
+        }
+
+        const uint8x8_t inverseAlpha = vmvn_u8(s.val[3]);
+        for (int c = 0; c < 4; c++)
+            d.val[c] = vqadd_u8(s.val[c], div255NEON(vmull_u8(d.val[c], inverseAlpha)));
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), d);
+    }
+
+    blendScalar(dst + i, src + i, count - i, opacity);
+}
+
+void filterNEON(quint32 * pixels, int count, const float * m)
+{
+    const uint32x4_t mask = vdupq_n_u32(0xff);
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t half = vdupq_n_f32(0.5f);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const uint32x4_t p = vld1q_u32(pixels + i);
+        const uint32x4_t alpha = vshrq_n_u32(p, 24);
+        const float32x4_t a = vcvtq_f32_u32(alpha);
+        const float32x4_t channels[3] = {vcvtq_f32_u32(vandq_u32(vshrq_n_u32(p, 16), mask)),
+                                         vcvtq_f32_u32(vandq_u32(vshrq_n_u32(p, 8), mask)),
+                                         vcvtq_f32_u32(vandq_u32(p, mask))};
+
+        uint32x4_t out = vshlq_n_u32(alpha, 24);
+        for (int row = 0; row < 3; row++)
+        {
+            float32x4_t v = vmulq_n_f32(a, m[row*4 + 3]);
+            for (int k = 0; k < 3; k++)
+                v = vmlaq_n_f32(v, channels[k], m[row*4 + k]);
+            v = vminq_f32(vmaxq_f32(v, zero), a);
+
+            //Converting truncates, so round first
+            const uint32x4_t value = vcvtq_u32_f32(vaddq_f32(v, half));
+            out = vorrq_u32(out, vshlq_u32(value, vdupq_n_s32(16 - 8*row)));
+        }
+        vst1q_u32(pixels + i, out);
+    }
+
+    filterScalar(pixels + i, count - i, m);
+}
+#endif
+
+struct Kernel
+{
+    BlendKernel blend;
+    FilterKernel filter;
+    const char * name;
+};
+
+//Every kernel this machine can run, best first
+QList<Kernel> availableKernels()
+{
+    QList<Kernel> toRet;
+#ifdef MAPGRAPHICS_BLENDER_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        toRet.append(Kernel{blendAVX2, filterAVX2, "AVX2"});
+#endif
+#if defined(MAPGRAPHICS_BLENDER_SSE2)
+    toRet.append(Kernel{blendSSE2, filterSSE2, "SSE2"});
+#elif defined(MAPGRAPHICS_BLENDER_NEON)
+    toRet.append(Kernel{blendNEON, filterNEON, "NEON"});
+#endif
+    toRet.append(Kernel{blendScalar, filterScalar, "scalar"});
+    return toRet;
+}
+
+//Picked once, the first time anyone blends
+const Kernel& kernel()
+{
+    static const Kernel toRet = availableKernels().first();
+    return toRet;
+}
+
+//Returns the kernel with the given name, or 0 if this machine can't run it
+const Kernel * namedKernel(const QString& name)
+{
+    static const QList<Kernel> kernels = availableKernels();
+    for (int i = 0; i < kernels.size(); i++)
+    {
+        if (name == QLatin1String(kernels.at(i).name))
+            return &kernels.at(i);
+    }
+    return 0;
+}
+}
+
+//static
+void MapTileBlender::blend(QImage *dest, const QImage &layer, qreal opacity, const MapLayerFilter &filter)
+{
+    if (dest == 0 || dest->isNull() || layer.isNull())
+        return;
+
+    const int alpha = qBound<int>(0, qRound(opacity * 255.0), 255);
+    if (alpha == 0)
+        return;
+
+    //Format_RGB32 is Format_ARGB32_Premultiplied with all alphas at 0xff, which source-over keeps that way
+    if (dest->format() != QImage::Format_ARGB32_Premultiplied && dest->format() != QImage::Format_RGB32)
+        *dest = dest->convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    //Converting is a no-op (a shallow copy) for tiles that are in the right format already
+    QImage source = layer;
+    if (source.format() != QImage::Format_ARGB32_Premultiplied && source.format() != QImage::Format_RGB32)
+        source = layer.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    const int width = qMin<int>(dest->width(), source.width());
+    const int height = qMin<int>(dest->height(), source.height());
+    const Kernel& functions = kernel();
+
+    //Filtered layers go through a row of scratch space on the way, so the layer itself is left alone
+    const bool filtered = !filter.isIdentity();
+    QVarLengthArray<quint32, 512> scratch(filtered ? width : 0);
+    for (int y = 0; y < height; y++)
+    {
+        const quint32 * row = reinterpret_cast<const quint32 *>(source.constScanLine(y));
+        if (filtered)
+        {
+            std::copy(row, row + width, scratch.data());
+            functions.filter(scratch.data(), width, filter.matrix());
+            row = scratch.constData();
+        }
+        functions.blend(reinterpret_cast<quint32 *>(dest->scanLine(y)), row, width, alpha);
+    }
+}
+
+//static
+void MapTileBlender::blendSourceOver(quint32 *dst, const quint32 *src, int count, int opacity)
+{
+    if (dst == 0 || src == 0 || count <= 0)
+        return;
+    kernel().blend(dst, src, count, qBound<int>(0, opacity, 255));
+}
+
+//static
+void MapTileBlender::filter(QImage *image, const MapLayerFilter &filter)
+{
+    if (image == 0 || image->isNull() || filter.isIdentity())
+        return;
+
+    if (image->format() != QImage::Format_ARGB32_Premultiplied && image->format() != QImage::Format_RGB32)
+        *image = image->convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    const FilterKernel function = kernel().filter;
+    for (int y = 0; y < image->height(); y++)
+        function(reinterpret_cast<quint32 *>(image->scanLine(y)), image->width(), filter.matrix());
+}
+
+//static
+void MapTileBlender::filterPixels(quint32 *pixels, int count, const float *matrix)
+{
+    if (pixels == 0 || matrix == 0 || count <= 0)
+        return;
+    kernel().filter(pixels, count, matrix);
+}
+
+//static
+void MapTileBlender::detectOpaque(QImage *image)
+{
+    if (image == 0 || image->isNull())
+        return;
+
+    //Both 32-bit alpha formats are bit-for-bit Format_RGB32 when every alpha is 0xff
+    if (image->format() != QImage::Format_ARGB32 && image->format() != QImage::Format_ARGB32_Premultiplied)
+        return;
+
+    for (int y = 0; y < image->height(); y++)
+    {
+        const quint32 * line = reinterpret_cast<const quint32 *>(image->constScanLine(y));
+        quint32 alphas = 0xff000000;
+        for (int x = 0; x < image->width(); x++)
+            alphas &= line[x];
+        if (alphas != 0xff000000)
+            return;
+    }
+    image->reinterpretAsFormat(QImage::Format_RGB32);
+}
+
+//static
+bool MapTileBlender::isOpaque(const QImage &image)
+{
+    return !image.isNull() && !image.hasAlphaChannel();
+}
+
+//static
+const char *MapTileBlender::kernelName()
+{
+    return kernel().name;
+}
+
+//static
+QStringList MapTileBlender::kernelNames()
+{
+    QStringList toRet;
+    foreach(const Kernel& available, availableKernels())
+        toRet.append(QLatin1String(available.name));
+    return toRet;
+}
+
+//static
+bool MapTileBlender::blendSourceOverWith(const QString &kernel, quint32 *dst, const quint32 *src, int count, int opacity)
+{
+    const Kernel * functions = namedKernel(kernel);
+    if (functions == 0)
+        return false;
+    if (dst != 0 && src != 0 && count > 0)
+        functions->blend(dst, src, count, qBound<int>(0, opacity, 255));
+    return true;
+}
+
+//static
+bool MapTileBlender::filterPixelsWith(const QString &kernel, quint32 *pixels, int count, const float *matrix)
+{
+    const Kernel * functions = namedKernel(kernel);
+    if (functions == 0)
+        return false;
+    if (pixels != 0 && matrix != 0 && count > 0)
+        functions->filter(pixels, count, matrix);
+    return true;
+}
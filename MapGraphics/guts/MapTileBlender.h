@@ -0,0 +1,94 @@
+#ifndef MAPTILEBLENDER_H
+#define MAPTILEBLENDER_H
+
+#include <QImage>
+#include <QStringList>
+
+#include "MapLayerFilter.h"
+#include "MapGraphics_global.h"
+
+/*!
+ \brief Blends map layers on top of each other for CompositeTileSource.
+
+ All blending is premultiplied source-over with a per-layer opacity and colour filter, done in place in the
+ destination. The kernels are vectorized with AVX2 (picked at runtime on x86 CPUs that have it), SSE2 or NEON, with a
+ scalar fallback. Everything here is reentrant.
+*/
+class MAPGRAPHICSSHARED_EXPORT MapTileBlender
+{
+public:
+    /*!
+     \brief Blends layer over dest at the given opacity. dest is converted to Format_ARGB32_Premultiplied,
+     and layer is converted on the fly, unless they're already in that format or in Format_RGB32 (an opaque
+     dest stays opaque). Only the area both images cover is blended. The filter is applied to layer's pixels
+     on their way into dest; layer itself isn't modified.
+
+     \param dest the image to blend into
+     \param layer the image to blend on top of dest
+     \param opacity from 0.0 (dest is left alone) to 1.0
+     \param filter the colour filter for layer
+    */
+    static void blend(QImage * dest, const QImage& layer, qreal opacity,
+                      const MapLayerFilter& filter = MapLayerFilter());
+
+    /*!
+     \brief The kernel: blends count premultiplied ARGB32 pixels from src over dst with the given opacity
+     (0 to 255). dst and src must not overlap.
+    */
+    static void blendSourceOver(quint32 * dst, const quint32 * src, int count, int opacity);
+
+    /*!
+     \brief Applies a colour filter to image in place, converting it to Format_ARGB32_Premultiplied unless
+     it's in that format or in Format_RGB32 already. Opaque images stay opaque.
+    */
+    static void filter(QImage * image, const MapLayerFilter& filter);
+
+    /*!
+     \brief The filter kernel: applies a MapLayerFilter::matrix() to count premultiplied ARGB32 pixels in
+     place
+    */
+    static void filterPixels(quint32 * pixels, int count, const float * matrix);
+
+    /*!
+     \brief Call once on freshly decoded tiles. If the tile has an alpha channel that is opaque everywhere,
+     it's relabeled as Format_RGB32 (without copying any pixels), so isOpaque() is free from then on and
+     blend() can use it as it is.
+
+     \param image the decoded tile
+    */
+    static void detectOpaque(QImage * image);
+
+    /*!
+     \brief Returns true if the image has no transparent pixels, as far as its format tells. Tiles that went
+     through detectOpaque() are reported correctly.
+    */
+    static bool isOpaque(const QImage& image);
+
+    /*!
+     \brief Returns the name of the kernels blendSourceOver() and filterPixels() use on this machine, e.g. "AVX2"
+    */
+    static const char * kernelName();
+
+    /*!
+     \brief Returns the names of all the kernels this build can run on this machine, best first. The first
+     is kernelName(). The scalar kernel is always there.
+    */
+    static QStringList kernelNames();
+
+    /*!
+     \brief Like blendSourceOver(), with the named kernel instead of the best one, so benchmarks and tests can
+     compare them. Returns false if there's no such kernel here.
+    */
+    static bool blendSourceOverWith(const QString& kernel, quint32 * dst, const quint32 * src, int count, int opacity);
+
+    /*!
+     \brief Like filterPixels(), with the named kernel instead of the best one. Returns false if there's no
+     such kernel here.
+    */
+    static bool filterPixelsWith(const QString& kernel, quint32 * pixels, int count, const float * matrix);
+
+private:
+    MapTileBlender();
+};
+
+#endif // MAPTILEBLENDER_H
@@ -0,0 +1,143 @@
+#include "MapTileDaemonProtocol.h"
+
+#include <QStringBuilder>
+#include <QtEndian>
+#include <cstring>
+
+const QString SERVER_NAME_PREFIX = "MapGraphicsTileDaemon";
+
+//Keys longer than this don't fit in a slot header, so their tiles are always sent inline
+const int MAX_KEY_CHARS = 96;
+
+/*
+  The segment is an array of slots. Each slot is this header, followed by up to slotBytes of
+  ARGB32_Premultiplied pixels.
+*/
+struct SlotHeader
+{
+    quint32 generation;
+    quint32 width;
+    quint32 height;
+    quint32 bytesPerLine;
+    quint32 keyLength;
+    ushort key[MAX_KEY_CHARS];
+};
+
+namespace
+{
+int slotStride(int slotBytes)
+{
+    //Keep every slot header 4-byte aligned
+    return (int)sizeof(SlotHeader) + ((slotBytes + 3) & ~3);
+}
+
+//Different users get different daemons, so nobody sees anyone else's tiles
+QString userSuffix()
+{
+    QString user = qEnvironmentVariable("USER");
+    if (user.isEmpty())
+        user = qEnvironmentVariable("USERNAME");
+    if (user.isEmpty())
+        return QString();
+    return "-" % user;
+}
+}
+
+//static
+QString MapTileDaemonProtocol::serverName()
+{
+    return SERVER_NAME_PREFIX % userSuffix();
+}
+
+//static
+QString MapTileDaemonProtocol::sharedMemoryKey()
+{
+    return SERVER_NAME_PREFIX % "-tiles" % userSuffix();
+}
+
+//static
+QString MapTileDaemonProtocol::tileKey(const QString &source, quint32 x, quint32 y, quint8 z)
+{
+    return source % "/" % QString::number(x) % "," % QString::number(y) % "," % QString::number(z);
+}
+
+//static
+QByteArray MapTileDaemonProtocol::frame(const QByteArray &payload)
+{
+    QByteArray toRet(4, 0);
+    qToBigEndian<quint32>((quint32)payload.size(), reinterpret_cast<uchar *>(toRet.data()));
+    toRet += payload;
+    return toRet;
+}
+
+//static
+bool MapTileDaemonProtocol::takeMessage(QByteArray *buffer, QByteArray *payload)
+{
+    if (buffer == 0 || payload == 0 || buffer->size() < 4)
+        return false;
+
+    const quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(buffer->constData()));
+    if ((quint64)buffer->size() < (quint64)length + 4)
+        return false;
+
+    *payload = buffer->mid(4, (int)length);
+    buffer->remove(0, (int)length + 4);
+    return true;
+}
+
+//static
+int MapTileDaemonProtocol::segmentBytes(int slotCount, int slotBytes)
+{
+    return slotCount * slotStride(slotBytes);
+}
+
+//static
+bool MapTileDaemonProtocol::writeSlot(void *segment, int slotBytes, int slot, quint32 generation,
+                                      const QString &key, const QImage &tile)
+{
+    if (segment == 0 || slot < 0 || key.size() > MAX_KEY_CHARS || tile.isNull())
+        return false;
+
+    const QImage converted = tile.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    const qint64 pixelBytes = (qint64)converted.bytesPerLine() * converted.height();
+    if (pixelBytes > slotBytes)
+        return false;
+
+    char * base = static_cast<char *>(segment) + (qint64)slot * slotStride(slotBytes);
+    SlotHeader * header = reinterpret_cast<SlotHeader *>(base);
+    header->generation = generation;
+    header->width = converted.width();
+    header->height = converted.height();
+    header->bytesPerLine = converted.bytesPerLine();
+    header->keyLength = key.size();
+    memcpy(header->key, key.utf16(), key.size() * sizeof(ushort));
+    memcpy(base + sizeof(SlotHeader), converted.constBits(), pixelBytes);
+    return true;
+}
+
+//static
+QImage MapTileDaemonProtocol::readSlot(const void *segment, int slotBytes, int slot, quint32 generation,
+                                       const QString &key)
+{
+    if (segment == 0 || slot < 0)
+        return QImage();
+
+    const char * base = static_cast<const char *>(segment) + (qint64)slot * slotStride(slotBytes);
+    const SlotHeader * header = reinterpret_cast<const SlotHeader *>(base);
+
+    //The daemon may have given the slot to another tile since it told us about it
+    if (header->generation != generation || (int)header->keyLength != key.size()
+            || memcmp(header->key, key.utf16(), key.size() * sizeof(ushort)) != 0)
+        return QImage();
+
+    if ((qint64)header->bytesPerLine * header->height > slotBytes)
+        return QImage();
+
+    //Wrap the slot's pixels, then copy them out so the caller doesn't depend on the slot
+    const QImage wrapped(reinterpret_cast<const uchar *>(base + sizeof(SlotHeader)),
+                         header->width,
+                         header->height,
+                         header->bytesPerLine,
+                         QImage::Format_ARGB32_Premultiplied);
+    return wrapped.copy();
+}
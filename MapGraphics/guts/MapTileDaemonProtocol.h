@@ -0,0 +1,80 @@
+#ifndef MAPTILEDAEMONPROTOCOL_H
+#define MAPTILEDAEMONPROTOCOL_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QString>
+
+#include "MapGraphics_global.h"
+
+/*!
+ \brief What the MapTileDaemon and its clients (DaemonTileSource) say to each other.
+
+ Clients connect to the daemon's QLocalServer, which answers with a Hello message naming the shared
+ memory segment tiles are handed out in. Clients then send Request messages for tiles of a source (by
+ its name()). The daemon fetches and decodes each tile once, copies it into a slot of the shared memory
+ segment and tells every client that asked which slot it's in. Slots are reused least-recently-used first,
+ so each one carries a generation number and the tile's key; clients check both before trusting a slot.
+ Tiles that don't fit in a slot are sent over the socket instead.
+
+ Every message is a quint32 length followed by that many bytes of QDataStream data, the first of which is
+ the MessageType. Everything here is reentrant.
+*/
+class MAPGRAPHICSSHARED_EXPORT MapTileDaemonProtocol
+{
+public:
+    enum MessageType
+    {
+        //daemon -> client: QString sharedMemoryKey, quint32 slotCount, quint32 slotBytes
+        Hello = 1,
+
+        //client -> daemon: QString source, quint32 x, quint32 y, quint8 z
+        Request,
+
+        //daemon -> client: QString source, quint32 x, quint32 y, quint8 z, quint32 slot, quint32 generation
+        TileInSlot,
+
+        //daemon -> client: QString source, quint32 x, quint32 y, quint8 z, QImage tile
+        TileInline,
+
+        //daemon -> client: QString source, quint32 x, quint32 y, quint8 z
+        TileUnavailable
+    };
+
+public:
+    //The name of the daemon's QLocalServer. There's one daemon per user.
+    static QString serverName();
+
+    //The default key of the daemon's shared memory segment
+    static QString sharedMemoryKey();
+
+    //The key tiles are known by across sources
+    static QString tileKey(const QString& source, quint32 x, quint32 y, quint8 z);
+
+    //Wraps a message's payload (starting with its MessageType) in its length
+    static QByteArray frame(const QByteArray& payload);
+
+    /*!
+     \brief Removes the first complete message from the start of buffer and puts its payload in *payload.
+     Returns false if buffer doesn't hold a complete message yet.
+    */
+    static bool takeMessage(QByteArray * buffer, QByteArray * payload);
+
+    //How many bytes a segment of slotCount slots, each holding up to slotBytes of pixels, needs
+    static int segmentBytes(int slotCount, int slotBytes);
+
+    /*!
+     \brief Copies tile into slot of the segment, marking it with generation and key. The segment must
+     be locked. Returns false if the tile doesn't fit.
+    */
+    static bool writeSlot(void * segment, int slotBytes, int slot, quint32 generation, const QString& key,
+                          const QImage& tile);
+
+    /*!
+     \brief Returns a copy of the tile in slot of the segment, or a null QImage if the slot doesn't hold
+     the given generation of key any more. The segment must be locked.
+    */
+    static QImage readSlot(const void * segment, int slotBytes, int slot, quint32 generation, const QString& key);
+};
+
+#endif // MAPTILEDAEMONPROTOCOL_H
@@ -1,5 +1,7 @@
 #include "MapTileGraphicsObject.h"
 
+#include "MapTilePixmapCache.h"
+
 #include <QPainter>
 #include <QtDebug>
 
@@ -7,11 +9,15 @@ MapTileGraphicsObject::MapTileGraphicsObject(quint16 tileSize)
 {
     this->setTileSize(tileSize);
     _tile = 0;
+    _placeholder = 0;
+    _pixmapCache = 0;
     _tileX = 0;
     _tileY = 0;
     _tileZoom = 0;
     _initialized = false;
     _havePendingRequest = false;
+    _tileVersion = 0;
+    _tileProvisional = false;
 
     //Default z-value is important --- used in MapGraphicsView
     this->setZValue(-1.0);
@@ -24,6 +30,11 @@ MapTileGraphicsObject::~MapTileGraphicsObject()
         delete _tile;
         _tile = 0;
     }
+    if (_placeholder != 0)
+    {
+        delete _placeholder;
+        _placeholder = 0;
+    }
 }
 
 QRectF MapTileGraphicsObject::boundingRect() const
@@ -40,10 +51,14 @@ void MapTileGraphicsObject::paint(QPainter *painter, const QStyleOptionGraphicsI
     Q_UNUSED(option)
     Q_UNUSED(widget)
 
-    //If we've got a tile, draw it. Otherwise, show a loading or "No tile source" message
+    //If we've got a tile, draw it. Otherwise, show a placeholder or a loading or "No tile source" message
     if (_tile != 0)
         painter->drawPixmap(this->boundingRect().toRect(),
                             *_tile);
+    else if (_placeholder != 0)
+        painter->drawPixmap(this->boundingRect(),
+                            *_placeholder,
+                            _placeholderSource);
     else
     {
         QString string;
@@ -75,12 +90,41 @@ void MapTileGraphicsObject::setTile(quint32 x, quint32 y, quint8 z, bool force)
     if (_tileX == x && _tileY == y && _tileZoom == z && !force && _initialized)
         return;
 
-    //Get rid of the old tile
-    if (_tile != 0)
+    //Get rid of the old placeholder
+    if (_placeholder != 0)
     {
-        delete _tile;
+        delete _placeholder;
+        _placeholder = 0;
+    }
+
+    /*
+      If we're just refreshing the same tile, keep showing the old one until the new one arrives.
+      Otherwise get rid of the old tile and find the best placeholder we can.
+    */
+    const bool sameTile = (_tileX == x && _tileY == y && _tileZoom == z && _initialized);
+    if (_tile != 0 && sameTile)
+    {
+        _placeholder = _tile;
+        _placeholderSource = _tile->rect();
         _tile = 0;
     }
+    else
+    {
+        if (_tile != 0)
+        {
+            delete _tile;
+            _tile = 0;
+        }
+
+        QPixmap found;
+        QRectF foundSource;
+        if (_pixmapCache != 0 && _pixmapCache->placeholder(x, y, z, this->tileSize(), &found, &foundSource))
+        {
+            _placeholder = new QPixmap(found);
+            _placeholderSource = foundSource;
+        }
+        this->update();
+    }
 
     //Store information for the tile we're requesting
     _tileX = x;
@@ -96,16 +140,43 @@ void MapTileGraphicsObject::setTile(quint32 x, quint32 y, quint8 z, bool force)
     connect(_tileSource.data(),
             SIGNAL(tileRetrieved(quint32,quint32,quint8)),
             this,
-            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+            SLOT(handleTileRetrieved(quint32,quint32,quint8)),
+            Qt::UniqueConnection);
 
     //Make sure we know that we're requesting a tile
     _havePendingRequest = true;
+    _tileVersion = 0;
+    _tileProvisional = false;
 
     //Request the tile from tileSource, which will emit tileRetrieved when finished
     //qDebug() << this << "requests" << x << y << z;
     _tileSource->requestTile(x,y,z);
 }
 
+qint64 MapTileGraphicsObject::tileBytes() const
+{
+    if (_tile == 0)
+        return 0;
+    return (qint64)_tile->width() * _tile->height() * _tile->depth() / 8;
+}
+
+void MapTileGraphicsObject::releaseTile()
+{
+    if (_placeholder != 0)
+    {
+        delete _placeholder;
+        _placeholder = 0;
+    }
+
+    if (_tile == 0)
+        return;
+    delete _tile;
+    _tile = 0;
+
+    //We'll have to request the tile again the next time we're asked to show it
+    _initialized = false;
+}
+
 QSharedPointer<MapTileSource> MapTileGraphicsObject::tileSource() const
 {
     return _tileSource;
@@ -144,62 +215,92 @@ void MapTileGraphicsObject::setTileSource(QSharedPointer<MapTileSource> nSource)
     this->handleTileInvalidation();
 }
 
+void MapTileGraphicsObject::setPixmapCache(MapTilePixmapCache *cache)
+{
+    _pixmapCache = cache;
+}
+
 //private slot
 void MapTileGraphicsObject::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
 {
-    //If we don't care about retrieved tiles (i.e., we haven't requested a tile), return
+    //If we don't care about retrieved tiles (i.e., we haven't requested a tile and have the real one), return
     //This shouldn't actually happen as the signal/slot should get disconnected
-    if (!_havePendingRequest)
+    if (!_havePendingRequest && !_tileProvisional)
         return;
 
     //If this isn't the tile we're looking for, return
     else if (_tileX != x || _tileY != y || _tileZoom != z)
         return;
 
-    //Now we know that our tile has been retrieved by the MapTileSource. We just need to get it.
+    /*
+      Now we know that our tile has been retrieved by the MapTileSource. We just need to get it.
+      We may get here more than once for the same tile since some sources deliver a quick approximation
+      first (e.g. a tile built from its cached children) and the real tile later.
+    */
+    const bool wasPending = _havePendingRequest;
     _havePendingRequest = false;
 
     //Make sure some mischevious person hasn't set our MapTileSource to null while we weren't looking...
     if (_tileSource.isNull())
         return;
 
-    QImage * image = _tileSource->getFinishedTile(x,y,z);
+    quint32 version;
+    bool provisional;
+    QImage * image = _tileSource->getFinishedTile(x,y,z,&version,&provisional);
 
     //Make sure someone didn't snake us to grabbing our tile
     if (image == 0)
     {
-        qWarning() << "Failed to get tile" << x << y << z << "from MapTileSource";
+        if (wasPending)
+            qWarning() << "Failed to get tile" << x << y << z << "from MapTileSource";
+        return;
+    }
+
+    //Never go back to an older provisional version, or from the real tile to a provisional one
+    if (_tile != 0 && provisional && (!_tileProvisional || version <= _tileVersion))
+    {
+        delete image;
         return;
     }
+    _tileVersion = version;
+    _tileProvisional = provisional;
 
     //Convert the QImage to a QPixmap
     //We have to do this here since we can't use QPixmaps in non-GUI threads (i.e., MapTileSource)
+    //The image is ours to give away, which lets the pixmap take over its pixels instead of copying them
     QPixmap * tile = new QPixmap();
-    *tile = QPixmap::fromImage(*image);
+    *tile = QPixmap::fromImage(std::move(*image));
 
     //Delete the QImage
     delete image;
     image = 0;
 
-    //Make sure that the old tile has been disposed of. If it hasn't, do it
-    //In reality, it should have been, so display a warning
+    //If we're replacing an earlier version of the tile, dispose of it
     if (_tile != 0)
     {
-        qWarning() << "Tile should be null, but isn't";
         delete _tile;
         _tile = 0;
     }
 
-    //Set the new tile and force a redraw
+    //Set the new tile, replacing the placeholder if there is one, and force a redraw
     _tile = tile;
+    if (_placeholder != 0)
+    {
+        delete _placeholder;
+        _placeholder = 0;
+    }
+    //Provisional versions make poor placeholders for other tiles, so only the real thing is cached
+    if (_pixmapCache != 0 && !provisional)
+        _pixmapCache->insert(x, y, z, *_tile);
     this->update();
 
-    //Disconnect our signal/slot connection with MapTileSource until we need to do another request
-    //It remains to be seen if it's better to continually connect/reconnect or just to filter events
-    QObject::disconnect(_tileSource.data(),
-                        SIGNAL(tileRetrieved(quint32,quint32,quint8)),
-                        this,
-                        SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+    //While we show a provisional version we stay connected to get the real one. After that, disconnect our
+    //signal/slot connection with MapTileSource until we need to do another request.
+    if (!provisional)
+        QObject::disconnect(_tileSource.data(),
+                            SIGNAL(tileRetrieved(quint32,quint32,quint8)),
+                            this,
+                            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
 }
 
 //private slot
@@ -6,6 +6,8 @@
 
 #include "MapTileSource.h"
 
+class MapTilePixmapCache;
+
 class MapTileGraphicsObject : public QGraphicsObject
 {
     Q_OBJECT
@@ -22,9 +24,18 @@ public:
 
     void setTile(quint32 x, quint32 y, quint8 z, bool force = false);
 
+    //Returns the number of bytes used by the pixmap we're displaying, if any
+    qint64 tileBytes() const;
+
+    //Throws away the pixmap we're displaying. Used to free memory held by hidden tile objects.
+    void releaseTile();
+
     QSharedPointer<MapTileSource> tileSource() const;
     void setTileSource(QSharedPointer<MapTileSource>);
 
+    //Sets the cache we put received tiles into and take placeholders from. We don't take ownership.
+    void setPixmapCache(MapTilePixmapCache * cache);
+
 
 private slots:
     void handleTileRetrieved(quint32 x, quint32 y, quint8 z);
@@ -38,6 +49,13 @@ public slots:
 private:
     quint16 _tileSize;
     QPixmap * _tile;
+
+    //Shown in place of _tile while it loads. Drawn from _placeholderSource, scaled to our bounding rect.
+    QPixmap * _placeholder;
+    QRectF _placeholderSource;
+
+    MapTilePixmapCache * _pixmapCache;
+
     quint32 _tileX;
     quint32 _tileY;
     quint8 _tileZoom;
@@ -46,6 +64,10 @@ private:
 
     bool _havePendingRequest;
 
+    //Version of the tile we're showing, and whether a better one is on its way
+    quint32 _tileVersion;
+    bool _tileProvisional;
+
     QSharedPointer<MapTileSource> _tileSource;
     
 };
@@ -0,0 +1,129 @@
+#include "MapTilePixmapCache.h"
+
+#include <QPainter>
+#include <QStringBuilder>
+
+//Enough for 256 256x256 32-bit tiles
+const int DEFAULT_PIXMAP_CACHE_KB = 256 * 256;
+
+//How many zoom levels up we'll look for an ancestor to crop
+const int MAX_ANCESTOR_LEVELS = 8;
+
+//How many zoom levels down we'll look for descendants to assemble
+const int MAX_DESCENDANT_LEVELS = 2;
+
+MapTilePixmapCache::MapTilePixmapCache()
+{
+    _cache.setMaxCost(DEFAULT_PIXMAP_CACHE_KB);
+}
+
+MapTilePixmapCache::~MapTilePixmapCache()
+{
+}
+
+void MapTilePixmapCache::insert(quint32 x, quint32 y, quint8 z, const QPixmap &tile)
+{
+    if (tile.isNull())
+        return;
+
+    const int costKB = qMax<int>(1, (qint64)tile.width() * tile.height() * tile.depth() / 8 / 1024);
+    _cache.insert(MapTilePixmapCache::key(x,y,z), new QPixmap(tile), costKB);
+}
+
+bool MapTilePixmapCache::placeholder(quint32 x, quint32 y, quint8 z, quint16 tileSize,
+                                     QPixmap *pixmap, QRectF *sourceRect)
+{
+    if (pixmap == 0 || sourceRect == 0)
+        return false;
+
+    //Best case: we've shown this very tile recently
+    QPixmap * exact = _cache.object(MapTilePixmapCache::key(x,y,z));
+    if (exact)
+    {
+        *pixmap = *exact;
+        *sourceRect = exact->rect();
+        return true;
+    }
+
+    //Zooming in: crop the closest ancestor
+    for (int levels = 1; levels <= MAX_ANCESTOR_LEVELS && levels <= z; levels++)
+    {
+        QPixmap * ancestor = _cache.object(MapTilePixmapCache::key(x >> levels, y >> levels, z - levels));
+        if (!ancestor)
+            continue;
+
+        const qreal subSize = (qreal)ancestor->width() / (1 << levels);
+
+        //Past this point the ancestor doesn't have enough pixels to be worth showing
+        if (subSize < 1.0)
+            break;
+
+        const quint32 mask = (1 << levels) - 1;
+        *pixmap = *ancestor;
+        *sourceRect = QRectF((x & mask) * subSize, (y & mask) * subSize, subSize, subSize);
+        return true;
+    }
+
+    //Zooming out: assemble whatever descendants we have
+    for (int levels = 1; levels <= MAX_DESCENDANT_LEVELS && z + levels <= 255; levels++)
+    {
+        const quint32 perSide = 1 << levels;
+        const qreal subSize = (qreal)tileSize / perSide;
+
+        QPixmap assembled(tileSize, tileSize);
+        assembled.fill(Qt::transparent);
+        QPainter painter(&assembled);
+
+        bool foundAny = false;
+        for (quint32 dx = 0; dx < perSide; dx++)
+        {
+            for (quint32 dy = 0; dy < perSide; dy++)
+            {
+                const quint32 childX = (x << levels) + dx;
+                const quint32 childY = (y << levels) + dy;
+                QPixmap * child = _cache.object(MapTilePixmapCache::key(childX, childY, z + levels));
+                if (!child)
+                    continue;
+
+                painter.drawPixmap(QRectF(dx * subSize, dy * subSize, subSize, subSize),
+                                   *child,
+                                   child->rect());
+                foundAny = true;
+            }
+        }
+        painter.end();
+
+        if (foundAny)
+        {
+            *pixmap = assembled;
+            *sourceRect = assembled.rect();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void MapTilePixmapCache::clear()
+{
+    _cache.clear();
+}
+
+qint64 MapTilePixmapCache::bytes() const
+{
+    return (qint64)_cache.totalCost() * 1024;
+}
+
+void MapTilePixmapCache::trim(qreal keepFraction)
+{
+    //Shrinking maxCost makes QCache evict its least-recently-used pixmaps
+    const int maxCost = _cache.maxCost();
+    _cache.setMaxCost((int)(_cache.totalCost() * qBound<qreal>(0.0, keepFraction, 1.0)));
+    _cache.setMaxCost(maxCost);
+}
+
+//private static
+QString MapTilePixmapCache::key(quint32 x, quint32 y, quint8 z)
+{
+    return QString::number(x) % "," % QString::number(y) % "," % QString::number(z);
+}
@@ -0,0 +1,50 @@
+#ifndef MAPTILEPIXMAPCACHE_H
+#define MAPTILEPIXMAPCACHE_H
+
+#include <QCache>
+#include <QPixmap>
+#include <QRectF>
+#include <QString>
+
+/*!
+ \brief A cache of recently displayed tile pixmaps, used by MapGraphicsView to show something useful
+ while a tile is loading.
+
+ When a tile isn't available yet, placeholder() looks for the closest cached ancestor (and crops it)
+ or for cached descendants (and assembles them). It lives in the GUI thread only, since QPixmaps can't
+ be used anywhere else.
+*/
+class MapTilePixmapCache
+{
+public:
+    explicit MapTilePixmapCache();
+    ~MapTilePixmapCache();
+
+    /*!
+     \brief Remembers the pixmap displayed for tile x,y,z
+    */
+    void insert(quint32 x, quint32 y, quint8 z, const QPixmap& tile);
+
+    /*!
+     \brief Finds the best stand-in for tile x,y,z. On success, returns true and sets *pixmap and
+     *sourceRect so that drawing sourceRect of pixmap into the tile's bounding rect approximates the tile.
+    */
+    bool placeholder(quint32 x, quint32 y, quint8 z, quint16 tileSize,
+                     QPixmap * pixmap, QRectF * sourceRect);
+
+    void clear();
+
+    //Approximate number of bytes held by the cache
+    qint64 bytes() const;
+
+    //Shrinks the cache to keepFraction of its current size, evicting least-recently-used pixmaps first
+    void trim(qreal keepFraction);
+
+private:
+    static QString key(quint32 x, quint32 y, quint8 z);
+
+    //Cost is in KiB
+    QCache<QString, QPixmap> _cache;
+};
+
+#endif // MAPTILEPIXMAPCACHE_H
@@ -0,0 +1,173 @@
+#include "MapTileResampler.h"
+
+#include <QPoint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MAPGRAPHICS_RESAMPLER_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MAPGRAPHICS_RESAMPLER_NEON
+#include <arm_neon.h>
+#endif
+
+//static
+QImage MapTileResampler::overzoom(const QImage &ancestor, quint32 x, quint32 y, int levels, quint16 tileSize)
+{
+    if (ancestor.isNull() || levels < 0)
+        return QImage();
+
+    const quint32 perSide = 1 << levels;
+    const quint32 mask = perSide - 1;
+    const qreal subSize = (qreal)ancestor.width() / perSide;
+
+    //Crop with a one pixel margin where we can so the smooth scaling doesn't darken the tile edges
+    const QRectF wanted((x & mask) * subSize, (y & mask) * subSize, subSize, subSize);
+    const QRect cropRect = wanted.toAlignedRect().adjusted(-1,-1,1,1).intersected(ancestor.rect());
+
+    const QImage cropped = ancestor.copy(cropRect).convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    const qreal scale = (qreal)tileSize / subSize;
+    const QImage scaled = cropped.scaled(qRound(cropped.width() * scale),
+                                         qRound(cropped.height() * scale),
+                                         Qt::IgnoreAspectRatio,
+                                         Qt::SmoothTransformation);
+
+    //Cut the margin back off
+    const QPoint offset(qRound((wanted.x() - cropRect.x()) * scale),
+                        qRound((wanted.y() - cropRect.y()) * scale));
+    return scaled.copy(offset.x(), offset.y(), tileSize, tileSize);
+}
+
+//static
+QImage MapTileResampler::underzoom(const QImage &topLeft, const QImage &topRight,
+                                   const QImage &bottomLeft, const QImage &bottomRight,
+                                   quint16 tileSize)
+{
+    QImage toRet(tileSize, tileSize, QImage::Format_ARGB32_Premultiplied);
+    toRet.fill(Qt::transparent);
+
+    const QImage * children[4] = {&topLeft, &topRight, &bottomLeft, &bottomRight};
+    const int half = tileSize / 2;
+    for (int i = 0; i < 4; i++)
+    {
+        QImage child = children[i]->convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        if (child.width() != tileSize || child.height() != tileSize)
+            child = child.scaled(tileSize, tileSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+        const int offsetX = (i % 2) * half;
+        const int offsetY = (i / 2) * half;
+        for (int row = 0; row < half; row++)
+        {
+            const quint32 * row0 = reinterpret_cast<const quint32 *>(child.constScanLine(row * 2));
+            const quint32 * row1 = reinterpret_cast<const quint32 *>(child.constScanLine(row * 2 + 1));
+            quint32 * out = reinterpret_cast<quint32 *>(toRet.scanLine(offsetY + row)) + offsetX;
+            MapTileResampler::boxFilter2x2(row0, row1, out, half);
+        }
+    }
+
+    return toRet;
+}
+
+//static
+QImage MapTileResampler::resize(const QImage &tile, quint16 tileSize)
+{
+    if (tile.isNull() || (tile.width() == tileSize && tile.height() == tileSize))
+        return tile;
+
+    QImage source = tile;
+    if (source.format() != QImage::Format_RGB32 && source.format() != QImage::Format_ARGB32_Premultiplied)
+        source = tile.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+    //High-DPI tiles are usually exactly twice the size, which the box filter does best
+    if (source.width() != 2 * tileSize || source.height() != 2 * tileSize)
+        return source.scaled(tileSize, tileSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+    QImage toRet(tileSize, tileSize, source.format());
+    for (int row = 0; row < tileSize; row++)
+    {
+        const quint32 * row0 = reinterpret_cast<const quint32 *>(source.constScanLine(row * 2));
+        const quint32 * row1 = reinterpret_cast<const quint32 *>(source.constScanLine(row * 2 + 1));
+        MapTileResampler::boxFilter2x2(row0, row1, reinterpret_cast<quint32 *>(toRet.scanLine(row)), tileSize);
+    }
+    return toRet;
+}
+
+//static
+void MapTileResampler::boxFilter2x2(const quint32 *row0, const quint32 *row1, quint32 *out, int outCount)
+{
+    int i = 0;
+
+#if defined(MAPGRAPHICS_RESAMPLER_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16(2);
+    for (; i + 4 <= outCount; i += 4)
+    {
+        //Eight source pixels from each row become four output pixels
+        const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + 2*i));
+        const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + 2*i + 4));
+        const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + 2*i));
+        const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + 2*i + 4));
+
+        //Widen to 16 bits per channel and add the rows. Each register holds two pixels.
+        const __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        const __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        const __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        const __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+
+        //Add horizontal neighbors: the low 64 bits of each sum hold one output pixel
+        const __m128i h0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+        const __m128i h1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+        const __m128i h2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+        const __m128i h3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+
+        __m128i lo = _mm_unpacklo_epi64(h0, h1);
+        __m128i hi = _mm_unpacklo_epi64(h2, h3);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, rounding), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, rounding), 2);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(MAPGRAPHICS_RESAMPLER_NEON)
+    for (; i + 4 <= outCount; i += 4)
+    {
+        //Load eight pixels from each row, split into even and odd pixels
+        const uint32x4x2_t a = vld2q_u32(row0 + 2*i);
+        const uint32x4x2_t b = vld2q_u32(row1 + 2*i);
+
+        const uint8x16_t aEven = vreinterpretq_u8_u32(a.val[0]);
+        const uint8x16_t aOdd = vreinterpretq_u8_u32(a.val[1]);
+        const uint8x16_t bEven = vreinterpretq_u8_u32(b.val[0]);
+        const uint8x16_t bOdd = vreinterpretq_u8_u32(b.val[1]);
+
+        uint16x8_t sumLow = vaddl_u8(vget_low_u8(aEven), vget_low_u8(aOdd));
+        sumLow = vaddq_u16(sumLow, vaddl_u8(vget_low_u8(bEven), vget_low_u8(bOdd)));
+        uint16x8_t sumHigh = vaddl_u8(vget_high_u8(aEven), vget_high_u8(aOdd));
+        sumHigh = vaddq_u16(sumHigh, vaddl_u8(vget_high_u8(bEven), vget_high_u8(bOdd)));
+
+        //Rounding divide by four and narrow back to 8 bits
+        const uint8x16_t result = vcombine_u8(vrshrn_n_u16(sumLow, 2), vrshrn_n_u16(sumHigh, 2));
+        vst1q_u32(out + i, vreinterpretq_u32_u8(result));
+    }
+#endif
+
+    //Scalar fallback, and the leftovers from the vectorized loops
+    for (; i < outCount; i++)
+    {
+        const quint32 p0 = row0[2*i];
+        const quint32 p1 = row0[2*i + 1];
+        const quint32 p2 = row1[2*i];
+        const quint32 p3 = row1[2*i + 1];
+
+        quint32 result = 0;
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            const quint32 sum = ((p0 >> shift) & 0xff) + ((p1 >> shift) & 0xff)
+                    + ((p2 >> shift) & 0xff) + ((p3 >> shift) & 0xff);
+            result |= ((sum + 2) >> 2) << shift;
+        }
+        out[i] = result;
+    }
+}
+
+//private
+MapTileResampler::MapTileResampler()
+{
+}
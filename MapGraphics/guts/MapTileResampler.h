@@ -0,0 +1,52 @@
+#ifndef MAPTILERESAMPLER_H
+#define MAPTILERESAMPLER_H
+
+#include <QImage>
+
+/*!
+ \brief Static helpers for synthesizing tiles from tiles on other zoom levels.
+
+ Everything here is reentrant and works on QImages only, so it can be used from worker threads.
+*/
+class MapTileResampler
+{
+public:
+    /*!
+     \brief Builds tile x,y (on the ancestor's zoom level + levels) by cropping the matching part of
+     ancestor and scaling it up to tileSize x tileSize.
+
+     \param ancestor the tile levels zoom levels above the tile we want
+     \param x x-coordinate of the tile we want
+     \param y y-coordinate of the tile we want
+     \param levels how many zoom levels below the ancestor the tile we want is
+     \param tileSize the length/width of the result
+    */
+    static QImage overzoom(const QImage& ancestor, quint32 x, quint32 y, int levels, quint16 tileSize);
+
+    /*!
+     \brief Builds a tile from its four children (one zoom level deeper) by shrinking each of them into
+     its quadrant with a 2x2 box filter. Children are expected to be tileSize x tileSize.
+    */
+    static QImage underzoom(const QImage& topLeft, const QImage& topRight,
+                            const QImage& bottomLeft, const QImage& bottomRight,
+                            quint16 tileSize);
+
+    /*!
+     \brief Scales a tile from a source with another tile size to tileSize x tileSize. Tiles exactly twice
+     as big are shrunk with the 2x2 box filter, anything else is scaled smoothly. Format_RGB32 tiles stay
+     Format_RGB32, everything else comes out as Format_ARGB32_Premultiplied.
+    */
+    static QImage resize(const QImage& tile, quint16 tileSize);
+
+    /*!
+     \brief 2x2 box filter kernel. Averages each 2x2 block of 32-bit pixels from row0 and row1 (which must
+     each hold 2*outCount pixels) into one pixel of out. Works per 8-bit channel, so any 32-bit pixel
+     format (premultiplied or not) is fine. Vectorized with SSE2 or NEON where available.
+    */
+    static void boxFilter2x2(const quint32 * row0, const quint32 * row1, quint32 * out, int outCount);
+
+private:
+    MapTileResampler();
+};
+
+#endif // MAPTILERESAMPLER_H
@@ -1,19 +1,50 @@
 #include "CompositeTileSource.h"
 
+#include "guts/MapGraphicsExecutor.h"
+#include "guts/MapGraphicsMemoryGovernor.h"
+#include "guts/MapTileBlender.h"
+#include "guts/MapTileResampler.h"
+
 #include <QtDebug>
 #include <QPainter>
 #include <QMutexLocker>
-#include <QThread>
 #include <QPointer>
 #include <QTimer>
+#include <QDateTime>
+#include <QStringBuilder>
+#include <algorithm>
+
+//How much we keep of our children's tiles, in KiB. Enough for 100 tiles of four 256x256 32-bit layers.
+const int RETAINED_LAYERS_KB = 4 * 100 * 256;
+
+//How much we keep of finished composites, in KiB. Enough for a few layer presets of 100 256x256 tiles.
+const int COMPOSITE_CACHE_KB = 4 * 100 * 256;
+
+//How long composites wait for a new layer's tiles by default, and how often we check
+const int DEFAULT_LAYER_DEADLINE_MSECS = 10000;
+const int DEADLINE_CHECK_MSECS = 250;
+
+//How many zoom levels deeper than their own maxZoomLevel() we overzoom layers to keep up with the basemap.
+//Beyond that, a 256x256 tile is down to a pixel per tile and the layer just stops showing.
+const int MAX_LAYER_OVERZOOM_LEVELS = 8;
 
 CompositeTileSource::CompositeTileSource() :
-    MapTileSource()
+    MapTileSource(), _layers(std::make_shared<const LayerSnapshot>()), _pendingTileBytes(0),
+    _progressiveCompositing(true)
 {
     //'Recursive' is not a member of QMutex
     // теперь не нужно
     //_globalMutex = new QMutex(QMutex::Recursive);
     this->setCacheMode(MapTileSource::NoCaching);
+    _retainedLayers.setMaxCost(RETAINED_LAYERS_KB);
+    _compositeCache.setMaxCost(COMPOSITE_CACHE_KB);
+
+    //Our children move to our thread with us
+    _deadlineTimer = new QTimer(this);
+    connect(_deadlineTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(checkLayerDeadlines()));
 }
 
 CompositeTileSource::~CompositeTileSource()
@@ -25,75 +56,72 @@ CompositeTileSource::~CompositeTileSource()
     this->clearPendingTiles();
 
     //Clear the sources
-    //We first find all the sources' threads and put them in a list
-    QList<QPointer<QThread> > tileSourceThreads;
-    foreach(QSharedPointer<MapTileSource> source, _childSources)
-        tileSourceThreads.append(QPointer<QThread>(source->thread()));
+    //We first keep track of all the sources in a list
+    QList<QPointer<QObject> > tileSources;
+    foreach(QSharedPointer<MapTileSource> source, this->layers()->sources)
+        tileSources.append(QPointer<QObject>(source.data()));
 
-    //Then we clear the sources
-    _childSources.clear();
+    //Then we clear the sources, which may be shared with others, and give them back their own overzoom
+    this->publishLayers(new LayerSnapshot());
+    this->restoreLayerZoomLevels();
 
-    int numThreads = tileSourceThreads.size();
-    //Then we wait for all of those threads to shut down
-    for (int i = 0; i < numThreads; i++)
-    {
-        QPointer<QThread> thread = tileSourceThreads[i];
-        if (!thread.isNull() && thread != this->thread())
-            thread->wait(10000);
-    }
+    /*
+      Then we wait for them to be deleted in their host threads, which saves their caches. We're usually on
+      a host thread ourselves, in which case the children shut down on their own instead.
+    */
+    MapGraphicsExecutor::getInstance()->waitUntilDestroyed(tileSources, 10000);
 }
 
 QPointF CompositeTileSource::ll2qgs(const QPointF &ll, quint8 zoomLevel) const
 {
-    QMutexLocker locker(&_globalMutex);
-    if (_childSources.isEmpty())
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (layers->sources.isEmpty())
     {
         qWarning() << "Composite tile source is empty --- results undefined";
         return QPointF(0,0);
     }
 
-    //Assume they're all the same. Nothing to do otherwise!
-    return _childSources.at(0)->ll2qgs(ll,zoomLevel);
+    //The bottom layer is the basemap, and the others are resampled to fit it
+    return layers->sources.last()->ll2qgs(ll,zoomLevel);
 }
 
 QPointF CompositeTileSource::qgs2ll(const QPointF &qgs, quint8 zoomLevel) const
 {
-    QMutexLocker locker(&_globalMutex);
-    if (_childSources.isEmpty())
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (layers->sources.isEmpty())
     {
         qWarning() << "Composite tile source is empty --- results undefined";
         return QPointF(0,0);
     }
 
-    //Assume they're all the same. Nothing to do otherwise!
-    return _childSources.at(0)->qgs2ll(qgs,zoomLevel);
+    //The bottom layer is the basemap, and the others are resampled to fit it
+    return layers->sources.last()->qgs2ll(qgs,zoomLevel);
 }
 
 quint64 CompositeTileSource::tilesOnZoomLevel(quint8 zoomLevel) const
 {
-    QMutexLocker locker(&_globalMutex);
-    if (_childSources.isEmpty())
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (layers->sources.isEmpty())
         return 1;
     else
-        return _childSources.at(0)->tilesOnZoomLevel(zoomLevel);
+        return layers->sources.last()->tilesOnZoomLevel(zoomLevel);
 }
 
 quint16 CompositeTileSource::tileSize() const
 {
-    QMutexLocker locker(&_globalMutex);
-    if (_childSources.isEmpty())
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (layers->sources.isEmpty())
         return 256;
     else
-        return _childSources.at(0)->tileSize();
+        return layers->sources.last()->tileSize();
 }
 
 quint8 CompositeTileSource::minZoomLevel(QPointF ll)
 {
-    QMutexLocker locker(&_globalMutex);
     //Return the highest minimum
     quint8 highest = 0;
 
-    foreach(QSharedPointer<MapTileSource> source, _childSources)
+    foreach(QSharedPointer<MapTileSource> source, this->layers()->sources)
     {
         quint8 current = source->minZoomLevel(ll);
         if (current > highest)
@@ -104,17 +132,11 @@ quint8 CompositeTileSource::minZoomLevel(QPointF ll)
 
 quint8 CompositeTileSource::maxZoomLevel(QPointF ll)
 {
-    QMutexLocker locker(&_globalMutex);
-    //Return the lowest maximum
-    quint8 lowest = 50;
-
-    foreach(QSharedPointer<MapTileSource> source, _childSources)
-    {
-        quint8 current = source->maxZoomLevel(ll);
-        if (current < lowest)
-            lowest = current;
-    }
-    return lowest;
+    //The bottom layer is the basemap. Shallower layers above it are overzoomed to keep up.
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (layers->sources.isEmpty())
+        return 50;
+    return layers->sources.last()->effectiveMaxZoomLevel(ll);
 }
 
 QString CompositeTileSource::name() const
@@ -127,23 +149,62 @@ QString CompositeTileSource::tileFileExtension() const
     return ".jpg";
 }
 
+void CompositeTileSource::preloadHotTiles(const QPointF &centerLL, quint8 zoomLevel)
+{
+    foreach(QSharedPointer<MapTileSource> source, this->layers()->sources)
+        source->preloadHotTiles(centerLL, zoomLevel);
+}
+
+bool CompositeTileSource::tileInCoverage(quint32 x, quint32 y, quint8 z) const
+{
+    if (!MapTileSource::tileInCoverage(x,y,z))
+        return false;
+
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (layers->sources.isEmpty())
+        return true;
+
+    for (int i = 0; i < layers->sources.size(); i++)
+    {
+        if (layers->effectiveOpacity(i) > 0.0 && layers->sources.at(i)->tileInCoverage(x,y,z))
+            return true;
+    }
+    return false;
+}
+
 void CompositeTileSource::addSourceTop(QSharedPointer<MapTileSource> source, qreal opacity)
 {
     QMutexLocker locker(&_globalMutex);
     if (source.isNull())
         return;
 
-    //Put the child in its own thread
+    //Put the child on one of the shared host threads
     this->doChildThreading(source);
 
-    _childSources.insert(0, source);
-    _childOpacities.insert(0,opacity);
-    _childEnabledFlags.insert(0,true);
+    LayerSnapshot * updated = new LayerSnapshot(*this->layers());
+    updated->sources.insert(0, source);
+    updated->opacities.insert(0,opacity);
+    updated->enabledFlags.insert(0,true);
+    updated->deadlines.insert(0,DEFAULT_LAYER_DEADLINE_MSECS);
+    updated->filters.insert(0,MapLayerFilter());
+    this->publishLayers(updated);
+    this->matchLayerZoomLevels();
 
     connect(source.data(),
             SIGNAL(tileRetrieved(quint32,quint32,quint8)),
             this,
             SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+    connect(source.data(),
+            SIGNAL(tileRetrievalFailed(quint32,quint32,quint8)),
+            this,
+            SLOT(handleChildTileFailed(quint32,quint32,quint8)));
+    connect(source.data(),
+            SIGNAL(allTilesInvalidated()),
+            this,
+            SLOT(handleChildTilesInvalidated()));
+
+    //Pending composites keep their tiles by child index, which just changed
+    this->clearPendingTiles();
 
     this->sourceAdded(0);
     this->sourcesChanged();
@@ -156,19 +217,35 @@ void CompositeTileSource::addSourceBottom(QSharedPointer<MapTileSource> source,
     if (source.isNull())
         return;
 
-    //Put the child in its own thread
+    //Put the child on one of the shared host threads
     this->doChildThreading(source);
 
-    _childSources.append(source);
-    _childOpacities.append(opacity);
-    _childEnabledFlags.append(true);
+    LayerSnapshot * updated = new LayerSnapshot(*this->layers());
+    updated->sources.append(source);
+    updated->opacities.append(opacity);
+    updated->enabledFlags.append(true);
+    updated->deadlines.append(DEFAULT_LAYER_DEADLINE_MSECS);
+    updated->filters.append(MapLayerFilter());
+    this->publishLayers(updated);
+    this->matchLayerZoomLevels();
 
     connect(source.data(),
             SIGNAL(tileRetrieved(quint32,quint32,quint8)),
             this,
             SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+    connect(source.data(),
+            SIGNAL(tileRetrievalFailed(quint32,quint32,quint8)),
+            this,
+            SLOT(handleChildTileFailed(quint32,quint32,quint8)));
+    connect(source.data(),
+            SIGNAL(allTilesInvalidated()),
+            this,
+            SLOT(handleChildTilesInvalidated()));
 
-    this->sourceAdded(_childSources.size()-1);
+    //Pending composites keep their tiles by child index, which just changed
+    this->clearPendingTiles();
+
+    this->sourceAdded(updated->sources.size()-1);
     this->sourcesChanged();
     this->allTilesInvalidated();
 }
@@ -184,9 +261,17 @@ void CompositeTileSource::moveSource(int from, int to)
     if (from >= size || to >= size)
         return;
 
-    _childSources.move(from,to);
-    _childOpacities.move(from,to);
-    _childEnabledFlags.move(from,to);
+    LayerSnapshot * updated = new LayerSnapshot(*this->layers());
+    updated->sources.move(from,to);
+    updated->opacities.move(from,to);
+    updated->enabledFlags.move(from,to);
+    updated->deadlines.move(from,to);
+    updated->filters.move(from,to);
+    this->publishLayers(updated);
+    this->matchLayerZoomLevels();
+
+    //Pending composites keep their tiles by child index. Their tiles are retained, so this is cheap.
+    this->clearPendingTiles();
 
     this->sourcesReordered();
     this->sourcesChanged();
@@ -196,14 +281,26 @@ void CompositeTileSource::moveSource(int from, int to)
 void CompositeTileSource::removeSource(int index)
 {
     QMutexLocker locker(&_globalMutex);
-    if (index < 0 || index >= _childSources.size())
+    if (index < 0 || index >= this->numSources())
         return;
 
-    _childSources.removeAt(index);
-    _childOpacities.removeAt(index);
-    _childEnabledFlags.removeAt(index);
+    LayerSnapshot * updated = new LayerSnapshot(*this->layers());
+    MapTileSource * removed = updated->sources.at(index).data();
+    this->forgetRetainedLayer(removed);
+    this->clearCompositeCache();
+    updated->sources.removeAt(index);
+    updated->opacities.removeAt(index);
+    updated->enabledFlags.removeAt(index);
+    updated->deadlines.removeAt(index);
+    updated->filters.removeAt(index);
+    this->publishLayers(updated);
+    this->matchLayerZoomLevels();
     this->clearPendingTiles();
 
+    QMutexLocker statisticsLocker(&_statisticsMutex);
+    _layerStatistics.remove(removed);
+    statisticsLocker.unlock();
+
     this->sourceRemoved(index);
     this->sourcesChanged();
     this->allTilesInvalidated();
@@ -211,25 +308,24 @@ void CompositeTileSource::removeSource(int index)
 
 int CompositeTileSource::numSources() const
 {
-    QMutexLocker locker(&_globalMutex);
-    return _childSources.size();
+    return this->layers()->sources.size();
 }
 
 QSharedPointer<MapTileSource> CompositeTileSource::getSource(int index) const
 {
-    QMutexLocker locker(&_globalMutex);
-    if (index < 0 || index >= _childSources.size())
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (index < 0 || index >= layers->sources.size())
         return QSharedPointer<MapTileSource>();
 
-    return _childSources[index];
+    return layers->sources[index];
 }
 
 qreal CompositeTileSource::getOpacity(int index) const
 {
-    QMutexLocker locker(&_globalMutex);
-    if (index < 0 || index >= _childSources.size())
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (index < 0 || index >= layers->sources.size())
         return 0.0;
-    return _childOpacities[index];
+    return layers->opacities[index];
 }
 
 void CompositeTileSource::setOpacity(int index, qreal opacity)
@@ -237,13 +333,15 @@ void CompositeTileSource::setOpacity(int index, qreal opacity)
     opacity = qMin<qreal>(1.0,qMax<qreal>(0.0,opacity));
 
     QMutexLocker locker(&_globalMutex);
-    if (index < 0 || index >= _childSources.size())
+    if (index < 0 || index >= this->numSources())
         return;
 
-    if (_childOpacities[index] == opacity)
+    if (this->layers()->opacities[index] == opacity)
         return;
 
-    _childOpacities[index] = opacity;
+    LayerSnapshot * updated = new LayerSnapshot(*this->layers());
+    updated->opacities[index] = opacity;
+    this->publishLayers(updated);
 
     //emit signal to tell any models watching us that we've changed
     this->sourcesChanged();
@@ -252,33 +350,115 @@ void CompositeTileSource::setOpacity(int index, qreal opacity)
 
 bool CompositeTileSource::getEnabledFlag(int index) const
 {
-    QMutexLocker locker(&_globalMutex);
-    if (index < 0 || index >= _childSources.size())
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (index < 0 || index >= layers->sources.size())
         return 0.0;
-    return _childEnabledFlags[index];
+    return layers->enabledFlags[index];
 }
 
 void CompositeTileSource::setEnabledFlag(int index, bool isEnabled)
 {
     QMutexLocker locker(&_globalMutex);
-    if (index < 0 || index >= _childSources.size())
+    if (index < 0 || index >= this->numSources())
         return;
 
-    if (_childEnabledFlags[index] == isEnabled)
+    if (this->layers()->enabledFlags[index] == isEnabled)
         return;
 
-    _childEnabledFlags[index] = isEnabled;
+    LayerSnapshot * updated = new LayerSnapshot(*this->layers());
+    updated->enabledFlags[index] = isEnabled;
+    this->publishLayers(updated);
 
     this->sourcesChanged();
     this->allTilesInvalidated();
 }
 
+int CompositeTileSource::layerDeadline(int index) const
+{
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (index < 0 || index >= layers->sources.size())
+        return 0;
+    return layers->deadlines[index];
+}
+
+void CompositeTileSource::setLayerDeadline(int index, int msecs)
+{
+    QMutexLocker locker(&_globalMutex);
+    if (index < 0 || index >= this->numSources())
+        return;
+
+    LayerSnapshot * updated = new LayerSnapshot(*this->layers());
+    updated->deadlines[index] = qMax<int>(0, msecs);
+    this->publishLayers(updated);
+}
+
+MapLayerFilter CompositeTileSource::layerFilter(int index) const
+{
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (index < 0 || index >= layers->sources.size())
+        return MapLayerFilter();
+    return layers->filters[index];
+}
+
+void CompositeTileSource::setLayerFilter(int index, const MapLayerFilter &filter)
+{
+    QMutexLocker locker(&_globalMutex);
+    if (index < 0 || index >= this->numSources())
+        return;
+
+    if (this->layers()->filters[index] == filter)
+        return;
+
+    LayerSnapshot * updated = new LayerSnapshot(*this->layers());
+    updated->filters[index] = filter;
+    this->publishLayers(updated);
+
+    //Composites are rebuilt from the retained layer tiles when they're asked for again
+    this->sourcesChanged();
+    this->allTilesInvalidated();
+}
+
+CompositeTileSource::LayerStatistics CompositeTileSource::layerStatistics(int index) const
+{
+    LayerStatistics toRet;
+    toRet.tilesRequested = 0;
+    toRet.deadlinesMissed = 0;
+    toRet.lateArrivals = 0;
+
+    const QSharedPointer<MapTileSource> source = this->getSource(index);
+    if (source.isNull())
+        return toRet;
+
+    QMutexLocker locker(&_statisticsMutex);
+    return _layerStatistics.value(source.data(), toRet);
+}
+
+void CompositeTileSource::resetLayerStatistics()
+{
+    QMutexLocker locker(&_statisticsMutex);
+    _layerStatistics.clear();
+}
+
+bool CompositeTileSource::progressiveCompositing() const
+{
+    QMutexLocker locker(&_globalMutex);
+    return _progressiveCompositing;
+}
+
+void CompositeTileSource::setProgressiveCompositing(bool enabled)
+{
+    QMutexLocker locker(&_globalMutex);
+    _progressiveCompositing = enabled;
+}
+
 //protected
 void CompositeTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
 {
     QMutexLocker locker(&_globalMutex);
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+
     //If we have no child sources, just print a message about that
-    if (_childSources.isEmpty())
+    if (layers->sources.isEmpty())
     {
         QImage * toRet = new QImage(this->tileSize(),
                                     this->tileSize(),
@@ -294,24 +474,90 @@ void CompositeTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
         return;
     }
 
-    //Allocate space in memory to store the tiles as they come before we composite them.
-    //If we already have a space allocated from a previous un-finished request, clear it and start over
+    //We may have built this tile with these very layer settings before
     QString cacheID = MapTileSource::createCacheID(x,y,z);
-    if (_pendingTiles.contains(cacheID))
+    const QImage * cached = _compositeCache.object(this->compositeCacheKey(*layers, cacheID));
+    if (cached != 0)
     {
-        QMap<quint32, QImage *> * tiles = _pendingTiles.value(cacheID);
-        foreach(QImage * tile, *tiles)
-            delete tile;
-        tiles->clear();
+        this->prepareNewlyReceivedTile(x,y,z,new QImage(*cached));
+        return;
     }
-    //Otherwise, create a new space
-    else
-        _pendingTiles.insert(cacheID,new QMap<quint32,QImage *>());
 
-    //Request tiles from all of our beautiful children
-    for (int i = 0; i < _childSources.size(); i++)
+    //Only children with something to show here get asked
+    const QSet<quint32> covering = this->contributingLayers(x,y,z);
+
+    if (covering.isEmpty())
     {
-        QSharedPointer<MapTileSource> child = _childSources.at(i);
+        QImage * toRet = new QImage(this->tileSize(),
+                                    this->tileSize(),
+                                    QImage::Format_ARGB32_Premultiplied);
+        toRet->fill(Qt::transparent);
+        this->prepareNewlyReceivedTile(x,y,z,toRet);
+        return;
+    }
+
+    /*
+      Allocate space in memory to store the tiles as they come before we composite them.
+      If we already have a space allocated from a previous un-finished request, keep what has arrived
+      so far and only ask for what hasn't.
+    */
+    PendingComposite * pending = _pendingTiles.value(cacheID, 0);
+    if (pending == 0)
+    {
+        pending = new PendingComposite();
+        _pendingTiles.insert(cacheID,pending);
+    }
+    pending->requestTime = QDateTime::currentMSecsSinceEpoch();
+    pending->expected = covering;
+
+    //Layers that missed their deadline or failed last time get another chance with everyone else
+    _lateLayers.remove(cacheID);
+    _abandonedLayers.remove(cacheID);
+    if (!_deadlineTimer->isActive())
+        _deadlineTimer->start(DEADLINE_CHECK_MSECS);
+
+    //Children that no longer cover the tile don't get a say
+    foreach(quint32 i, pending->tiles.keys())
+    {
+        if (covering.contains(i))
+            continue;
+        QImage * tile = pending->tiles.take(i);
+        _pendingTileBytes -= tile->sizeInBytes();
+        delete tile;
+    }
+
+    //Start from the child tiles we've retained
+    const QHash<MapTileSource *, QImage> * retained = _retainedLayers.object(cacheID);
+    foreach(quint32 i, covering)
+    {
+        MapTileSource * child = layers->sources.at(i).data();
+        if (pending->tiles.contains(i) || retained == 0 || !retained->contains(child))
+            continue;
+
+        QImage * tile = new QImage(retained->value(child));
+        pending->tiles.insert(i, tile);
+        _pendingTileBytes += tile->sizeInBytes();
+    }
+
+    //If one of them is opaque, the layers underneath it aren't needed. Only the rest need to be requested.
+    this->dropOccludedLayers(pending);
+    QList<quint32> missing;
+    foreach(quint32 i, pending->expected)
+    {
+        if (!pending->tiles.contains(i))
+            missing.append(i);
+    }
+    this->reportPendingTileUsage();
+
+    //With everything retained this is where we're done, without bothering our children at all
+    this->publishComposite(x,y,z,cacheID);
+
+    //Request the missing tiles from our beautiful children
+    QMutexLocker statisticsLocker(&_statisticsMutex);
+    foreach(quint32 i, missing)
+    {
+        QSharedPointer<MapTileSource> child = layers->sources.at(i);
+        this->layerStatisticsFor(child.data())->tilesRequested++;
         child->requestTile(x,y,z);
     }
 }
@@ -331,10 +577,11 @@ void CompositeTileSource::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
     }
 
     //Make sure this is a notification from a MapTileSource that we care about
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
     int tileSourceIndex = -1;
-    for (int i = 0; i < _childSources.size(); i++)
+    for (int i = 0; i < layers->sources.size(); i++)
     {
-        if (_childSources[i].data() != tileSource)
+        if (layers->sources[i].data() != tileSource)
             continue;
         tileSourceIndex = i;
         break;
@@ -347,19 +594,61 @@ void CompositeTileSource::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
     }
 
 
-    //Make sure that this is a tile we're interested in
+    //Make sure the tile is non-null
     const QString cacheID = MapTileSource::createCacheID(x,y,z);
-    if (!_pendingTiles.contains(cacheID))
+    bool provisional;
+    QImage * tile = tileSource->getFinishedTile(x,y,z,0,&provisional);
+    if (!tile)
     {
-        qWarning() << this << "received unknown tile" << x << y << z << "from" << tileSource;
+        if (_pendingTiles.contains(cacheID))
+            qWarning() << this << "received null tile" << x << y << z << "from" << tileSource;
         return;
     }
 
-    //Make sure the tile is non-null
-    QImage * tile = tileSource->getFinishedTile(x,y,z);
-    if (!tile)
+    //We only composite our children's real tiles. The provisional ones are followed by the real thing.
+    if (provisional)
+    {
+        delete tile;
+        return;
+    }
+
+    //Children with bigger or smaller tiles (e.g. 512x512 high-DPI layers) are resampled to our size
+    const quint16 tileSize = this->tileSize();
+    if (tile->width() != tileSize || tile->height() != tileSize)
+    {
+        *tile = MapTileResampler::resize(*tile, tileSize);
+        MapTileBlender::detectOpaque(tile);
+    }
+
+    //Hang on to the tile so layer changes don't need it again. That includes improved versions of tiles
+    //we've already composited.
+    this->retainLayerTile(cacheID, tileSource, *tile);
+
+    //Tiles that missed their deadline still make it into the composite, late as they are
+    const bool late = _lateLayers.contains(cacheID) && _lateLayers[cacheID].remove(tileSource);
+    if (late)
+    {
+        if (_lateLayers.value(cacheID).isEmpty())
+            _lateLayers.remove(cacheID);
+
+        QMutexLocker statisticsLocker(&_statisticsMutex);
+        this->layerStatisticsFor(tileSource)->lateArrivals++;
+        statisticsLocker.unlock();
+
+        //The composite has gone out without this layer already
+        if (!_pendingTiles.contains(cacheID))
+        {
+            delete tile;
+            this->rebuildFromRetained(x,y,z);
+            return;
+        }
+        _pendingTiles.value(cacheID)->expected.insert(tileSourceIndex);
+    }
+
+    //Make sure that this is a tile we're interested in
+    if (!_pendingTiles.contains(cacheID))
     {
-        qWarning() << this << "received null tile" << x << y << z << "from" << tileSource;
+        delete tile;
         return;
     }
 
@@ -371,59 +660,206 @@ void CompositeTileSource::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
       it was requested twice for some reason (e.g. crazy zooming in/out) then let's just go ahead
       and delete the new version and go about our day.
     */
-    QMap<quint32, QImage *> * tiles = _pendingTiles.value(cacheID);
-    if (tiles->contains(tileSourceIndex))
+    PendingComposite * pending = _pendingTiles.value(cacheID);
+    QMap<quint32, QImage *> * tiles = &pending->tiles;
+    if (tiles->contains(tileSourceIndex) || !pending->expected.contains(tileSourceIndex))
     {
         delete tile;
         return;
     }
     tiles->insert(tileSourceIndex,tile);
+    _pendingTileBytes += tile->sizeInBytes();
 
-    //Still waiting for a tile or two?
-    if (tiles->size() < _childSources.size())
+    //If the new tile is opaque, we can stop waiting for the layers underneath it
+    this->dropOccludedLayers(pending);
+    this->reportPendingTileUsage();
+
+    //If the new layer doesn't show, there's nothing new to show until the last one arrives
+    if (tiles->size() < pending->expected.size() && layers->effectiveOpacity(tileSourceIndex) <= 0.0)
+        return;
+
+    this->publishComposite(x,y,z,cacheID);
+}
+
+//private slot
+void CompositeTileSource::handleChildTileFailed(quint32 x, quint32 y, quint8 z)
+{
+    QMutexLocker locker(&_globalMutex);
+    MapTileSource * tileSource = qobject_cast<MapTileSource *>(QObject::sender());
+    if (!tileSource)
         return;
 
-    //Time to build the finished composite tile
-    QImage * toRet = new QImage(this->tileSize(),
-                                this->tileSize(),
-                                QImage::Format_ARGB32_Premultiplied);
-    QPainter painter(toRet);
-    painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
-    painter.setOpacity(1.0);
-    for (int i = tiles->size()-1; i >= 0; i--)
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    int tileSourceIndex = -1;
+    for (int i = 0; i < layers->sources.size(); i++)
     {
-        QImage * childTile = tiles->value(i);
-        qreal opacity = _childOpacities[i];
+        if (layers->sources[i].data() != tileSource)
+            continue;
+        tileSourceIndex = i;
+        break;
+    }
+    if (tileSourceIndex == -1)
+        return;
+
+    const QString cacheID = MapTileSource::createCacheID(x,y,z);
 
-        //If there are no other layers, we need to be opaque no matter what
-        if (this->numSources() == 1)
-            opacity = 1.0;
+    //A late layer that isn't coming means the composite we delivered without it is as good as it gets
+    if (_lateLayers.contains(cacheID) && _lateLayers[cacheID].remove(tileSource))
+    {
+        if (_lateLayers.value(cacheID).isEmpty())
+            _lateLayers.remove(cacheID);
+        _abandonedLayers[cacheID].insert(tileSource);
 
-        if (_childEnabledFlags[i] == false)
-            opacity = 0.0;
-        painter.setOpacity(opacity);
-        painter.drawImage(0,0,*childTile);
-        delete childTile;
+        if (!_pendingTiles.contains(cacheID))
+            this->rebuildFromRetained(x,y,z);
+        return;
     }
-    delete tiles;
-    _pendingTiles.remove(cacheID);
-    painter.end();
 
-    this->prepareNewlyReceivedTile(x,y,z,toRet);
+    //Nor is there any point in waiting for a layer we're still expecting
+    PendingComposite * pending = _pendingTiles.value(cacheID, 0);
+    if (pending == 0 || pending->tiles.contains(tileSourceIndex) || !pending->expected.remove(tileSourceIndex))
+        return;
+    _abandonedLayers[cacheID].insert(tileSource);
+
+    if (pending->tiles.size() >= pending->expected.size())
+        this->publishComposite(x,y,z,cacheID);
 }
 
 //private slot
-void CompositeTileSource::clearPendingTiles()
+void CompositeTileSource::handleChildTilesInvalidated()
 {
-    QList<QMap<quint32, QImage *> * > pendingTiles = _pendingTiles.values();
-    for (int i = 0; i < pendingTiles.size(); i++)
+    MapTileSource * tileSource = qobject_cast<MapTileSource *>(QObject::sender());
+    if (!tileSource)
+        return;
+
+    QMutexLocker locker(&_globalMutex);
+    this->forgetRetainedLayer(tileSource);
+    this->clearCompositeCache();
+    this->allTilesInvalidated();
+}
+
+//private slot
+void CompositeTileSource::checkLayerDeadlines()
+{
+    QMutexLocker locker(&_globalMutex);
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    foreach(const QString& cacheID, _pendingTiles.keys())
     {
-        QMap<quint32, QImage *> * tiles = pendingTiles.at(i);
-        foreach(QImage * tile, tiles->values())
-            delete tile;
-        delete tiles;
+        PendingComposite * pending = _pendingTiles.value(cacheID);
+        const qint64 waited = now - pending->requestTime;
+
+        //Stop waiting for the layers that are overdue. They're remembered so they can be added when they arrive.
+        bool changed = false;
+        foreach(quint32 i, pending->expected.values())
+        {
+            if (pending->tiles.contains(i) || (int)i >= layers->sources.size())
+                continue;
+            const int deadline = layers->deadlines.at(i);
+            if (deadline <= 0 || waited < deadline)
+                continue;
+
+            MapTileSource * child = layers->sources.at(i).data();
+            pending->expected.remove(i);
+            _lateLayers[cacheID].insert(child);
+            changed = true;
+
+            QMutexLocker statisticsLocker(&_statisticsMutex);
+            this->layerStatisticsFor(child)->deadlinesMissed++;
+        }
+
+        //Deliver the composite if the overdue layers were all we were waiting for. It stays provisional until
+        //they arrive or fail.
+        quint32 x, y, z;
+        if (changed && pending->tiles.size() >= pending->expected.size()
+                && MapTileSource::cacheID2xyz(cacheID, &x, &y, &z))
+            this->publishComposite(x,y,z,cacheID);
+    }
+
+    if (_pendingTiles.isEmpty())
+        _deadlineTimer->stop();
+}
+
+//protected slot
+void CompositeTileSource::handleMemoryTrim(int category, qreal keepFraction)
+{
+    MapTileSource::handleMemoryTrim(category, keepFraction);
+
+    if (category == MapGraphicsMemoryGovernor::TileMemoryCache)
+    {
+        QMutexLocker locker(&_globalMutex);
+        const int maxCost = _compositeCache.maxCost();
+        _compositeCache.setMaxCost((int)(_compositeCache.totalCost() * qBound<qreal>(0.0, keepFraction, 1.0)));
+        _compositeCache.setMaxCost(maxCost);
+        this->reportCompositeCacheUsage();
+        return;
     }
+
+    if (category == MapGraphicsMemoryGovernor::RetainedLayerTiles)
+    {
+        //Shrinking maxCost makes QCache evict its least-recently-used tiles
+        QMutexLocker locker(&_globalMutex);
+        const int maxCost = _retainedLayers.maxCost();
+        _retainedLayers.setMaxCost((int)(_retainedLayers.totalCost() * qBound<qreal>(0.0, keepFraction, 1.0)));
+        _retainedLayers.setMaxCost(maxCost);
+        this->reportRetainedLayerUsage();
+        return;
+    }
+
+    if (category != MapGraphicsMemoryGovernor::PendingCompositeTiles)
+        return;
+
+    QMutexLocker locker(&_globalMutex);
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    const qint64 keepBytes = _pendingTileBytes * qBound<qreal>(0.0, keepFraction, 1.0);
+
+    //Finish the oldest pending composites first. They've been waiting longest for their stragglers.
+    QList<QPair<qint64, QString> > byAge;
+    QHash<QString, PendingComposite *>::const_iterator iter;
+    for (iter = _pendingTiles.constBegin(); iter != _pendingTiles.constEnd(); iter++)
+        byAge.append(QPair<qint64, QString>(iter.value()->requestTime, iter.key()));
+    std::sort(byAge.begin(), byAge.end());
+
+    for (int i = 0; i < byAge.size() && _pendingTileBytes > keepBytes; i++)
+    {
+        const QString cacheID = byAge.at(i).second;
+        PendingComposite * pending = _pendingTiles.value(cacheID);
+
+        //Nothing has arrived for this one, so there's nothing to free
+        quint32 x, y, z;
+        if (pending->tiles.isEmpty() || !MapTileSource::cacheID2xyz(cacheID, &x, &y, &z))
+            continue;
+
+        /*
+          Someone is waiting for this tile, so rather than dropping it we deliver what we have now. The
+          layers still missing are treated like ones that missed their deadline, so publishComposite()
+          delivers it as a provisional tile and rebuildFromRetained() delivers the final one once they've
+          all arrived or failed.
+        */
+        foreach(quint32 index, pending->expected.values())
+        {
+            if (pending->tiles.contains(index) || (int)index >= layers->sources.size())
+                continue;
+            pending->expected.remove(index);
+            _lateLayers[cacheID].insert(layers->sources.at(index).data());
+        }
+        this->publishComposite(x,y,z,cacheID);
+    }
+
+    this->reportPendingTileUsage();
+}
+
+//private slot
+void CompositeTileSource::clearPendingTiles()
+{
+    QList<PendingComposite *> pendingTiles = _pendingTiles.values();
     _pendingTiles.clear();
+    _lateLayers.clear();
+    _abandonedLayers.clear();
+    for (int i = 0; i < pendingTiles.size(); i++)
+        this->deletePendingComposite(pendingTiles.at(i));
+    this->reportPendingTileUsage();
 }
 
 //private
@@ -432,18 +868,454 @@ void CompositeTileSource::doChildThreading(QSharedPointer<MapTileSource> source)
     if (source.isNull())
         return;
 
-    //We create a new thread for each child source in our care.
-    QThread * sourceThread = new QThread();
-    sourceThread->start();
-    source->moveToThread(sourceThread);
+    //Each child source in our care goes to one of the shared host threads
+    MapGraphicsExecutor::getInstance()->hostSource(source.data());
+}
 
-    //Set the thread up so that it will shutdown and be destroyed when the tilesource is dead
-    connect(source.data(),
-            SIGNAL(destroyed()),
-            sourceThread,
-            SLOT(quit()));
-    connect(sourceThread,
-            SIGNAL(finished()),
-            sourceThread,
-            SLOT(deleteLater()));
+//private
+std::shared_ptr<const CompositeTileSource::LayerSnapshot> CompositeTileSource::layers() const
+{
+    return std::atomic_load(&_layers);
+}
+
+//private
+void CompositeTileSource::publishLayers(CompositeTileSource::LayerSnapshot *updated)
+{
+    updated->fingerprint = updated->computeFingerprint();
+    std::atomic_store(&_layers, std::shared_ptr<const LayerSnapshot>(updated));
+}
+
+quint64 CompositeTileSource::LayerSnapshot::computeFingerprint() const
+{
+    //FNV-1a over what the blend actually sees: the visible layers, in order, with their 8-bit opacities and
+    //their colour filters
+    quint64 hash = 14695981039346656037ULL;
+    for (int i = 0; i < sources.size(); i++)
+    {
+        const int alpha = qBound<int>(0, qRound(this->effectiveOpacity(i) * 255.0), 255);
+        if (alpha == 0)
+            continue;
+
+        const quint64 values[2] = {(quint64)(quintptr)sources.at(i).data(), (quint64)alpha};
+        const uchar * bytes = reinterpret_cast<const uchar *>(values);
+        for (size_t j = 0; j < sizeof(values); j++)
+        {
+            hash ^= bytes[j];
+            hash *= 1099511628211ULL;
+        }
+
+        if (filters.at(i).isIdentity())
+            continue;
+        bytes = reinterpret_cast<const uchar *>(filters.at(i).matrix());
+        for (size_t j = 0; j < 12 * sizeof(float); j++)
+        {
+            hash ^= bytes[j];
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+qreal CompositeTileSource::LayerSnapshot::effectiveOpacity(int index) const
+{
+    if (enabledFlags.at(index) == false)
+        return 0.0;
+
+    //If there are no other layers, we need to be opaque no matter what
+    if (sources.size() == 1)
+        return 1.0;
+
+    return opacities.at(index);
+}
+
+//private
+QImage *CompositeTileSource::buildComposite(QMap<quint32, QImage *> *tiles, bool takeTiles)
+{
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    const quint16 tileSize = this->tileSize();
+
+    //Nothing underneath an opaque layer shows, so that's where we start
+    int bottom = this->occludingLayer(*tiles);
+    if (bottom < 0)
+        bottom = layers->sources.size()-1;
+
+    QImage * toRet = 0;
+    for (int i = bottom; i >= 0; i--)
+    {
+        if (!tiles->contains(i))
+            continue;
+        QImage * childTile = tiles->value(i);
+        const qreal opacity = layers->effectiveOpacity(i);
+        if (opacity <= 0.0)
+            continue;
+
+        if (toRet == 0)
+        {
+            /*
+              The bottom-most layer that's fully shown becomes the composite itself, so the layers
+              above it are blended in place over its buffer instead of into a freshly allocated one.
+              If we can't have its buffer, we at least start from a copy instead of a blank tile.
+            */
+            if (opacity >= 1.0 && childTile->width() == tileSize && childTile->height() == tileSize)
+            {
+                if (takeTiles)
+                {
+                    tiles->remove(i);
+                    _pendingTileBytes -= childTile->sizeInBytes();
+                    toRet = childTile;
+                }
+                else
+                    toRet = new QImage(*childTile);
+
+                //MapTileBlender blends over opaque Format_RGB32 tiles as they are
+                if (toRet->format() != QImage::Format_ARGB32_Premultiplied && toRet->format() != QImage::Format_RGB32)
+                    *toRet = toRet->convertToFormat(QImage::Format_ARGB32_Premultiplied);
+
+                //The buffer is ours now (a retained tile it shares pixels with is detached), so filter it in place
+                MapTileBlender::filter(toRet, layers->filters.at(i));
+                continue;
+            }
+
+            //Layers that don't cover the tile leave holes
+            toRet = new QImage(tileSize, tileSize, QImage::Format_ARGB32_Premultiplied);
+            toRet->fill(Qt::transparent);
+        }
+        MapTileBlender::blend(toRet, *childTile, opacity, layers->filters.at(i));
+    }
+
+    //Nothing visible at all
+    if (toRet == 0)
+    {
+        toRet = new QImage(tileSize, tileSize, QImage::Format_ARGB32_Premultiplied);
+        toRet->fill(Qt::transparent);
+    }
+    return toRet;
+}
+
+//private
+QSet<quint32> CompositeTileSource::contributingLayers(quint32 x, quint32 y, quint8 z) const
+{
+    //Regional layers cover little of the world, and disabled or fully transparent layers don't show anywhere
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    QSet<quint32> toRet;
+    for (int i = 0; i < layers->sources.size(); i++)
+    {
+        const QSharedPointer<MapTileSource>& source = layers->sources.at(i);
+        if (layers->effectiveOpacity(i) > 0.0 && z <= source->effectiveMaxZoomLevel() && source->tileInCoverage(x,y,z))
+            toRet.insert(i);
+    }
+    return toRet;
+}
+
+//private
+void CompositeTileSource::matchLayerZoomLevels()
+{
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    if (layers->sources.isEmpty())
+    {
+        this->restoreLayerZoomLevels();
+        return;
+    }
+
+    /*
+      Layers that have stopped being overlays (removed, or moved to the bottom) get their own overzoom back.
+      That includes the basemap, whose depth is what we're about to match.
+    */
+    QSet<MapTileSource *> overlays;
+    for (int i = 0; i < layers->sources.size() - 1; i++)
+        overlays.insert(layers->sources.at(i).data());
+    this->restoreLayerZoomLevels(overlays);
+
+    const quint8 basemapZoom = layers->sources.last()->effectiveMaxZoomLevel();
+    for (int i = 0; i < layers->sources.size() - 1; i++)
+    {
+        QSharedPointer<MapTileSource> source = layers->sources.at(i);
+        const quint8 nativeZoom = source->maxZoomLevel(QPointF());
+        const quint8 current = source->maxOverzoomLevel();
+
+        //If someone else changed the child's overzoom since we did, that's its own setting now
+        OverzoomChange change;
+        if (_overzoomChanges.contains(source.data()) && _overzoomChanges.value(source.data()).applied == current)
+            change = _overzoomChanges.value(source.data());
+        else
+        {
+            change.source = source;
+            change.original = current;
+        }
+
+        //Never shallower than whoever set up the child asked for
+        const quint8 wanted = qMin<int>(basemapZoom, nativeZoom + MAX_LAYER_OVERZOOM_LEVELS);
+        change.applied = (nativeZoom < wanted) ? qMax(change.original, wanted) : change.original;
+
+        if (change.applied != current)
+            source->setMaxOverzoomLevel(change.applied);
+        if (change.applied == change.original)
+            _overzoomChanges.remove(source.data());
+        else
+            _overzoomChanges.insert(source.data(), change);
+    }
+}
+
+//private
+void CompositeTileSource::restoreLayerZoomLevels(const QSet<MapTileSource *> &keep)
+{
+    foreach(MapTileSource * key, _overzoomChanges.keys())
+    {
+        if (keep.contains(key))
+            continue;
+
+        const OverzoomChange change = _overzoomChanges.take(key);
+        QSharedPointer<MapTileSource> source = change.source.toStrongRef();
+
+        //Leave it alone if someone else has changed it since
+        if (!source.isNull() && source->maxOverzoomLevel() == change.applied)
+            source->setMaxOverzoomLevel(change.original);
+    }
+}
+
+//private
+void CompositeTileSource::rebuildFromRetained(quint32 x, quint32 y, quint8 z)
+{
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    const QString cacheID = MapTileSource::createCacheID(x,y,z);
+    const QSet<quint32> contributing = this->contributingLayers(x,y,z);
+    const QSet<MapTileSource *> stillLate = _lateLayers.value(cacheID);
+    const QSet<MapTileSource *> abandoned = _abandonedLayers.value(cacheID);
+    const QHash<MapTileSource *, QImage> * retained = _retainedLayers.object(cacheID);
+
+    QMap<quint32, QImage *> tiles;
+    bool complete = true;
+    foreach(quint32 i, contributing)
+    {
+        MapTileSource * child = layers->sources.at(i).data();
+        if (retained != 0 && retained->contains(child))
+            tiles.insert(i, new QImage(retained->value(child)));
+        else if (!stillLate.contains(child) && !abandoned.contains(child))
+            complete = false;
+    }
+
+    //Some of what went into the composite is gone from the retained tiles. Start over.
+    if (!complete)
+    {
+        qDeleteAll(tiles);
+        this->fetchTile(x,y,z);
+        return;
+    }
+
+    QImage * toRet = this->buildComposite(&tiles, false);
+    qDeleteAll(tiles);
+    if (stillLate.isEmpty() && abandoned.isEmpty())
+        this->toCompositeCache(cacheID, *toRet);
+
+    //Until the last late layer has arrived or failed, there's a better version to come
+    if (stillLate.isEmpty())
+        this->prepareNewlyReceivedTile(x,y,z,toRet);
+    else
+        this->prepareProvisionalTile(x,y,z,toRet);
+}
+
+//private
+CompositeTileSource::LayerStatistics *CompositeTileSource::layerStatisticsFor(MapTileSource *source)
+{
+    if (!_layerStatistics.contains(source))
+    {
+        LayerStatistics fresh;
+        fresh.tilesRequested = 0;
+        fresh.deadlinesMissed = 0;
+        fresh.lateArrivals = 0;
+        _layerStatistics.insert(source, fresh);
+    }
+    return &_layerStatistics[source];
+}
+
+//private
+int CompositeTileSource::occludingLayer(const QMap<quint32, QImage *> &tiles) const
+{
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+    const quint16 tileSize = this->tileSize();
+
+    //Indices go from the top layer down, and so does QMap
+    QMap<quint32, QImage *>::const_iterator iter;
+    for (iter = tiles.constBegin(); iter != tiles.constEnd(); iter++)
+    {
+        const QImage * tile = iter.value();
+        if ((int)iter.key() < layers->sources.size() && layers->effectiveOpacity(iter.key()) >= 1.0
+                && tile->width() == tileSize && tile->height() == tileSize && MapTileBlender::isOpaque(*tile))
+            return iter.key();
+    }
+    return -1;
+}
+
+//private
+void CompositeTileSource::dropOccludedLayers(CompositeTileSource::PendingComposite *pending)
+{
+    const int occluding = this->occludingLayer(pending->tiles);
+    if (occluding < 0)
+        return;
+
+    foreach(quint32 i, pending->expected.values())
+    {
+        if ((int)i <= occluding)
+            continue;
+        pending->expected.remove(i);
+
+        QImage * tile = pending->tiles.take(i);
+        if (tile == 0)
+            continue;
+        _pendingTileBytes -= tile->sizeInBytes();
+        delete tile;
+    }
+}
+
+//private
+void CompositeTileSource::publishComposite(quint32 x, quint32 y, quint8 z, const QString &cacheID)
+{
+    PendingComposite * pending = _pendingTiles.value(cacheID, 0);
+    if (pending == 0)
+        return;
+    QMap<quint32, QImage *> * tiles = &pending->tiles;
+    const std::shared_ptr<const LayerSnapshot> layers = this->layers();
+
+    //Still waiting for a tile or two?
+    if (tiles->size() < pending->expected.size())
+    {
+        if (!_progressiveCompositing)
+            return;
+
+        //Once the bottom visible layer is here, show what we've got and improve on it as the rest arrive
+        QList<quint32> expected = pending->expected.values();
+        std::sort(expected.begin(), expected.end());
+        for (int i = expected.size()-1; i >= 0; i--)
+        {
+            if (layers->effectiveOpacity(expected.at(i)) <= 0.0)
+                continue;
+            if (tiles->contains(expected.at(i)))
+                this->prepareProvisionalTile(x,y,z,this->buildComposite(tiles,false));
+            break;
+        }
+        return;
+    }
+
+    QImage * toRet = this->buildComposite(tiles,true);
+    _pendingTiles.remove(cacheID);
+    this->deletePendingComposite(pending);
+    this->reportPendingTileUsage();
+
+    //Composites missing a layer aren't worth remembering
+    const bool late = _lateLayers.contains(cacheID);
+    if (!late && !_abandonedLayers.contains(cacheID))
+        this->toCompositeCache(cacheID, *toRet);
+
+    /*
+      Views stop listening once they have the final version of a tile, so while late layers may still
+      arrive this one is only provisional. rebuildFromRetained() delivers the final one when the last
+      of them arrives or fails.
+    */
+    if (late)
+        this->prepareProvisionalTile(x,y,z,toRet);
+    else
+        this->prepareNewlyReceivedTile(x,y,z,toRet);
+}
+
+//private
+QString CompositeTileSource::compositeCacheKey(const CompositeTileSource::LayerSnapshot &layers,
+                                               const QString &cacheID) const
+{
+    return QString::number(layers.fingerprint, 16) % ':' % cacheID;
+}
+
+//private
+void CompositeTileSource::toCompositeCache(const QString &cacheID, const QImage &composite)
+{
+    const QString key = this->compositeCacheKey(*this->layers(), cacheID);
+    _compositeCache.insert(key, new QImage(composite), qMax<int>(1, composite.sizeInBytes() / 1024));
+    this->reportCompositeCacheUsage();
+}
+
+//private
+void CompositeTileSource::clearCompositeCache()
+{
+    _compositeCache.clear();
+    this->reportCompositeCacheUsage();
+}
+
+//private
+void CompositeTileSource::reportCompositeCacheUsage()
+{
+    //We don't use MapTileSource's memory cache, so this is ours to report
+    MapGraphicsMemoryGovernor::getInstance()->reportUsage(this,
+                                                          MapGraphicsMemoryGovernor::TileMemoryCache,
+                                                          (qint64)_compositeCache.totalCost() * 1024);
+}
+
+//private
+void CompositeTileSource::retainLayerTile(const QString &cacheID, MapTileSource *source, const QImage &tile)
+{
+    //QCache costs are fixed on insertion, so the entry is taken out and put back in with its new cost
+    QHash<MapTileSource *, QImage> * layers = _retainedLayers.take(cacheID);
+    if (layers == 0)
+        layers = new QHash<MapTileSource *, QImage>();
+    layers->insert(source, tile);
+
+    qint64 bytes = 0;
+    foreach(const QImage& layer, *layers)
+        bytes += layer.sizeInBytes();
+    _retainedLayers.insert(cacheID, layers, qMax<int>(1, bytes / 1024));
+
+    this->reportRetainedLayerUsage();
+}
+
+//private
+void CompositeTileSource::forgetRetainedLayer(MapTileSource *source)
+{
+    foreach(const QString& cacheID, _retainedLayers.keys())
+    {
+        QHash<MapTileSource *, QImage> * layers = _retainedLayers.object(cacheID);
+        if (!layers->contains(source))
+            continue;
+
+        layers = _retainedLayers.take(cacheID);
+        layers->remove(source);
+        if (layers->isEmpty())
+        {
+            delete layers;
+            continue;
+        }
+
+        qint64 bytes = 0;
+        foreach(const QImage& layer, *layers)
+            bytes += layer.sizeInBytes();
+        _retainedLayers.insert(cacheID, layers, qMax<int>(1, bytes / 1024));
+    }
+    this->reportRetainedLayerUsage();
+}
+
+//private
+void CompositeTileSource::deletePendingComposite(CompositeTileSource::PendingComposite *pending)
+{
+    if (pending == 0)
+        return;
+
+    foreach(QImage * tile, pending->tiles)
+    {
+        _pendingTileBytes -= tile->sizeInBytes();
+        delete tile;
+    }
+    delete pending;
+}
+
+//private
+void CompositeTileSource::reportPendingTileUsage()
+{
+    MapGraphicsMemoryGovernor::getInstance()->reportUsage(this,
+                                                          MapGraphicsMemoryGovernor::PendingCompositeTiles,
+                                                          _pendingTileBytes);
+}
+
+//private
+void CompositeTileSource::reportRetainedLayerUsage()
+{
+    MapGraphicsMemoryGovernor::getInstance()->reportUsage(this,
+                                                          MapGraphicsMemoryGovernor::RetainedLayerTiles,
+                                                          (qint64)_retainedLayers.totalCost() * 1024);
 }
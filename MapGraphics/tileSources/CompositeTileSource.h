@@ -2,18 +2,37 @@
 #define COMPOSITETILESOURCE_H
 
 #include "MapTileSource.h"
+#include "MapLayerFilter.h"
 #include "MapGraphics_global.h"
 
 #include <QList>
 #include <QHash>
 #include <QMap>
+#include <QSet>
 #include <QSharedPointer>
+#include <QCache>
+#include <QImage>
 #include <QMutex>
 #include <QRecursiveMutex>
 
+#include <memory>
+
+class QTimer;
+
 class MAPGRAPHICSSHARED_EXPORT CompositeTileSource : public MapTileSource
 {
     Q_OBJECT
+public:
+    struct LayerStatistics
+    {
+        //Tiles the layer was asked for
+        quint64 tilesRequested;
+
+        //Tiles that hadn't arrived by the layer's deadline, and how many of those showed up later anyway
+        quint64 deadlinesMissed;
+        quint64 lateArrivals;
+    };
+
 public:
     explicit CompositeTileSource();
     virtual ~CompositeTileSource();
@@ -27,13 +46,13 @@ public:
     //pure-virtual from MapTileSource
     virtual quint64 tilesOnZoomLevel(quint8 zoomLevel) const;
 
-    //pure-virtual from MapTileSource
+    //pure-virtual from MapTileSource. The bottom layer's. Children with other tile sizes are resampled to this one.
     virtual quint16 tileSize() const;
 
     //pure-virtual from MapTileSource
     virtual quint8 minZoomLevel(QPointF ll);
 
-    //pure-virtual from MapTileSource
+    //pure-virtual from MapTileSource. The bottom layer's, overzoom included.
     virtual quint8 maxZoomLevel(QPointF ll);
 
     //pure-virtual from MapTileSource
@@ -42,6 +61,12 @@ public:
     //pure-virtual from MapTileSource
     virtual QString tileFileExtension() const;
 
+    //virtual from MapTileSource. Forwards to the child sources, which do the actual caching.
+    virtual void preloadHotTiles(const QPointF& centerLL, quint8 zoomLevel);
+
+    //virtual from MapTileSource. A composite covers whatever any of its enabled children covers.
+    virtual bool tileInCoverage(quint32 x, quint32 y, quint8 z) const;
+
 
     void addSourceTop(QSharedPointer<MapTileSource>, qreal opacity = 1.0);
     void addSourceBottom(QSharedPointer<MapTileSource>, qreal opacity = 1.0);
@@ -54,6 +79,53 @@ public:
     bool getEnabledFlag(int index) const;
     void setEnabledFlag(int index, bool isEnabled);
 
+    /*!
+     \brief Returns how long composites wait for the layer's tiles, in milliseconds. 0 means forever.
+    */
+    int layerDeadline(int index) const;
+
+    /*!
+     \brief Sets how long composites wait for the layer's tiles. Once a tile is overdue, the composite is
+     delivered without it, and delivered again with it if it does arrive. Defaults to 10 seconds.
+
+     \param index the layer
+     \param msecs the deadline in milliseconds, or 0 to wait forever
+    */
+    void setLayerDeadline(int index, int msecs);
+
+    MapLayerFilter layerFilter(int index) const;
+
+    /*!
+     \brief Sets the colour filter the layer is blended with, e.g. MapLayerFilter::nightMode(). The layer's
+     tiles aren't fetched again for this; composites are re-blended from the tiles we've retained.
+
+     \param index the layer
+     \param filter the filter, or a default-constructed MapLayerFilter for none
+    */
+    void setLayerFilter(int index, const MapLayerFilter& filter);
+
+    /*!
+     \brief Returns how the layer has been doing at delivering its tiles in time
+    */
+    CompositeTileSource::LayerStatistics layerStatistics(int index) const;
+    void resetLayerStatistics();
+
+    /*!
+     \brief Returns true if composites are delivered progressively. Enabled by default.
+    */
+    bool progressiveCompositing() const;
+
+    /*!
+     \brief Enables or disables progressive compositing. When enabled, a provisional composite is delivered
+     as soon as the bottom visible layer of a tile has arrived, and again whenever another visible layer
+     arrives, so a slow layer doesn't hold up the rest of the map. Each delivery of a tile has a higher
+     version than the last (see getFinishedTile()). When disabled, a composite is only delivered once all
+     of its layers have arrived.
+
+     \param enabled
+    */
+    void setProgressiveCompositing(bool enabled);
+
 
 
 protected:
@@ -76,22 +148,221 @@ signals:
 
 public slots:
 
+protected slots:
+    //virtual from MapTileSource
+    virtual void handleMemoryTrim(int category, qreal keepFraction);
+
 private slots:
     void handleTileRetrieved(quint32 x, quint32 y, quint8 z);
+    void handleChildTileFailed(quint32 x, quint32 y, quint8 z);
+    void handleChildTilesInvalidated();
+    void checkLayerDeadlines();
     void clearPendingTiles();
 
 private:
+    /*!
+     \brief Bookkeeping for a composite tile whose child tiles haven't all arrived yet
+    */
+    struct PendingComposite
+    {
+        //Child tiles received so far, keyed by child index
+        QMap<quint32, QImage *> tiles;
+
+        //Indices of the children whose tiles we're waiting for: those that cover the tile, show, aren't
+        //hidden by an opaque layer and haven't missed their deadline
+        QSet<quint32> expected;
+
+        //When the composite was requested, in msecs since the epoch
+        qint64 requestTime;
+    };
+
+    /*!
+     \brief The layers and their settings, as of one moment. Snapshots are never modified once published,
+     so they can be read from any thread without locking.
+    */
+    struct LayerSnapshot
+    {
+        QList<QSharedPointer<MapTileSource> > sources;
+        QList<qreal> opacities;
+        QList<bool> enabledFlags;
+
+        //In msecs, 0 for none
+        QList<int> deadlines;
+
+        QList<MapLayerFilter> filters;
+
+        //Identifies what composites built from this snapshot look like. Set by publishLayers().
+        quint64 fingerprint;
+
+        /*!
+         \brief Returns the opacity a layer is actually drawn with, taking its enabled flag into account
+        */
+        qreal effectiveOpacity(int index) const;
+
+        /*!
+         \brief Hashes everything that affects how the layers blend: which ones show, their order, their
+         opacities and their colour filters. Snapshots that blend the same way get the same fingerprint.
+        */
+        quint64 computeFingerprint() const;
+    };
+
+    /*!
+     \brief Returns the current layer snapshot. Lock-free, so it's safe to call from the GUI thread while
+     we're compositing.
+    */
+    std::shared_ptr<const LayerSnapshot> layers() const;
+
+    /*!
+     \brief Replaces the current layer snapshot with updated, which we take ownership of. Only call with
+     _globalMutex held, so concurrent changes don't get lost.
+    */
+    void publishLayers(LayerSnapshot * updated);
+
     void doChildThreading(QSharedPointer<MapTileSource>);
 
+    /*!
+     \brief Blends the child tiles we have into a new composite tile, from the bottom layer up. If takeTiles
+     is true, the bottom layer's tile may be taken out of tiles and used as the composite's buffer.
+    */
+    QImage * buildComposite(QMap<quint32, QImage *> * tiles, bool takeTiles);
+
+    /*!
+     \brief Returns the index of the topmost layer whose tile hides everything underneath it, i.e. an
+     opaque tile on a fully shown layer, or -1 if none of the tiles do
+    */
+    int occludingLayer(const QMap<quint32, QImage *>& tiles) const;
+
+    /*!
+     \brief Returns the indices of the layers that can show anything on tile x,y,z
+    */
+    QSet<quint32> contributingLayers(quint32 x, quint32 y, quint8 z) const;
+
+    /*!
+     \brief Enables overzoom on the layers that don't go as deep as the bottom layer (the basemap), so
+     coarse overlays are scaled up from their deepest zoom level rather than limiting the whole composite
+    */
+    void matchLayerZoomLevels();
+
+    /*!
+     \brief Gives the children whose overzoom matchLayerZoomLevels() changed their own back, except for
+     the ones in keep
+    */
+    void restoreLayerZoomLevels(const QSet<MapTileSource *>& keep = QSet<MapTileSource *>());
+
+    /*!
+     \brief Delivers composite x,y,z again, built from the retained tiles, after a late layer arrived or
+     failed. The composite is provisional while other layers are still late. Requests the tile all over
+     again if the retained tiles aren't enough.
+    */
+    void rebuildFromRetained(quint32 x, quint32 y, quint8 z);
+
+    /*!
+     \brief Returns the statistics of the given child. Only call with _statisticsMutex held.
+    */
+    CompositeTileSource::LayerStatistics * layerStatisticsFor(MapTileSource * source);
+
+    /*!
+     \brief Stops waiting for the layers underneath an opaque layer, and throws away what we have of them
+    */
+    void dropOccludedLayers(PendingComposite * pending);
+
+    /*!
+     \brief Delivers the composite for the given pending tile if all of its layers are there, or a
+     provisional one if progressive compositing allows it
+    */
+    void publishComposite(quint32 x, quint32 y, quint8 z, const QString& cacheID);
+
+    /*!
+     \brief Remembers a child's tile so the composite can be rebuilt without asking the child again
+    */
+    void retainLayerTile(const QString& cacheID, MapTileSource * source, const QImage& tile);
+
+    /*!
+     \brief Forgets every tile we're retaining from the given child
+    */
+    void forgetRetainedLayer(MapTileSource * source);
+
+    /*!
+     \brief Tells the MapGraphicsMemoryGovernor how much memory the retained layer tiles are using
+    */
+    void reportRetainedLayerUsage();
+
+    /*!
+     \brief Returns the key of composite cacheID in _compositeCache when built from the given layers
+    */
+    QString compositeCacheKey(const LayerSnapshot& layers, const QString& cacheID) const;
+
+    void toCompositeCache(const QString& cacheID, const QImage& composite);
+    void clearCompositeCache();
+
+    /*!
+     \brief Tells the MapGraphicsMemoryGovernor how much memory the composite cache is using
+    */
+    void reportCompositeCacheUsage();
+
+    /*!
+     \brief Deletes a pending composite and its child tiles, keeping the byte count up to date
+    */
+    void deletePendingComposite(PendingComposite * pending);
+
+    /*!
+     \brief Tells the MapGraphicsMemoryGovernor how much memory the pending tiles are using
+    */
+    void reportPendingTileUsage();
+
     // было: QMutex * _globalMutex;
+    //Serializes layer changes and guards the compositing state below. Reading the layers doesn't need it.
     mutable QRecursiveMutex _globalMutex; // рекурсивный мьютекс-член
 
-    QList<QSharedPointer<MapTileSource> > _childSources;
-    QList<qreal> _childOpacities;
-    QList<bool> _childEnabledFlags;
+    //Only ever accessed through std::atomic_load() and std::atomic_store()
+    std::shared_ptr<const LayerSnapshot> _layers;
+
+    //Composites waiting on child tiles, keyed by cacheID
+    QHash<QString, PendingComposite *> _pendingTiles;
+
+    //Bytes held by the child tiles in _pendingTiles
+    qint64 _pendingTileBytes;
+
+    bool _progressiveCompositing;
+
+    /*
+      The latest tile of each child, keyed by the cacheID of the composite and then by child, so changing
+      the layers' opacity, order or enabled flags only needs a re-blend. Cost is in KiB.
+    */
+    QCache<QString, QHash<MapTileSource *, QImage> > _retainedLayers;
+
+    /*
+      Finished composites, keyed by the fingerprint of the layers they were built from and their cacheID,
+      so switching back and forth between layer settings doesn't even need a re-blend. Cost is in KiB.
+    */
+    QCache<QString, QImage> _compositeCache;
+
+    //Checks the pending composites for overdue layers
+    QTimer * _deadlineTimer;
+
+    //Children that missed their deadline for composites we've delivered or given up waiting on, by cacheID
+    QHash<QString, QSet<MapTileSource *> > _lateLayers;
+
+    //Children that failed to deliver their tile for a composite, by cacheID. Such composites aren't cached.
+    QHash<QString, QSet<MapTileSource *> > _abandonedLayers;
+
+    mutable QMutex _statisticsMutex;
+    QHash<MapTileSource *, LayerStatistics> _layerStatistics;
+
+    /*!
+     \brief What matchLayerZoomLevels() did to a child's overzoom, so it can be undone
+    */
+    struct OverzoomChange
+    {
+        QWeakPointer<MapTileSource> source;
+
+        //The child's own maxOverzoomLevel(), from before we changed it
+        quint8 original;
 
-    //A hash of QString:QMap pointer to quint32:QImage pointer
-    QHash<QString, QMap<quint32, QImage *> * > _pendingTiles;
+        //The maxOverzoomLevel() we gave it
+        quint8 applied;
+    };
+    QHash<MapTileSource *, OverzoomChange> _overzoomChanges;
 
 };
 
@@ -0,0 +1,385 @@
+#include "DaemonTileSource.h"
+
+#include "guts/MapGraphicsExecutor.h"
+#include "guts/MapTileBlender.h"
+#include "guts/MapTileDaemonProtocol.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QSharedMemory>
+#include <QTimer>
+#include <QtDebug>
+
+//After failing to reach the daemon, we use the local source for this long before trying again
+const qint64 RECONNECT_INTERVAL_MSECS = 10000;
+
+//A tile the daemon hasn't delivered after this long is fetched locally instead
+const qint64 DAEMON_REQUEST_TIMEOUT_MSECS = 30000;
+const int TIMEOUT_CHECK_MSECS = 5000;
+
+DaemonTileSource::DaemonTileSource(QSharedPointer<MapTileSource> localSource) :
+    MapTileSource(), _localSource(localSource), _sharedMemory(0), _slotCount(0), _slotBytes(0),
+    _lastConnectFailure(0)
+{
+    //The daemon does the caching. When it's not around, the local source does.
+    this->setCacheMode(MapTileSource::NoCaching);
+
+    if (!_localSource.isNull())
+    {
+        //Like CompositeTileSource's children, the local source goes to one of the shared host threads
+        MapGraphicsExecutor::getInstance()->hostSource(_localSource.data());
+
+        connect(_localSource.data(),
+                SIGNAL(tileRetrieved(quint32,quint32,quint8)),
+                this,
+                SLOT(handleLocalTileRetrieved(quint32,quint32,quint8)));
+        connect(_localSource.data(),
+                SIGNAL(tileRetrievalFailed(quint32,quint32,quint8)),
+                this,
+                SLOT(handleLocalTileFailed(quint32,quint32,quint8)));
+    }
+
+    //Our children move to our thread with us
+    _socket = new QLocalSocket(this);
+    connect(_socket,
+            SIGNAL(connected()),
+            this,
+            SLOT(handleConnected()));
+    connect(_socket,
+            SIGNAL(disconnected()),
+            this,
+            SLOT(handleDisconnected()));
+    connect(_socket,
+            SIGNAL(errorOccurred(QLocalSocket::LocalSocketError)),
+            this,
+            SLOT(handleSocketError()));
+    connect(_socket,
+            SIGNAL(readyRead()),
+            this,
+            SLOT(handleReadyRead()));
+
+    _timeoutTimer = new QTimer(this);
+    connect(_timeoutTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(checkRequestTimeouts()));
+}
+
+DaemonTileSource::~DaemonTileSource()
+{
+    _socket->disconnect(this);
+    _socket->abort();
+
+    if (_sharedMemory != 0)
+        _sharedMemory->detach();
+
+    //Let go of the local source and wait for it to be deleted (unless we're on a host thread), like
+    //CompositeTileSource does
+    QPointer<QObject> localSource = _localSource.data();
+    _localSource.clear();
+    MapGraphicsExecutor::getInstance()->waitUntilDestroyed(localSource, 10000);
+}
+
+bool DaemonTileSource::isDaemonConnected() const
+{
+    return _socket->state() == QLocalSocket::ConnectedState;
+}
+
+QSharedPointer<MapTileSource> DaemonTileSource::localSource() const
+{
+    return _localSource;
+}
+
+QPointF DaemonTileSource::ll2qgs(const QPointF &ll, quint8 zoomLevel) const
+{
+    return _localSource->ll2qgs(ll, zoomLevel);
+}
+
+QPointF DaemonTileSource::qgs2ll(const QPointF &qgs, quint8 zoomLevel) const
+{
+    return _localSource->qgs2ll(qgs, zoomLevel);
+}
+
+quint64 DaemonTileSource::tilesOnZoomLevel(quint8 zoomLevel) const
+{
+    return _localSource->tilesOnZoomLevel(zoomLevel);
+}
+
+quint16 DaemonTileSource::tileSize() const
+{
+    return _localSource->tileSize();
+}
+
+quint8 DaemonTileSource::minZoomLevel(QPointF ll)
+{
+    return _localSource->minZoomLevel(ll);
+}
+
+quint8 DaemonTileSource::maxZoomLevel(QPointF ll)
+{
+    return _localSource->maxZoomLevel(ll);
+}
+
+QString DaemonTileSource::name() const
+{
+    return _localSource->name();
+}
+
+QString DaemonTileSource::tileFileExtension() const
+{
+    return _localSource->tileFileExtension();
+}
+
+bool DaemonTileSource::tileInCoverage(quint32 x, quint32 y, quint8 z) const
+{
+    return MapTileSource::tileInCoverage(x,y,z) && _localSource->tileInCoverage(x,y,z);
+}
+
+//protected
+void DaemonTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
+{
+    //Don't ask twice for the same tile
+    const QString cacheID = MapTileSource::createCacheID(x,y,z);
+    if (_requested.contains(cacheID) || _localRequests.contains(cacheID) || _unsent.contains(cacheID))
+        return;
+
+    if (this->isDaemonConnected())
+    {
+        this->sendRequest(cacheID);
+        return;
+    }
+
+    //If the daemon wasn't there a moment ago, it probably still isn't
+    if (QDateTime::currentMSecsSinceEpoch() - _lastConnectFailure < RECONNECT_INTERVAL_MSECS)
+    {
+        this->fetchLocally(cacheID);
+        return;
+    }
+
+    _unsent.append(cacheID);
+    this->connectToDaemon();
+}
+
+//private slot
+void DaemonTileSource::handleConnected()
+{
+    const QList<QString> unsent = _unsent;
+    _unsent.clear();
+    foreach(const QString& cacheID, unsent)
+        this->sendRequest(cacheID);
+}
+
+//private slot
+void DaemonTileSource::handleDisconnected()
+{
+    _received.clear();
+    if (_sharedMemory != 0)
+    {
+        _sharedMemory->detach();
+        delete _sharedMemory;
+        _sharedMemory = 0;
+    }
+
+    //Whatever the daemon owed us, we'll get ourselves
+    this->fetchAllLocally();
+}
+
+//private slot
+void DaemonTileSource::handleSocketError()
+{
+    if (_socket->state() != QLocalSocket::ConnectedState)
+    {
+        _lastConnectFailure = QDateTime::currentMSecsSinceEpoch();
+        this->fetchAllLocally();
+    }
+}
+
+//private slot
+void DaemonTileSource::handleReadyRead()
+{
+    _received += _socket->readAll();
+
+    QByteArray payload;
+    while (MapTileDaemonProtocol::takeMessage(&_received, &payload))
+        this->handleMessage(payload);
+}
+
+//private slot
+void DaemonTileSource::handleLocalTileRetrieved(quint32 x, quint32 y, quint8 z)
+{
+    /*
+      The local source may deliver tiles we didn't ask it for, like improved versions of earlier tiles or
+      tiles somebody else requested from it. Those are left for whoever asked.
+    */
+    const QString cacheID = MapTileSource::createCacheID(x,y,z);
+    if (!_localRequests.contains(cacheID))
+        return;
+
+    bool provisional;
+    QImage * tile = _localSource->getFinishedTile(x,y,z,0,&provisional);
+    if (tile == 0)
+        return;
+
+    //Pass provisional versions along, but keep waiting for the real tile
+    if (provisional)
+    {
+        this->prepareProvisionalTile(x,y,z,tile);
+        return;
+    }
+
+    _localRequests.remove(cacheID);
+    this->prepareNewlyReceivedTile(x,y,z,tile);
+}
+
+//private slot
+void DaemonTileSource::handleLocalTileFailed(quint32 x, quint32 y, quint8 z)
+{
+    //Forget the request so the next one for this tile fetches it again
+    if (!_localRequests.remove(MapTileSource::createCacheID(x,y,z)))
+        return;
+    this->abandonTile(x,y,z);
+}
+
+//private slot
+void DaemonTileSource::checkRequestTimeouts()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<QString> overdue;
+    QHash<QString, qint64>::const_iterator iter;
+    for (iter = _requested.constBegin(); iter != _requested.constEnd(); iter++)
+    {
+        if (now - iter.value() >= DAEMON_REQUEST_TIMEOUT_MSECS)
+            overdue.append(iter.key());
+    }
+
+    foreach(const QString& cacheID, overdue)
+    {
+        _requested.remove(cacheID);
+        this->fetchLocally(cacheID);
+    }
+
+    if (_requested.isEmpty())
+        _timeoutTimer->stop();
+}
+
+//private
+void DaemonTileSource::connectToDaemon()
+{
+    if (_socket->state() != QLocalSocket::UnconnectedState)
+        return;
+    _socket->connectToServer(MapTileDaemonProtocol::serverName());
+}
+
+//private
+void DaemonTileSource::sendRequest(const QString &cacheID)
+{
+    quint32 x,y,z;
+    if (!MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
+        return;
+
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream << (quint8)MapTileDaemonProtocol::Request << this->name() << x << y << (quint8)z;
+    _socket->write(MapTileDaemonProtocol::frame(payload));
+
+    _requested.insert(cacheID, QDateTime::currentMSecsSinceEpoch());
+    if (!_timeoutTimer->isActive())
+        _timeoutTimer->start(TIMEOUT_CHECK_MSECS);
+}
+
+//private
+void DaemonTileSource::fetchLocally(const QString &cacheID)
+{
+    quint32 x,y,z;
+    if (_localSource.isNull() || _localRequests.contains(cacheID) || !MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
+        return;
+
+    _localRequests.insert(cacheID);
+    _localSource->requestTile(x,y,z);
+}
+
+//private
+void DaemonTileSource::fetchAllLocally()
+{
+    QList<QString> toFetch = _unsent;
+    toFetch.append(_requested.keys());
+    _unsent.clear();
+    _requested.clear();
+
+    foreach(const QString& cacheID, toFetch)
+        this->fetchLocally(cacheID);
+}
+
+//private
+void DaemonTileSource::handleMessage(const QByteArray &payload)
+{
+    QDataStream stream(payload);
+    stream.setVersion(QDataStream::Qt_5_15);
+
+    quint8 type;
+    stream >> type;
+
+    if (type == MapTileDaemonProtocol::Hello)
+    {
+        QString key;
+        quint32 slotCount, slotBytes;
+        stream >> key >> slotCount >> slotBytes;
+
+        delete _sharedMemory;
+        _sharedMemory = new QSharedMemory(key, this);
+        _slotCount = slotCount;
+        _slotBytes = slotBytes;
+        if (!_sharedMemory->attach(QSharedMemory::ReadOnly))
+            qWarning() << "Failed to attach to tile daemon's shared memory:" << _sharedMemory->errorString();
+        return;
+    }
+
+    QString source;
+    quint32 x, y;
+    quint8 z;
+    stream >> source >> x >> y >> z;
+    if (stream.status() != QDataStream::Ok || source != this->name())
+        return;
+
+    //Only take what we're still waiting for
+    const QString cacheID = MapTileSource::createCacheID(x,y,z);
+    if (!_requested.remove(cacheID))
+        return;
+
+    QImage tile;
+    if (type == MapTileDaemonProtocol::TileInSlot)
+    {
+        quint32 slot, generation;
+        stream >> slot >> generation;
+        if (_sharedMemory != 0 && _sharedMemory->isAttached() && (int)slot < _slotCount)
+        {
+            _sharedMemory->lock();
+            tile = MapTileDaemonProtocol::readSlot(_sharedMemory->constData(), _slotBytes, slot, generation,
+                                                   MapTileDaemonProtocol::tileKey(source, x, y, z));
+            _sharedMemory->unlock();
+        }
+    }
+    else if (type == MapTileDaemonProtocol::TileInline)
+        stream >> tile;
+
+    //The daemon couldn't help, or the slot was already reused by the time we got to it
+    if (tile.isNull())
+    {
+        this->fetchLocally(cacheID);
+        return;
+    }
+
+    this->deliverTile(x, y, z, tile);
+}
+
+//private
+void DaemonTileSource::deliverTile(quint32 x, quint32 y, quint8 z, const QImage &tile)
+{
+    //The daemon hands everything over as Format_ARGB32_Premultiplied
+    QImage * image = new QImage(tile);
+    MapTileBlender::detectOpaque(image);
+    this->prepareNewlyReceivedTile(x, y, z, image);
+}
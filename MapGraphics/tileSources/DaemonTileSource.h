@@ -0,0 +1,125 @@
+#ifndef DAEMONTILESOURCE_H
+#define DAEMONTILESOURCE_H
+
+#include "MapTileSource.h"
+#include "MapGraphics_global.h"
+
+#include <QSharedPointer>
+#include <QHash>
+#include <QSet>
+#include <QList>
+#include <QByteArray>
+
+class QLocalSocket;
+class QSharedMemory;
+class QTimer;
+
+/**
+ * @brief Gets its tiles from the MapTileDaemon shared by every MapGraphics application of the user, so
+ * each tile is fetched and decoded only once per machine and the daemon is the only one writing the
+ * disk cache and its expiration database. Decoded tiles are handed over through shared memory.
+ *
+ * The source wraps a regular "local" source with the same name(), which the daemon must also serve.
+ * The local source provides the tile geometry, and is used to fetch tiles whenever the daemon isn't
+ * running or can't provide a tile, so using a DaemonTileSource never makes things worse than using the
+ * local source directly. The DaemonTileSource itself doesn't cache.
+ */
+class MAPGRAPHICSSHARED_EXPORT DaemonTileSource : public MapTileSource
+{
+    Q_OBJECT
+public:
+    explicit DaemonTileSource(QSharedPointer<MapTileSource> localSource);
+    virtual ~DaemonTileSource();
+
+    /**
+     * @brief Returns true if we're currently connected to the daemon
+     *
+     * @return bool
+     */
+    bool isDaemonConnected() const;
+
+    QSharedPointer<MapTileSource> localSource() const;
+
+    //pure-virtual from MapTileSource. Forwarded to the local source.
+    virtual QPointF ll2qgs(const QPointF& ll, quint8 zoomLevel) const;
+
+    //pure-virtual from MapTileSource. Forwarded to the local source.
+    virtual QPointF qgs2ll(const QPointF& qgs, quint8 zoomLevel) const;
+
+    //pure-virtual from MapTileSource. Forwarded to the local source.
+    virtual quint64 tilesOnZoomLevel(quint8 zoomLevel) const;
+
+    //pure-virtual from MapTileSource. Forwarded to the local source.
+    virtual quint16 tileSize() const;
+
+    //pure-virtual from MapTileSource. Forwarded to the local source.
+    virtual quint8 minZoomLevel(QPointF ll);
+
+    //pure-virtual from MapTileSource. Forwarded to the local source.
+    virtual quint8 maxZoomLevel(QPointF ll);
+
+    //pure-virtual from MapTileSource. Forwarded to the local source.
+    virtual QString name() const;
+
+    //pure-virtual from MapTileSource. Forwarded to the local source.
+    virtual QString tileFileExtension() const;
+
+    //virtual from MapTileSource. The local source's coverage applies too.
+    virtual bool tileInCoverage(quint32 x, quint32 y, quint8 z) const;
+
+protected:
+    virtual void fetchTile(quint32 x,
+                           quint32 y,
+                           quint8 z);
+
+private slots:
+    void handleConnected();
+    void handleDisconnected();
+    void handleSocketError();
+    void handleReadyRead();
+    void handleLocalTileRetrieved(quint32 x, quint32 y, quint8 z);
+    void handleLocalTileFailed(quint32 x, quint32 y, quint8 z);
+    void checkRequestTimeouts();
+
+private:
+    //Connects to the daemon unless we're connected, connecting, or gave up on it recently
+    void connectToDaemon();
+
+    void sendRequest(const QString& cacheID);
+
+    //Gets the tile from the local source instead
+    void fetchLocally(const QString& cacheID);
+
+    //Gives every tile we're waiting on the daemon for to the local source
+    void fetchAllLocally();
+
+    void handleMessage(const QByteArray& payload);
+
+    void deliverTile(quint32 x, quint32 y, quint8 z, const QImage& tile);
+
+    QSharedPointer<MapTileSource> _localSource;
+
+    QLocalSocket * _socket;
+    QByteArray _received;
+
+    //Attached when the daemon says hello
+    QSharedMemory * _sharedMemory;
+    int _slotCount;
+    int _slotBytes;
+
+    //When we last failed to reach the daemon, in msecs since the epoch
+    qint64 _lastConnectFailure;
+
+    //cacheIDs waiting for a connection to the daemon
+    QList<QString> _unsent;
+
+    //cacheIDs we asked the daemon for, and when
+    QHash<QString, qint64> _requested;
+
+    //cacheIDs the local source is fetching for us
+    QSet<QString> _localRequests;
+
+    QTimer * _timeoutTimer;
+};
+
+#endif // DAEMONTILESOURCE_H
@@ -1,12 +1,15 @@
 #include "OSMTileSource.h"
 
 #include "guts/MapGraphicsNetwork.h"
+#include "guts/MapGraphicsNetworkReply.h"
 
 #include <cmath>
 #include <QPainter>
 #include <QStringBuilder>
 #include <QtDebug>
 #include <QNetworkReply>
+#include <QTimer>
+#include <algorithm>
 
 #include <QRegularExpression>
 
@@ -14,15 +17,69 @@ const qreal PI = 3.14159265358979323846;
 const qreal deg2rad = PI / 180.0;
 const qreal rad2deg = 180.0 / PI;
 
+const QString DEFAULT_OSM_URL_TEMPLATE = "https://{s}.tile.openstreetmap.org/{z}/{x}/{y}.png";
+
+//QNetworkAccessManager's own limit for HTTP/1.1 connections per host
+const int DEFAULT_MAX_CONNECTIONS_PER_HOST = 6;
+
+//Matches the concurrent stream limit most HTTP/2 servers advertise
+const int DEFAULT_MAX_STREAMS_PER_HOST = 100;
+
+const qreal DEFAULT_HEDGE_PERCENTILE = 0.95;
+const qreal DEFAULT_MAX_HEDGE_FRACTION = 0.05;
+
+//Hedged requests can be saved up to this many for bursts of slow responses
+const qreal MAX_HEDGE_TOKENS = 10.0;
+
+//How many latencies we remember per mirror, and how many we need before trusting the percentile
+const int LATENCY_HISTORY_SIZE = 128;
+const int MIN_LATENCY_SAMPLES = 16;
+
+//Hedge delay used until we know a mirror, and the shortest one we'll ever use
+const qint64 DEFAULT_HEDGE_DELAY_MSECS = 1000;
+const qint64 MIN_HEDGE_DELAY_MSECS = 50;
+
+//A mirror that fails is avoided for this long
+const qint64 MIRROR_FAILURE_BACKOFF_MSECS = 30000;
+
 OSMTileSource::OSMTileSource(OSMTileType tileType) :
-    MapTileSource(), _tileType(tileType)
+    MapTileSource(), _tileType(tileType), _maxConnectionsPerHost(DEFAULT_MAX_CONNECTIONS_PER_HOST),
+    _keepAlive(true), _http2Mode(Http1Only), _maxStreamsPerHost(DEFAULT_MAX_STREAMS_PER_HOST),
+    _hedgePercentile(DEFAULT_HEDGE_PERCENTILE), _maxHedgeFraction(DEFAULT_MAX_HEDGE_FRACTION), _hedgeTokens(1.0)
 {
     this->setCacheMode(MapTileSource::DiskAndMemCaching);
+
+    _mirrorStats.resize(1);
+    _mirrorStats[0].nextLatency = 0;
+    _mirrorStats[0].failedUntil = 0;
+    _latencyClock.start();
+
+    //The timer is our child, so it moves to our thread with us
+    _hedgeTimer = new QTimer(this);
+    _hedgeTimer->setSingleShot(true);
+    connect(_hedgeTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(sendHedgedRequests()));
+
+    //Figure out which servers to request from based on our desired tile type
+    if (_tileType == OSMTiles)
+    {
+        _urlTemplate = DEFAULT_OSM_URL_TEMPLATE;
+        _subdomains << "a" << "b" << "c";
+    }
 }
 
 OSMTileSource::~OSMTileSource()
 {
     qDebug() << this << this->name() << "Destructing";
+
+    //Deleting the replies cancels the requests
+    qDeleteAll(_pendingReplies.keys());
+    _pendingReplies.clear();
+
+    //Our budget goes away with us
+    MapGraphicsNetwork::getInstance()->setRateLimit(this->budgetName(), 0.0, 0.0);
 }
 
 QPointF OSMTileSource::ll2qgs(const QPointF &ll, quint8 zoomLevel) const
@@ -89,52 +146,169 @@ QString OSMTileSource::tileFileExtension() const
         return "jpg";
 }
 
-//protected
-void OSMTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
+QString OSMTileSource::urlTemplate() const
 {
-    MapGraphicsNetwork * network = MapGraphicsNetwork::getInstance();
+    return _urlTemplate;
+}
 
-    QString host;
-    QString url;
+void OSMTileSource::setUrlTemplate(const QString &urlTemplate)
+{
+    _urlTemplate = urlTemplate;
 
-    //Figure out which server to request from based on our desired tile type
-    if (_tileType == OSMTiles)
+    //What we knew about the old server doesn't apply to the new one
+    _mirrorStats[0].latencies.clear();
+    _mirrorStats[0].nextLatency = 0;
+    _mirrorStats[0].failedUntil = 0;
+}
+
+QStringList OSMTileSource::subdomains() const
+{
+    return _subdomains;
+}
+
+void OSMTileSource::setSubdomains(const QStringList &subdomains)
+{
+    _subdomains = subdomains;
+}
+
+QStringList OSMTileSource::mirrorUrlTemplates() const
+{
+    return _mirrorTemplates;
+}
+
+void OSMTileSource::setMirrorUrlTemplates(const QStringList &mirrorTemplates)
+{
+    _mirrorTemplates = mirrorTemplates;
+
+    //Keep the stats of the main server and start over for the mirrors
+    _mirrorStats.resize(1);
+    for (int i = 0; i < _mirrorTemplates.size(); i++)
     {
-        host = "https://b.tile.openstreetmap.org";
-        url = "/%1/%2/%3.png";
+        MirrorStats stats;
+        stats.nextLatency = 0;
+        stats.failedUntil = 0;
+        _mirrorStats.append(stats);
     }
+}
+
+qreal OSMTileSource::hedgePercentile() const
+{
+    return _hedgePercentile;
+}
+
+void OSMTileSource::setHedgePercentile(qreal percentile)
+{
+    _hedgePercentile = qBound<qreal>(0.0, percentile, 1.0);
+}
+
+qreal OSMTileSource::maxHedgeFraction() const
+{
+    return _maxHedgeFraction;
+}
+
+void OSMTileSource::setMaxHedgeFraction(qreal fraction)
+{
+    _maxHedgeFraction = qBound<qreal>(0.0, fraction, 1.0);
+}
+
+QString OSMTileSource::metatileUrlTemplate() const
+{
+    return _metatileTemplate;
+}
+
+void OSMTileSource::setMetatileUrlTemplate(const QString &urlTemplate, int size)
+{
+    _metatileTemplate = urlTemplate;
+    this->setMetatileSize(urlTemplate.isEmpty() ? 0 : size);
+}
+
+int OSMTileSource::maxConnectionsPerHost() const
+{
+    return _maxConnectionsPerHost;
+}
+
+void OSMTileSource::setMaxConnectionsPerHost(int maxConnections)
+{
+    _maxConnectionsPerHost = qMax<int>(1, maxConnections);
+}
 
+bool OSMTileSource::keepAlive() const
+{
+    return _keepAlive;
+}
+
+void OSMTileSource::setKeepAlive(bool keepAlive)
+{
+    _keepAlive = keepAlive;
+}
+
+OSMTileSource::Http2Mode OSMTileSource::http2Mode() const
+{
+    return _http2Mode;
+}
+
+void OSMTileSource::setHttp2Mode(OSMTileSource::Http2Mode mode)
+{
+    _http2Mode = mode;
+    _http1Hosts.clear();
+}
+
+int OSMTileSource::maxStreamsPerHost() const
+{
+    return _maxStreamsPerHost;
+}
+
+void OSMTileSource::setMaxStreamsPerHost(int maxStreams)
+{
+    _maxStreamsPerHost = qMax<int>(1, maxStreams);
+}
+
+void OSMTileSource::setRateLimit(qreal requestsPerSecond, qreal bytesPerSecond)
+{
+    MapGraphicsNetwork::getInstance()->setRateLimit(this->budgetName(), requestsPerSecond, bytesPerSecond);
+}
+
+qreal OSMTileSource::rateLimitUtilization() const
+{
+    return MapGraphicsNetwork::getInstance()->utilization(this->budgetName());
+}
+
+//protected
+void OSMTileSource::fetchTile(quint32 x, quint32 y, quint8 z)
+{
     //Use the unique cacheID to see if this tile has already been requested
     const QString cacheID = this->createCacheID(x,y,z);
     if (_pendingRequests.contains(cacheID))
         return;
     _pendingRequests.insert(cacheID);
 
-    //Build the request
-    const QString fetchURL = url.arg(QString::number(z),
-                                     QString::number(x),
-                                     QString::number(y));
-    QNetworkRequest request(QUrl(host + fetchURL));
-
-    //Send the request and setupd a signal to ensure we're notified when it finishes
-    QNetworkReply * reply = network->get(request);
-    _pendingReplies.insert(reply,cacheID);
+    this->requestFromMirror(cacheID, x, y, z, this->primaryMirror(), 0);
+}
 
-    connect(reply,
-            SIGNAL(finished()),
-            this,
-            SLOT(handleNetworkRequestFinished()));
+//protected
+void OSMTileSource::fetchMetatile(quint32 x, quint32 y, quint8 z, int size)
+{
+    Q_UNUSED(size)
+
+    //MapTileSource makes sure a metatile isn't requested twice
+    TileRequest tileRequest;
+    tileRequest.cacheID = this->createCacheID(x,y,z);
+    tileRequest.url = this->metatileUrl(x,y,z);
+    tileRequest.mirror = 0;
+    tileRequest.attempt = 0;
+    tileRequest.metatile = true;
+    this->queueRequest(tileRequest);
 }
 
 //private slot
 void OSMTileSource::handleNetworkRequestFinished()
 {
     QObject * sender = QObject::sender();
-    QNetworkReply * reply = qobject_cast<QNetworkReply *>(sender);
+    MapGraphicsNetworkReply * reply = qobject_cast<MapGraphicsNetworkReply *>(sender);
 
     if (reply == 0)
     {
-        qWarning() << "QNetworkReply cast failure";
+        qWarning() << "MapGraphicsNetworkReply cast failure";
         return;
     }
 
@@ -146,39 +320,96 @@ void OSMTileSource::handleNetworkRequestFinished()
 
     if (!_pendingReplies.contains(reply))
     {
-        qWarning() << "Unknown QNetworkReply";
+        qWarning() << "Unknown MapGraphicsNetworkReply";
         return;
     }
 
     //get the cacheID
-    const QString cacheID = _pendingReplies.take(reply);
-    _pendingRequests.remove(cacheID);
+    const PendingReply pending = _pendingReplies.take(reply);
+    const QString cacheID = pending.cacheID;
 
-    //If there was a network error, ignore the reply
-    if (reply->error() != QNetworkReply::NoError)
-    {
-        qDebug() << "Network Error:" << reply->errorString();
-        return;
-    }
+    //The connection is free for the next request to the same host
+    const QString host = OSMTileSource::hostKey(reply->request().url());
+    _activeRequestsPerHost[host]--;
+
+    //If we hoped for HTTP/2 and didn't get it, treat the host like any HTTP/1.1 server from now on
+    if (_http2Mode != Http1Only && reply->error() == QNetworkReply::NoError && !reply->http2WasUsed())
+        _http1Hosts.insert(host);
+
+    //If the tile was hedged, the other request may still come through
+    MapGraphicsNetworkReply * rival = this->rivalReply(reply, cacheID);
 
     //Convert the cacheID back into x,y,z tile coordinates
     quint32 x,y,z;
     if (!MapTileSource::cacheID2xyz(cacheID,&x,&y,&z))
     {
         qWarning() << "Failed to convert cacheID" << cacheID << "back to xyz";
+        _pendingRequests.remove(cacheID);
+        this->dispatchQueuedRequests(host);
         return;
     }
 
-    QByteArray bytes = reply->readAll();
-    QImage * image = new QImage();
-
-    if (!image->loadFromData(bytes))
+    //If there was a network error, ignore the reply
+    if (reply->error() != QNetworkReply::NoError)
     {
-        delete image;
-        qWarning() << "Failed to make QImage from network bytes";
+        qDebug() << "Network Error:" << reply->errorString();
+
+        //Metatiles have nowhere else to go. Let the next request for one of their tiles try again.
+        if (pending.metatile)
+        {
+            this->abandonMetatile(x,y,z);
+            this->dispatchQueuedRequests(host);
+            return;
+        }
+
+        /*
+          Connection trouble and 5xx responses mean the server is unwell, so avoid it for a while. Either
+          way, fail over to the next server if nobody else is fetching the tile.
+        */
+        if (reply->error() != QNetworkReply::OperationCanceledError)
+        {
+            const int error = reply->error();
+            if (error < QNetworkReply::ContentAccessDenied || error >= QNetworkReply::InternalServerError)
+                _mirrorStats[pending.mirror].failedUntil = _latencyClock.elapsed() + MIRROR_FAILURE_BACKOFF_MSECS;
+            if (rival == 0 && pending.attempt + 1 < this->mirrorCount())
+            {
+                this->dispatchQueuedRequests(host);
+                this->requestFromMirror(cacheID, x, y, z,
+                                        (pending.mirror + 1) % this->mirrorCount(),
+                                        pending.attempt + 1);
+                return;
+            }
+        }
+
+        //Nobody else is fetching the tile, so give up on it until it's requested again
+        if (rival == 0)
+        {
+            _pendingRequests.remove(cacheID);
+            this->abandonTile(x,y,z);
+        }
+        this->dispatchQueuedRequests(host);
         return;
     }
 
+    //We have a winner. Learn from its latency (metatiles would skew it) and call off the other request.
+    if (!pending.metatile)
+        this->recordLatency(pending.mirror, _latencyClock.elapsed() - pending.sent);
+    if (rival != 0)
+    {
+        _pendingReplies.remove(rival);
+        const QString rivalHost = OSMTileSource::hostKey(rival->request().url());
+        _activeRequestsPerHost[rivalHost]--;
+
+        //Deleting the reply cancels the request
+        delete rival;
+        rival = 0;
+        this->dispatchQueuedRequests(rivalHost);
+    }
+    _pendingRequests.remove(cacheID);
+    this->dispatchQueuedRequests(host);
+
+    QByteArray bytes = reply->readAll();
+
     //Figure out how long the tile should be cached
     QDateTime expireTime;
     if (reply->hasRawHeader("Cache-Control"))
@@ -211,6 +442,317 @@ void OSMTileSource::handleNetworkRequestFinished()
         }
     }
 
-    //Notify client of tile retrieval
-    this->prepareNewlyReceivedTile(x,y,z, image, expireTime);
+    //Metatiles are split up on a worker thread
+    if (pending.metatile)
+    {
+        this->prepareNewlyReceivedMetatile(x,y,z, bytes, expireTime);
+        return;
+    }
+
+    //Decoded on a worker thread, then cached and handed to the client
+    this->prepareNewlyReceivedTileData(x,y,z, bytes, expireTime);
+}
+
+//private slot
+void OSMTileSource::sendHedgedRequests()
+{
+    const qint64 now = _latencyClock.elapsed();
+
+    //Find the requests that have waited longer than their server usually takes
+    QList<MapGraphicsNetworkReply *> overdue;
+    qint64 nextDeadline = -1;
+    QHash<MapGraphicsNetworkReply *, PendingReply>::const_iterator iter;
+    for (iter = _pendingReplies.constBegin(); iter != _pendingReplies.constEnd(); iter++)
+    {
+        const PendingReply& pending = iter.value();
+        if (pending.hedge || pending.hedged || pending.metatile)
+            continue;
+
+        const qint64 deadline = pending.sent + this->hedgeDelay(pending.mirror);
+        if (deadline <= now)
+            overdue.append(iter.key());
+        else if (nextDeadline < 0 || deadline < nextDeadline)
+            nextDeadline = deadline;
+    }
+
+    foreach(MapGraphicsNetworkReply * reply, overdue)
+    {
+        //Each request gets at most one chance to be hedged
+        _pendingReplies[reply].hedged = true;
+        const PendingReply pending = _pendingReplies.value(reply);
+
+        if (_hedgeTokens < 1.0)
+            continue;
+
+        const int mirror = this->hedgeMirror(pending.mirror);
+        if (mirror < 0)
+            continue;
+
+        quint32 x,y,z;
+        if (!MapTileSource::cacheID2xyz(pending.cacheID,&x,&y,&z))
+            continue;
+
+        //Hedges are only worth it if they can go out right away
+        const QUrl url = this->tileUrl(x,y,z,mirror);
+        const QString host = OSMTileSource::hostKey(url);
+        if (_activeRequestsPerHost.value(host) >= this->requestLimit(host))
+            continue;
+
+        TileRequest tileRequest;
+        tileRequest.cacheID = pending.cacheID;
+        tileRequest.url = url;
+        tileRequest.mirror = mirror;
+        tileRequest.attempt = pending.attempt;
+        tileRequest.metatile = false;
+
+        _hedgeTokens -= 1.0;
+        this->sendRequest(tileRequest, true);
+    }
+
+    if (nextDeadline >= 0)
+        this->scheduleHedgeCheck(nextDeadline - now);
+}
+
+//private
+QUrl OSMTileSource::tileUrl(quint32 x, quint32 y, quint8 z, int mirror) const
+{
+    const QString url = (mirror > 0 && mirror <= _mirrorTemplates.size()) ? _mirrorTemplates.at(mirror - 1) : _urlTemplate;
+    return this->fillUrlTemplate(url, x, y, z);
+}
+
+//private
+QUrl OSMTileSource::metatileUrl(quint32 x, quint32 y, quint8 z) const
+{
+    QString url = _metatileTemplate;
+    const int size = qMax<int>(1, this->metatileSize());
+    url.replace("{mx}", QString::number(x / size));
+    url.replace("{my}", QString::number(y / size));
+    return this->fillUrlTemplate(url, x, y, z);
+}
+
+//private
+QUrl OSMTileSource::fillUrlTemplate(QString url, quint32 x, quint32 y, quint8 z) const
+{
+    url.replace("{z}", QString::number(z));
+    url.replace("{x}", QString::number(x));
+    url.replace("{y}", QString::number(y));
+
+    /*
+      Pick the subdomain from the tile coordinates so a tile always comes from the same host.
+      With HTTP/2 we'd rather multiplex everything over a single connection, so we stick to one host.
+    */
+    if (!_subdomains.isEmpty())
+    {
+        const int index = (_http2Mode == Http1Only) ? (x + y) % _subdomains.size() : 0;
+        url.replace("{s}", _subdomains.at(index));
+    }
+
+    return QUrl(url);
+}
+
+//private static
+QString OSMTileSource::hostKey(const QUrl &url)
+{
+    return url.host() % ":" % QString::number(url.port(url.scheme() == "https" ? 443 : 80));
+}
+
+//private
+int OSMTileSource::mirrorCount() const
+{
+    return 1 + _mirrorTemplates.size();
+}
+
+//private
+int OSMTileSource::primaryMirror() const
+{
+    const qint64 now = _latencyClock.elapsed();
+    for (int i = 0; i < _mirrorStats.size(); i++)
+    {
+        if (_mirrorStats.at(i).failedUntil <= now)
+            return i;
+    }
+
+    //Everybody is failing. Keep trying the main server.
+    return 0;
+}
+
+//private
+int OSMTileSource::hedgeMirror(int mirror) const
+{
+    const qint64 now = _latencyClock.elapsed();
+    for (int i = 1; i < this->mirrorCount(); i++)
+    {
+        const int candidate = (mirror + i) % this->mirrorCount();
+        if (_mirrorStats.at(candidate).failedUntil <= now)
+            return candidate;
+    }
+    return -1;
+}
+
+//private
+qint64 OSMTileSource::hedgeDelay(int mirror) const
+{
+    const QVector<qint64>& latencies = _mirrorStats.at(mirror).latencies;
+    if (latencies.size() < MIN_LATENCY_SAMPLES)
+        return DEFAULT_HEDGE_DELAY_MSECS;
+
+    QVector<qint64> sorted = latencies;
+    std::sort(sorted.begin(), sorted.end());
+    const int index = qMin<int>(sorted.size() - 1, (int)(_hedgePercentile * sorted.size()));
+    return qMax<qint64>(MIN_HEDGE_DELAY_MSECS, sorted.at(index));
+}
+
+//private
+void OSMTileSource::recordLatency(int mirror, qint64 msecs)
+{
+    MirrorStats& stats = _mirrorStats[mirror];
+    if (stats.latencies.size() < LATENCY_HISTORY_SIZE)
+        stats.latencies.append(msecs);
+    else
+        stats.latencies[stats.nextLatency] = msecs;
+    stats.nextLatency = (stats.nextLatency + 1) % LATENCY_HISTORY_SIZE;
+
+    //A server that answers is healthy again
+    stats.failedUntil = 0;
+}
+
+//private
+MapGraphicsNetworkReply *OSMTileSource::rivalReply(MapGraphicsNetworkReply *reply, const QString &cacheID) const
+{
+    QHash<MapGraphicsNetworkReply *, PendingReply>::const_iterator iter;
+    for (iter = _pendingReplies.constBegin(); iter != _pendingReplies.constEnd(); iter++)
+    {
+        if (iter.key() != reply && iter.value().cacheID == cacheID)
+            return iter.key();
+    }
+    return 0;
+}
+
+//private
+void OSMTileSource::requestFromMirror(const QString &cacheID, quint32 x, quint32 y, quint8 z, int mirror, int attempt)
+{
+    TileRequest tileRequest;
+    tileRequest.cacheID = cacheID;
+    tileRequest.url = this->tileUrl(x,y,z,mirror);
+    tileRequest.mirror = mirror;
+    tileRequest.attempt = attempt;
+    tileRequest.metatile = false;
+    this->queueRequest(tileRequest);
+}
+
+//private
+void OSMTileSource::queueRequest(const TileRequest &tileRequest)
+{
+    const QString host = OSMTileSource::hostKey(tileRequest.url);
+
+    //Wait for a free connection to the host if we have to
+    if (_activeRequestsPerHost.value(host) >= this->requestLimit(host))
+    {
+        _queuedRequests[host].append(tileRequest);
+        return;
+    }
+
+    this->sendRequest(tileRequest);
+}
+
+//private
+void OSMTileSource::scheduleHedgeCheck(qint64 msecs)
+{
+    msecs = qMax<qint64>(1, msecs);
+    if (!_hedgeTimer->isActive() || _hedgeTimer->remainingTime() > msecs)
+        _hedgeTimer->start((int)msecs);
+}
+
+//private
+void OSMTileSource::sendRequest(const TileRequest &tileRequest, bool hedge)
+{
+    MapGraphicsNetwork * network = MapGraphicsNetwork::getInstance();
+
+    //Build the request
+    QNetworkRequest request(tileRequest.url);
+    if (!_keepAlive)
+        request.setRawHeader("Connection", "close");
+    request.setAttribute(QNetworkRequest::Http2AllowedAttribute, _http2Mode != Http1Only);
+    request.setAttribute(QNetworkRequest::Http2DirectAttribute, _http2Mode == Http2PriorKnowledge);
+
+    //Let the network throttle us and, on metered links, start coarse tiles first
+    quint32 x,y,z;
+    request.setAttribute(MapGraphicsNetwork::BudgetAttribute, this->budgetName());
+    if (MapTileSource::cacheID2xyz(tileRequest.cacheID,&x,&y,&z))
+        request.setAttribute(MapGraphicsNetwork::PriorityAttribute, (int)z);
+
+    //Send the request and setupd a signal to ensure we're notified when it finishes
+    MapGraphicsNetworkReply * reply = network->get(request);
+    PendingReply pending;
+    pending.cacheID = tileRequest.cacheID;
+    pending.mirror = tileRequest.mirror;
+    pending.sent = _latencyClock.elapsed();
+    pending.metatile = tileRequest.metatile;
+    pending.attempt = tileRequest.attempt;
+    pending.hedge = hedge;
+    pending.hedged = false;
+    _pendingReplies.insert(reply,pending);
+    _activeRequestsPerHost[OSMTileSource::hostKey(tileRequest.url)]++;
+
+    //With somewhere else to go, keep an eye on how long the server takes
+    if (!hedge && !tileRequest.metatile && this->mirrorCount() > 1)
+    {
+        _hedgeTokens = qMin<qreal>(MAX_HEDGE_TOKENS, _hedgeTokens + _maxHedgeFraction);
+        this->scheduleHedgeCheck(this->hedgeDelay(tileRequest.mirror));
+    }
+
+    connect(reply,
+            SIGNAL(finished()),
+            this,
+            SLOT(handleNetworkRequestFinished()));
+}
+
+//private
+void OSMTileSource::dispatchQueuedRequests(const QString &host)
+{
+    if (!_queuedRequests.contains(host))
+        return;
+
+    const bool metered = (MapGraphicsNetwork::getInstance()->schedulingProfile() == MapGraphicsNetwork::MeteredLink);
+
+    QList<TileRequest> & queue = _queuedRequests[host];
+    while (!queue.isEmpty() && _activeRequestsPerHost.value(host) < this->requestLimit(host))
+    {
+        //Newest first: the most recently requested tiles are most likely still on screen
+        int index = queue.size() - 1;
+
+        //On a metered link, coarser tiles cover more of the screen per byte so they go first
+        if (metered)
+        {
+            quint32 bestZ = 0xffffffff;
+            for (int i = queue.size() - 1; i >= 0; i--)
+            {
+                quint32 x,y,z;
+                if (MapTileSource::cacheID2xyz(queue.at(i).cacheID,&x,&y,&z) && z < bestZ)
+                {
+                    bestZ = z;
+                    index = i;
+                }
+            }
+        }
+
+        this->sendRequest(queue.takeAt(index));
+    }
+
+    if (queue.isEmpty())
+        _queuedRequests.remove(host);
+}
+
+//private
+int OSMTileSource::requestLimit(const QString &host) const
+{
+    if (_http2Mode != Http1Only && !_http1Hosts.contains(host))
+        return _maxStreamsPerHost;
+    return _maxConnectionsPerHost;
+}
+
+//private
+QString OSMTileSource::budgetName() const
+{
+    return "OSMTileSource/" % QString::number((quintptr)this, 16);
 }
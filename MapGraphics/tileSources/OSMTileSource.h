@@ -5,9 +5,15 @@
 #include "MapGraphics_global.h"
 #include <QSet>
 #include <QHash>
+#include <QStringList>
+#include <QUrl>
+#include <QVector>
+#include <QElapsedTimer>
+
+class QTimer;
 
 //Forward declaration so that projects that import us as a library don't necessarily have to use QT += network
-class QNetworkReply;
+class MapGraphicsNetworkReply;
 
 class MAPGRAPHICSSHARED_EXPORT OSMTileSource : public MapTileSource
 {
@@ -18,6 +24,18 @@ public:
         OSMTiles
     };
 
+    /*!
+     \brief Which HTTP versions to use. Http2WithFallback negotiates HTTP/2 over TLS and falls back to
+     HTTP/1.1 for servers that don't support it. Http2PriorKnowledge speaks HTTP/2 right away (also over
+     cleartext) and has no fallback.
+    */
+    enum Http2Mode
+    {
+        Http1Only,
+        Http2WithFallback,
+        Http2PriorKnowledge
+    };
+
 public:
     explicit OSMTileSource(OSMTileSource::OSMTileType tileType = OSMTiles);
     virtual ~OSMTileSource();
@@ -38,19 +56,286 @@ public:
 
     virtual QString tileFileExtension() const;
 
+    /**
+     * @brief Returns the URL template tiles are fetched from. See setUrlTemplate().
+     *
+     * @return QString
+     */
+    QString urlTemplate() const;
+
+    /**
+     * @brief Sets the URL template tiles are fetched from. {z}, {x} and {y} are replaced with the tile's
+     * coordinates and {s} with one of subdomains(), chosen per tile so the load is spread over several
+     * hosts. {s} doesn't have to be part of the host name: "http://127.0.0.1:{s}/{z}/{x}/{y}.png" with
+     * subdomains 8001, 8002 and 8003 spreads the load over three local ports.
+     *
+     * @param urlTemplate
+     */
+    void setUrlTemplate(const QString& urlTemplate);
+
+    QStringList subdomains() const;
+
+    /**
+     * @brief Sets the values {s} in the URL template is replaced with.
+     *
+     * @param subdomains
+     */
+    void setSubdomains(const QStringList& subdomains);
+
+    QStringList mirrorUrlTemplates() const;
+
+    /**
+     * @brief Sets URL templates of other servers with the same tiles, in the same format as setUrlTemplate().
+     * Tiles are fetched from the first server that hasn't failed recently. A tile that takes longer than
+     * hedgePercentile() of its server's recent latencies gets one more request to another server, and
+     * whichever answers first wins. A failed request is retried on the next server.
+     *
+     * @param mirrorTemplates
+     */
+    void setMirrorUrlTemplates(const QStringList& mirrorTemplates);
+
+    qreal hedgePercentile() const;
+
+    /**
+     * @brief Sets which percentile of a server's recent latencies we wait for before sending a hedged
+     * request to another server. Defaults to 0.95.
+     *
+     * @param percentile between 0.0 and 1.0
+     */
+    void setHedgePercentile(qreal percentile);
+
+    qreal maxHedgeFraction() const;
+
+    /**
+     * @brief Sets the largest fraction of requests that may be hedged, so that a slow server doesn't
+     * double our load. Defaults to 0.05.
+     *
+     * @param fraction between 0.0 and 1.0
+     */
+    void setMaxHedgeFraction(qreal fraction);
+
+    QString metatileUrlTemplate() const;
+
+    /**
+     * @brief Fetches tiles in size x size metatiles from the given URL template instead of one by one,
+     * as served by mod_tile/renderd style servers. {z} is replaced with the zoom level, {x} and {y} with
+     * the coordinates of the metatile's top-left tile, {mx} and {my} with the metatile's own coordinates
+     * (the tile coordinates divided by size) and {s} with one of subdomains(). The response can be a
+     * mod_tile META container or a single image of the whole metatile. Mirrors and hedging only apply to
+     * single tiles. An empty template goes back to fetching single tiles.
+     *
+     * @param urlTemplate
+     * @param size
+     */
+    void setMetatileUrlTemplate(const QString& urlTemplate, int size = 8);
+
+    int maxConnectionsPerHost() const;
+
+    /**
+     * @brief Sets how many requests may be in flight to a single host (and port) at once. Requests beyond
+     * that wait in a queue, newest first. Note that QNetworkAccessManager never opens more than six HTTP/1.1
+     * connections to one host and port, so values above six only help by keeping its pipeline full.
+     *
+     * @param maxConnections
+     */
+    void setMaxConnectionsPerHost(int maxConnections);
+
+    bool keepAlive() const;
+
+    /**
+     * @brief Sets whether connections to the tile servers should be kept open between requests.
+     * Enabled by default.
+     *
+     * @param keepAlive
+     */
+    void setKeepAlive(bool keepAlive);
+
+    OSMTileSource::Http2Mode http2Mode() const;
+
+    /**
+     * @brief Sets whether tiles are fetched over HTTP/2. Defaults to Http1Only. When HTTP/2 is used, all
+     * requests go to the first subdomain so they can be multiplexed over a single connection, and up to
+     * maxStreamsPerHost() requests are kept in flight per host instead of maxConnectionsPerHost(). Hosts
+     * that turn out to answer over HTTP/1.1 go back to maxConnectionsPerHost().
+     *
+     * @param mode
+     */
+    void setHttp2Mode(OSMTileSource::Http2Mode mode);
+
+    int maxStreamsPerHost() const;
+
+    /**
+     * @brief Sets how many requests may be in flight to a single HTTP/2 host at once
+     *
+     * @param maxStreams
+     */
+    void setMaxStreamsPerHost(int maxStreams);
+
+    /**
+     * @brief Throttles this source's requests with a token bucket in MapGraphicsNetwork, in addition to
+     * any global limit. A rate of 0 means unlimited. See MapGraphicsNetwork::setRateLimit().
+     *
+     * @param requestsPerSecond
+     * @param bytesPerSecond
+     */
+    void setRateLimit(qreal requestsPerSecond, qreal bytesPerSecond);
+
+    /**
+     * @brief Returns how much of this source's rate limit was used over the last second, from 0.0 to 1.0
+     *
+     * @return qreal
+     */
+    qreal rateLimitUtilization() const;
+
 protected:
     virtual void fetchTile(quint32 x,
                            quint32 y,
                            quint8 z);
 
+    virtual void fetchMetatile(quint32 x,
+                               quint32 y,
+                               quint8 z,
+                               int size);
+
 private:
+    /*!
+     \brief What we know about a request in flight
+    */
+    struct PendingReply
+    {
+        QString cacheID;
+        int mirror;
+        qint64 sent;
+        bool metatile;
+
+        //How many servers have been tried for this tile before this one
+        int attempt;
+
+        //True for the extra request sent to a second server, and for a request that already got one
+        bool hedge;
+        bool hedged;
+    };
+
+    /*!
+     \brief A request we're about to send, or that is waiting for a free connection to its host.
+     For metatiles, cacheID is that of the metatile's top-left tile.
+    */
+    struct TileRequest
+    {
+        QString cacheID;
+        QUrl url;
+        int mirror;
+        int attempt;
+        bool metatile;
+    };
+
+    /*!
+     \brief Latency history and health of one of our servers
+    */
+    struct MirrorStats
+    {
+        QVector<qint64> latencies;
+        int nextLatency;
+        qint64 failedUntil;
+    };
+
+    /*!
+     \brief Builds the URL for tile x,y,z from the URL template of the given mirror (0 is urlTemplate())
+    */
+    QUrl tileUrl(quint32 x, quint32 y, quint8 z, int mirror = 0) const;
+
+    /*!
+     \brief Builds the URL for the metatile whose top-left tile is x,y,z from the metatile URL template
+    */
+    QUrl metatileUrl(quint32 x, quint32 y, quint8 z) const;
+
+    //Fills in the parts of the URL templates that tiles and metatiles have in common
+    QUrl fillUrlTemplate(QString url, quint32 x, quint32 y, quint8 z) const;
+
+    int mirrorCount() const;
+
+    //Returns the first mirror that hasn't failed recently
+    int primaryMirror() const;
+
+    //Returns a healthy mirror other than the given one to hedge with, or -1 if there isn't one
+    int hedgeMirror(int mirror) const;
+
+    //Returns how long we wait for the given mirror before hedging
+    qint64 hedgeDelay(int mirror) const;
+
+    void recordLatency(int mirror, qint64 msecs);
+
+    //Returns another reply in flight for the same tile, or 0
+    MapGraphicsNetworkReply * rivalReply(MapGraphicsNetworkReply * reply, const QString& cacheID) const;
+
+    //Sends the request for the tile to the given mirror, or queues it if the host is busy
+    void requestFromMirror(const QString& cacheID, quint32 x, quint32 y, quint8 z, int mirror, int attempt);
+
+    //Sends the request, or queues it if the host is busy
+    void queueRequest(const TileRequest& tileRequest);
+
+    void scheduleHedgeCheck(qint64 msecs);
+
+    /*!
+     \brief Returns the key we use to count connections to the host serving url
+    */
+    static QString hostKey(const QUrl& url);
+
+    /*!
+     \brief Sends the request. A hedge is an extra request for a tile that is already being fetched.
+    */
+    void sendRequest(const TileRequest& tileRequest, bool hedge = false);
+
+    /*!
+     \brief Sends queued requests to the given host while it has free connections
+    */
+    void dispatchQueuedRequests(const QString& host);
+
+    /*!
+     \brief Returns how many requests may be in flight to the given host
+    */
+    int requestLimit(const QString& host) const;
+
+    /*!
+     \brief Returns the name of the MapGraphicsNetwork budget our requests count against
+    */
+    QString budgetName() const;
+
     OSMTileSource::OSMTileType _tileType;
 
+    QString _urlTemplate;
+    QStringList _subdomains;
+    int _maxConnectionsPerHost;
+    bool _keepAlive;
+    OSMTileSource::Http2Mode _http2Mode;
+    int _maxStreamsPerHost;
+
+    //Host keys of servers that answered over HTTP/1.1 even though we allowed HTTP/2
+    QSet<QString> _http1Hosts;
+
+    //Requests in flight per host key
+    QHash<QString, int> _activeRequestsPerHost;
+
+    //Requests waiting for a free connection per host key, oldest first
+    QHash<QString, QList<TileRequest> > _queuedRequests;
+
     //Set used to ensure a tile with a certain cacheID isn't requested twice
     QSet<QString> _pendingRequests;
 
-    //Hash used to keep track of what cacheID goes with what reply
-    QHash<QNetworkReply *, QString> _pendingReplies;
+    //Hash used to keep track of what cacheID (and mirror) goes with what reply
+    QHash<MapGraphicsNetworkReply *, PendingReply> _pendingReplies;
+
+    QStringList _mirrorTemplates;
+    QString _metatileTemplate;
+    QVector<MirrorStats> _mirrorStats;
+    qreal _hedgePercentile;
+    qreal _maxHedgeFraction;
+
+    //Hedged requests we may still send. Grows by _maxHedgeFraction per request.
+    qreal _hedgeTokens;
+
+    QElapsedTimer _latencyClock;
+    QTimer * _hedgeTimer;
     
 signals:
     
@@ -58,6 +343,7 @@ public slots:
 
 private slots:
     void handleNetworkRequestFinished();
+    void sendHedgedRequests();
     
 };
 
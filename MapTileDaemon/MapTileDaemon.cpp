@@ -0,0 +1,320 @@
+#include "MapTileDaemon.h"
+
+#include "guts/MapGraphicsExecutor.h"
+#include "guts/MapTileDaemonProtocol.h"
+
+#include <QDataStream>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QSharedMemory>
+#include <QtDebug>
+
+//How long we wait to find out whether another daemon is already answering on our server name
+const int EXISTING_DAEMON_CHECK_MSECS = 500;
+
+MapTileDaemon::MapTileDaemon(int slotCount, int slotBytes, QObject *parent) :
+    QObject(parent), _slotCount(qMax<int>(1, slotCount)), _slotBytes(qMax<int>(1, slotBytes)), _useCounter(0)
+{
+    _server = new QLocalServer(this);
+    connect(_server,
+            SIGNAL(newConnection()),
+            this,
+            SLOT(handleNewConnection()));
+
+    _sharedMemory = new QSharedMemory(MapTileDaemonProtocol::sharedMemoryKey(), this);
+
+    _slotKeys.resize(_slotCount);
+    _slotGenerations.fill(0, _slotCount);
+    _slotLastUsed.fill(0, _slotCount);
+}
+
+MapTileDaemon::~MapTileDaemon()
+{
+    foreach(QLocalSocket * client, _buffers.keys())
+        client->disconnect(this);
+    _server->close();
+    _sharedMemory->detach();
+
+    //Let go of the sources and wait for them to be deleted, which saves their caches
+    QList<QPointer<QObject> > sources;
+    foreach(QSharedPointer<MapTileSource> source, _sources)
+        sources.append(QPointer<QObject>(source.data()));
+    _sources.clear();
+    MapGraphicsExecutor::getInstance()->waitUntilDestroyed(sources, 10000);
+}
+
+bool MapTileDaemon::start()
+{
+    const QString name = MapTileDaemonProtocol::serverName();
+
+    //Only one daemon per user
+    QLocalSocket probe;
+    probe.connectToServer(name);
+    if (probe.waitForConnected(EXISTING_DAEMON_CHECK_MSECS))
+    {
+        qWarning() << "A tile daemon is already running as" << name;
+        return false;
+    }
+
+    //Nobody answered, so whatever is left of a previous daemon that crashed is ours to clean up
+    QLocalServer::removeServer(name);
+    const int bytes = MapTileDaemonProtocol::segmentBytes(_slotCount, _slotBytes);
+    if (!_sharedMemory->create(bytes))
+    {
+        if (_sharedMemory->error() == QSharedMemory::AlreadyExists && _sharedMemory->attach())
+            _sharedMemory->detach();
+        if (!_sharedMemory->create(bytes))
+        {
+            qWarning() << "Failed to create tile shared memory:" << _sharedMemory->errorString();
+            return false;
+        }
+    }
+
+    //Only our own user's applications get to talk to us
+    _server->setSocketOptions(QLocalServer::UserAccessOption);
+    if (!_server->listen(name))
+    {
+        qWarning() << "Failed to listen as" << name << ":" << _server->errorString();
+        return false;
+    }
+
+    qDebug() << "Tile daemon listening as" << name << "with" << _slotCount << "slots of" << _slotBytes << "bytes";
+    return true;
+}
+
+void MapTileDaemon::addSource(QSharedPointer<MapTileSource> source)
+{
+    if (source.isNull())
+        return;
+
+    //Sources share the executor's host threads, like CompositeTileSource's children
+    MapGraphicsExecutor::getInstance()->hostSource(source.data());
+
+    connect(source.data(),
+            SIGNAL(tileRetrieved(quint32,quint32,quint8)),
+            this,
+            SLOT(handleTileRetrieved(quint32,quint32,quint8)));
+
+    _sources.insert(source->name(), source);
+}
+
+//private slot
+void MapTileDaemon::handleNewConnection()
+{
+    while (_server->hasPendingConnections())
+    {
+        QLocalSocket * client = _server->nextPendingConnection();
+        _buffers.insert(client, QByteArray());
+        connect(client,
+                SIGNAL(readyRead()),
+                this,
+                SLOT(handleReadyRead()));
+        connect(client,
+                SIGNAL(disconnected()),
+                this,
+                SLOT(handleDisconnected()));
+
+        QByteArray payload;
+        QDataStream stream(&payload, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_15);
+        stream << (quint8)MapTileDaemonProtocol::Hello << _sharedMemory->key() << (quint32)_slotCount
+               << (quint32)_slotBytes;
+        client->write(MapTileDaemonProtocol::frame(payload));
+    }
+}
+
+//private slot
+void MapTileDaemon::handleReadyRead()
+{
+    QLocalSocket * client = qobject_cast<QLocalSocket *>(QObject::sender());
+    if (client == 0 || !_buffers.contains(client))
+        return;
+
+    QByteArray& buffer = _buffers[client];
+    buffer += client->readAll();
+
+    QList<QByteArray> messages;
+    QByteArray payload;
+    while (MapTileDaemonProtocol::takeMessage(&buffer, &payload))
+        messages.append(payload);
+
+    foreach(const QByteArray& message, messages)
+        this->handleMessage(client, message);
+}
+
+//private slot
+void MapTileDaemon::handleDisconnected()
+{
+    QLocalSocket * client = qobject_cast<QLocalSocket *>(QObject::sender());
+    if (client == 0)
+        return;
+
+    _buffers.remove(client);
+    QHash<QString, QSet<QLocalSocket *> >::iterator iter;
+    for (iter = _waiting.begin(); iter != _waiting.end(); iter++)
+        iter.value().remove(client);
+    client->deleteLater();
+}
+
+//private slot
+void MapTileDaemon::handleTileRetrieved(quint32 x, quint32 y, quint8 z)
+{
+    MapTileSource * source = qobject_cast<MapTileSource *>(QObject::sender());
+    if (source == 0)
+    {
+        qWarning() << "MapTileSource cast failure";
+        return;
+    }
+
+    bool provisional;
+    QImage * tile = source->getFinishedTile(x,y,z,0,&provisional);
+
+    //Clients only get real tiles from us. Provisional ones are followed by the real one.
+    if (tile != 0 && provisional)
+    {
+        delete tile;
+        return;
+    }
+
+    const QString name = source->name();
+    const QString key = MapTileDaemonProtocol::tileKey(name, x, y, z);
+    const QSet<QLocalSocket *> waiting = _waiting.take(key);
+
+    if (tile == 0)
+    {
+        foreach(QLocalSocket * client, waiting)
+            this->sendUnavailable(client, name, x, y, z);
+        return;
+    }
+
+    const int slot = this->storeTile(key, *tile);
+    foreach(QLocalSocket * client, waiting)
+    {
+        if (slot >= 0)
+            this->sendSlot(client, name, x, y, z, slot);
+        else
+            this->sendInline(client, name, x, y, z, *tile);
+    }
+    delete tile;
+}
+
+//private
+void MapTileDaemon::handleMessage(QLocalSocket *client, const QByteArray &payload)
+{
+    QDataStream stream(payload);
+    stream.setVersion(QDataStream::Qt_5_15);
+
+    quint8 type;
+    QString source;
+    quint32 x, y;
+    quint8 z;
+    stream >> type >> source >> x >> y >> z;
+    if (stream.status() != QDataStream::Ok || type != MapTileDaemonProtocol::Request)
+        return;
+
+    if (!_sources.contains(source))
+    {
+        this->sendUnavailable(client, source, x, y, z);
+        return;
+    }
+
+    //Decoded and waiting in shared memory already?
+    const QString key = MapTileDaemonProtocol::tileKey(source, x, y, z);
+    if (_slotByKey.contains(key))
+    {
+        const int slot = _slotByKey.value(key);
+        this->touchSlot(slot);
+        this->sendSlot(client, source, x, y, z, slot);
+        return;
+    }
+
+    /*
+      Get in line. We ask the source again even if others are already waiting in case an earlier
+      fetch failed; sources ignore duplicate requests.
+    */
+    _waiting[key].insert(client);
+    _sources.value(source)->requestTile(x,y,z);
+}
+
+//private
+void MapTileDaemon::sendSlot(QLocalSocket *client, const QString &source, quint32 x, quint32 y, quint8 z, int slot)
+{
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream << (quint8)MapTileDaemonProtocol::TileInSlot << source << x << y << z << (quint32)slot
+           << _slotGenerations.at(slot);
+    client->write(MapTileDaemonProtocol::frame(payload));
+}
+
+//private
+void MapTileDaemon::sendInline(QLocalSocket *client, const QString &source, quint32 x, quint32 y, quint8 z,
+                               const QImage &tile)
+{
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream << (quint8)MapTileDaemonProtocol::TileInline << source << x << y << z << tile;
+    client->write(MapTileDaemonProtocol::frame(payload));
+}
+
+//private
+void MapTileDaemon::sendUnavailable(QLocalSocket *client, const QString &source, quint32 x, quint32 y, quint8 z)
+{
+    QByteArray payload;
+    QDataStream stream(&payload, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_5_15);
+    stream << (quint8)MapTileDaemonProtocol::TileUnavailable << source << x << y << z;
+    client->write(MapTileDaemonProtocol::frame(payload));
+}
+
+//private
+int MapTileDaemon::storeTile(const QString &key, const QImage &tile)
+{
+    if (!_sharedMemory->isAttached())
+        return -1;
+
+    //Reuse the tile's own slot if it has one, otherwise the least recently used one
+    int slot = _slotByKey.value(key, -1);
+    if (slot < 0)
+    {
+        slot = 0;
+        for (int i = 1; i < _slotCount; i++)
+        {
+            if (_slotLastUsed.at(i) < _slotLastUsed.at(slot))
+                slot = i;
+        }
+    }
+
+    /*
+      The new generation makes clients that were told about the slot's old tile notice that it's gone,
+      even if they get to it after we've written the new one.
+    */
+    _sharedMemory->lock();
+    const quint32 generation = _slotGenerations.at(slot) + 1;
+    const bool stored = MapTileDaemonProtocol::writeSlot(_sharedMemory->data(), _slotBytes, slot, generation, key, tile);
+    _sharedMemory->unlock();
+
+    if (!_slotKeys.at(slot).isEmpty())
+        _slotByKey.remove(_slotKeys.at(slot));
+    _slotGenerations[slot] = generation;
+
+    if (!stored)
+    {
+        _slotKeys[slot].clear();
+        _slotLastUsed[slot] = 0;
+        return -1;
+    }
+
+    _slotKeys[slot] = key;
+    _slotByKey.insert(key, slot);
+    this->touchSlot(slot);
+    return slot;
+}
+
+//private
+void MapTileDaemon::touchSlot(int slot)
+{
+    _slotLastUsed[slot] = ++_useCounter;
+}
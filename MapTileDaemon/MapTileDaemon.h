@@ -0,0 +1,90 @@
+#ifndef MAPTILEDAEMON_H
+#define MAPTILEDAEMON_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QSet>
+#include <QSharedPointer>
+#include <QVector>
+
+#include "MapTileSource.h"
+
+class QLocalServer;
+class QLocalSocket;
+class QSharedMemory;
+
+/*!
+ \brief Serves tiles to the DaemonTileSources of every MapGraphics application of the user.
+
+ The daemon runs one tile source per name, each in its own thread, and is the only one caching their
+ tiles on disk. Decoded tiles are copied into a shared memory segment of fixed-size slots that are reused
+ least-recently-used first, so a tile that several clients want is fetched and decoded once. See
+ MapTileDaemonProtocol for what goes over the wire.
+*/
+class MapTileDaemon : public QObject
+{
+    Q_OBJECT
+public:
+    /*!
+     \param slotCount how many decoded tiles the shared memory segment holds
+     \param slotBytes how many bytes of pixels each slot holds. Bigger tiles are sent over the socket.
+    */
+    MapTileDaemon(int slotCount, int slotBytes, QObject * parent = 0);
+    virtual ~MapTileDaemon();
+
+    /*!
+     \brief Creates the shared memory segment and starts listening. Returns false if that fails, for
+     example because another daemon is already running.
+    */
+    bool start();
+
+    /*!
+     \brief Serves tiles of the source to clients asking for its name(). Moves the source to a thread
+     of its own.
+    */
+    void addSource(QSharedPointer<MapTileSource> source);
+
+private slots:
+    void handleNewConnection();
+    void handleReadyRead();
+    void handleDisconnected();
+    void handleTileRetrieved(quint32 x, quint32 y, quint8 z);
+
+private:
+    void handleMessage(QLocalSocket * client, const QByteArray& payload);
+
+    //Tells the client where to find the tile, or that there isn't one
+    void sendSlot(QLocalSocket * client, const QString& source, quint32 x, quint32 y, quint8 z, int slot);
+    void sendInline(QLocalSocket * client, const QString& source, quint32 x, quint32 y, quint8 z,
+                    const QImage& tile);
+    void sendUnavailable(QLocalSocket * client, const QString& source, quint32 x, quint32 y, quint8 z);
+
+    //Puts the tile in a slot, evicting the least recently used one if necessary. Returns the slot or -1.
+    int storeTile(const QString& key, const QImage& tile);
+
+    void touchSlot(int slot);
+
+    int _slotCount;
+    int _slotBytes;
+
+    QLocalServer * _server;
+    QSharedMemory * _sharedMemory;
+
+    QHash<QString, QSharedPointer<MapTileSource> > _sources;
+
+    //Bytes received from each client that don't make up a whole message yet
+    QHash<QLocalSocket *, QByteArray> _buffers;
+
+    //Clients waiting for each tile, by tile key
+    QHash<QString, QSet<QLocalSocket *> > _waiting;
+
+    //Which slot holds which tile
+    QHash<QString, int> _slotByKey;
+    QVector<QString> _slotKeys;
+    QVector<quint32> _slotGenerations;
+    QVector<quint64> _slotLastUsed;
+    quint64 _useCounter;
+};
+
+#endif // MAPTILEDAEMON_H
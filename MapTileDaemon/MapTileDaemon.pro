@@ -0,0 +1,32 @@
+#-------------------------------------------------
+#
+# Local tile daemon that fetches, decodes and caches tiles once for every
+# MapGraphics application of the user. Clients use DaemonTileSource.
+#
+#-------------------------------------------------
+CONFIG += c++17
+CONFIG += warn_on
+CONFIG += console
+CONFIG -= app_bundle
+
+QT       += core gui network sql
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = MapTileDaemon
+TEMPLATE = app
+
+
+SOURCES += main.cpp \
+    MapTileDaemon.cpp
+
+HEADERS  += MapTileDaemon.h
+
+DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x050F00
+
+#Linkage for MapGraphics shared library
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../MapGraphics/release/ -lMapGraphics
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../MapGraphics/debug/ -lMapGraphics
+else:unix:!symbian: LIBS += -L$$OUT_PWD/../MapGraphics/ -lMapGraphics
+
+INCLUDEPATH += $$PWD/../MapGraphics
+DEPENDPATH += $$PWD/../MapGraphics
@@ -0,0 +1,51 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QSharedPointer>
+#include <QtDebug>
+
+#include "MapTileDaemon.h"
+#include "tileSources/OSMTileSource.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("MapTileDaemon");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Fetches, decodes and caches map tiles once for every MapGraphics "
+                                     "application of the user. Applications use it through DaemonTileSource.");
+    parser.addHelpOption();
+
+    QCommandLineOption slotsOption("slots", "How many decoded tiles to keep in shared memory.", "count", "512");
+    QCommandLineOption tileSizeOption("max-tile-size", "Largest tile (in pixels along an edge) that fits in a slot.",
+                                      "pixels", "256");
+    QCommandLineOption osmTemplateOption("osm-url-template", "URL template the OpenStreetMap source fetches from.",
+                                         "template");
+    parser.addOption(slotsOption);
+    parser.addOption(tileSizeOption);
+    parser.addOption(osmTemplateOption);
+    parser.process(a);
+
+    const int slotCount = qBound<int>(1, parser.value(slotsOption).toInt(), 65536);
+    const int tileSize = qBound<int>(1, parser.value(tileSizeOption).toInt(), 2048);
+
+    //Keep the segment addressable with an int
+    const qint64 slotBytes = (qint64)tileSize * tileSize * 4;
+    if (slotBytes * slotCount > 1024LL * 1024 * 1024)
+    {
+        qWarning() << "Refusing to use more than 1 GiB of shared memory";
+        return 1;
+    }
+
+    MapTileDaemon daemon(slotCount, (int)slotBytes);
+
+    QSharedPointer<OSMTileSource> osmTiles(new OSMTileSource(OSMTileSource::OSMTiles), &QObject::deleteLater);
+    if (parser.isSet(osmTemplateOption))
+        osmTiles->setUrlTemplate(parser.value(osmTemplateOption));
+    daemon.addSource(osmTiles);
+
+    if (!daemon.start())
+        return 1;
+
+    return a.exec();
+}
@@ -0,0 +1,260 @@
+#include "MockTileConnection.h"
+
+#include "MockTileServer.h"
+
+#include <QRandomGenerator>
+#include <QRegularExpression>
+#include <QStringBuilder>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QtDebug>
+
+//Throttled responses are written in slices this often
+const int THROTTLE_INTERVAL_MSECS = 20;
+
+//Anybody sending us more than this without finishing a request is up to no good
+const int MAX_REQUEST_HEADER_BYTES = 64 * 1024;
+
+MockTileConnection::MockTileConnection(QTcpSocket *socket, MockTileServer *server) :
+    QObject(server), _socket(socket), _server(server), _busy(false), _closeAfterResponse(false), _fate(0.0)
+{
+    _socket->setParent(this);
+
+    _throttleTimer = new QTimer(this);
+    connect(_throttleTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(writeMore()));
+
+    connect(_socket,
+            SIGNAL(readyRead()),
+            this,
+            SLOT(handleReadyRead()));
+    connect(_socket,
+            SIGNAL(disconnected()),
+            this,
+            SLOT(handleDisconnected()));
+}
+
+MockTileConnection::~MockTileConnection()
+{
+}
+
+//private slot
+void MockTileConnection::handleReadyRead()
+{
+    _received += _socket->readAll();
+    if (_received.size() > MAX_REQUEST_HEADER_BYTES && !_received.contains("\r\n\r\n"))
+    {
+        _socket->abort();
+        return;
+    }
+    this->processNextRequest();
+}
+
+//private slot
+void MockTileConnection::handleDisconnected()
+{
+    _throttleTimer->stop();
+    this->deleteLater();
+}
+
+//private slot
+void MockTileConnection::respond()
+{
+    const MockTileServer::Settings& settings = _server->settings();
+    QList<QPair<QByteArray, QByteArray> > headers;
+
+    //Some requests fail no matter what they ask for
+    if (_fate < settings.dropRate + settings.stallRate + settings.errorRate)
+    {
+        _server->countError();
+        headers << qMakePair(QByteArray("Retry-After"), QByteArray("1"));
+        this->send(503, "Service Unavailable", headers, "Injected failure\n");
+        return;
+    }
+
+    if (_method != "GET" && _method != "HEAD")
+    {
+        this->send(405, "Method Not Allowed", headers, QByteArray());
+        return;
+    }
+
+    //Figure out which tiles they want
+    static const QRegularExpression tilePath("^/(\\d+)/(\\d+)/(\\d+)\\.png$");
+    static const QRegularExpression metatilePath("^/meta/(\\d+)/(\\d+)/(\\d+)/(\\d+)\\.png$");
+    const QString path = QString::fromLatin1(_path);
+    quint32 x = 0, y = 0, z = 0;
+    int size = 1;
+    bool ok = false;
+
+    QRegularExpressionMatch match = tilePath.match(path);
+    if (match.hasMatch())
+    {
+        z = match.captured(1).toUInt();
+        x = match.captured(2).toUInt();
+        y = match.captured(3).toUInt();
+        ok = true;
+    }
+    else
+    {
+        match = metatilePath.match(path);
+        if (match.hasMatch())
+        {
+            size = match.captured(1).toInt();
+            z = match.captured(2).toUInt();
+            x = match.captured(3).toUInt();
+            y = match.captured(4).toUInt();
+            ok = (size >= 1 && size <= 16);
+        }
+    }
+
+    if (!ok || z > 30 || x >= (1u << z) || y >= (1u << z))
+    {
+        _server->countNotFound();
+        this->send(404, "Not Found", headers, "No such tile\n");
+        return;
+    }
+
+    //Caching headers
+    if (settings.maxAge >= 0)
+        headers << qMakePair(QByteArray("Cache-Control"), "max-age=" + QByteArray::number(settings.maxAge));
+
+    if (settings.etags)
+    {
+        const QByteArray etag = "\"" + QByteArray::number(z) + "-" + QByteArray::number(x) + "-"
+                + QByteArray::number(y) + "-" + QByteArray::number(size) + "-v"
+                + QByteArray::number(settings.tileVersion) + "\"";
+        headers << qMakePair(QByteArray("ETag"), etag);
+
+        if (_headers.value("if-none-match") == etag)
+        {
+            _server->countNotModified();
+            this->send(304, "Not Modified", headers, QByteArray());
+            return;
+        }
+    }
+
+    const QByteArray body = _server->renderTiles(x, y, (quint8)z, size);
+    headers << qMakePair(QByteArray("Content-Type"), QByteArray("image/png"));
+    _server->countTile(body.size());
+    this->send(200, "OK", headers, body);
+}
+
+//private slot
+void MockTileConnection::writeMore()
+{
+    const qint64 bytesPerSecond = _server->settings().bytesPerSecond;
+    const int slice = (int)qMax<qint64>(1, bytesPerSecond * THROTTLE_INTERVAL_MSECS / 1000);
+
+    _socket->write(_outgoing.left(slice));
+    _outgoing.remove(0, slice);
+
+    if (_outgoing.isEmpty())
+    {
+        _throttleTimer->stop();
+        this->finishResponse();
+    }
+}
+
+//private
+void MockTileConnection::processNextRequest()
+{
+    if (_busy)
+        return;
+
+    const int headerEnd = _received.indexOf("\r\n\r\n");
+    if (headerEnd < 0)
+        return;
+
+    const QByteArray head = _received.left(headerEnd);
+    _received.remove(0, headerEnd + 4);
+
+    //"GET /z/x/y.png HTTP/1.1", then the headers
+    const QList<QByteArray> lines = head.split('\n');
+    const QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+    if (requestLine.size() < 3)
+    {
+        _socket->abort();
+        return;
+    }
+    _method = requestLine.at(0);
+    _path = requestLine.at(1);
+
+    _headers.clear();
+    for (int i = 1; i < lines.size(); i++)
+    {
+        const int colon = lines.at(i).indexOf(':');
+        if (colon <= 0)
+            continue;
+        _headers.insert(lines.at(i).left(colon).trimmed().toLower(), lines.at(i).mid(colon + 1).trimmed());
+    }
+
+    const QByteArray connection = _headers.value("connection").toLower();
+    _closeAfterResponse = (connection == "close")
+            || (requestLine.at(2) == "HTTP/1.0" && connection != "keep-alive");
+
+    _busy = true;
+    _server->countRequest();
+
+    //Decide what kind of trouble this request gets into
+    const MockTileServer::Settings& settings = _server->settings();
+    _fate = QRandomGenerator::global()->generateDouble();
+    if (_fate < settings.dropRate)
+    {
+        _server->countDrop();
+        _socket->abort();
+        return;
+    }
+    if (_fate < settings.dropRate + settings.stallRate)
+    {
+        //Never answer. The connection stays busy until the client gives up.
+        _server->countStall();
+        return;
+    }
+
+    int latency = settings.latencyMsecs;
+    if (settings.jitterMsecs > 0)
+        latency += QRandomGenerator::global()->bounded(settings.jitterMsecs + 1);
+    QTimer::singleShot(latency, this, SLOT(respond()));
+}
+
+//private
+void MockTileConnection::send(int status, const QByteArray &reason, const QList<QPair<QByteArray, QByteArray> > &headers,
+                              const QByteArray &body)
+{
+    QByteArray response = "HTTP/1.1 " + QByteArray::number(status) + " " + reason + "\r\n";
+    for (int i = 0; i < headers.size(); i++)
+        response += headers.at(i).first + ": " + headers.at(i).second + "\r\n";
+    response += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+    if (_closeAfterResponse)
+        response += "Connection: close\r\n";
+    response += "\r\n";
+    if (_method != "HEAD")
+        response += body;
+
+    if (_server->settings().bytesPerSecond <= 0)
+    {
+        _socket->write(response);
+        this->finishResponse();
+        return;
+    }
+
+    _outgoing = response;
+    _throttleTimer->start(THROTTLE_INTERVAL_MSECS);
+    this->writeMore();
+}
+
+//private
+void MockTileConnection::finishResponse()
+{
+    _busy = false;
+    if (_closeAfterResponse)
+    {
+        _socket->disconnectFromHost();
+        return;
+    }
+
+    //Pipelined requests may already be waiting
+    this->processNextRequest();
+}
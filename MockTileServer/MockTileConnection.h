@@ -0,0 +1,60 @@
+#ifndef MOCKTILECONNECTION_H
+#define MOCKTILECONNECTION_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QPair>
+
+class QTcpSocket;
+class QTimer;
+class MockTileServer;
+
+/*!
+ \brief Serves the HTTP/1.1 requests arriving on one connection to a MockTileServer, one at a time and
+ in order, applying the server's latency, bandwidth and fault settings. Deletes itself when the connection
+ closes.
+*/
+class MockTileConnection : public QObject
+{
+    Q_OBJECT
+public:
+    MockTileConnection(QTcpSocket * socket, MockTileServer * server);
+    virtual ~MockTileConnection();
+
+private slots:
+    void handleReadyRead();
+    void handleDisconnected();
+    void respond();
+    void writeMore();
+
+private:
+    //Starts on the next complete request in the buffer, unless we're still busy with one
+    void processNextRequest();
+
+    //Queues a response to be written, at the allowed bandwidth
+    void send(int status, const QByteArray& reason, const QList<QPair<QByteArray, QByteArray> >& headers,
+              const QByteArray& body);
+
+    void finishResponse();
+
+    QTcpSocket * _socket;
+    MockTileServer * _server;
+    QTimer * _throttleTimer;
+
+    QByteArray _received;
+    bool _busy;
+
+    //The request we're working on
+    QByteArray _method;
+    QByteArray _path;
+    QHash<QByteArray, QByteArray> _headers;
+    bool _closeAfterResponse;
+    qreal _fate;
+
+    //Response bytes we haven't written yet
+    QByteArray _outgoing;
+};
+
+#endif // MOCKTILECONNECTION_H
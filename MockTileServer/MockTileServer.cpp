@@ -0,0 +1,171 @@
+#include "MockTileServer.h"
+
+#include "MockTileConnection.h"
+
+#include <QBuffer>
+#include <QImage>
+#include <QPainter>
+#include <QStringBuilder>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QtDebug>
+
+//Enough for a few thousand PNG tiles
+const int RENDER_CACHE_KB = 64 * 1024;
+
+const int STATISTICS_INTERVAL_MSECS = 5000;
+
+MockTileServer::MockTileServer(const MockTileServer::Settings &settings, QObject *parent) :
+    QTcpServer(parent), _settings(settings)
+{
+    _statistics.requests = 0;
+    _statistics.tiles = 0;
+    _statistics.notModified = 0;
+    _statistics.errors = 0;
+    _statistics.stalls = 0;
+    _statistics.drops = 0;
+    _statistics.notFound = 0;
+    _statistics.bytesSent = 0;
+    _lastPrinted = _statistics;
+    _sincePrinted.start();
+
+    _rendered.setMaxCost(RENDER_CACHE_KB);
+
+    QTimer * statisticsTimer = new QTimer(this);
+    connect(statisticsTimer,
+            SIGNAL(timeout()),
+            this,
+            SLOT(printStatistics()));
+    statisticsTimer->start(STATISTICS_INTERVAL_MSECS);
+}
+
+MockTileServer::~MockTileServer()
+{
+}
+
+const MockTileServer::Settings &MockTileServer::settings() const
+{
+    return _settings;
+}
+
+const MockTileServer::Statistics &MockTileServer::statistics() const
+{
+    return _statistics;
+}
+
+QByteArray MockTileServer::renderTiles(quint32 x, quint32 y, quint8 z, int size)
+{
+    const QString key = QString::number(x) % "," % QString::number(y) % "," % QString::number(z) % "," % QString::number(size);
+    if (_rendered.contains(key))
+        return *_rendered.object(key);
+
+    //Don't go past the edge of the world
+    const quint64 tilesPerSide = (quint64)1 << z;
+    const int across = (int)qMin<quint64>(size, tilesPerSide - qMin<quint64>(x, tilesPerSide));
+    const int down = (int)qMin<quint64>(size, tilesPerSide - qMin<quint64>(y, tilesPerSide));
+    if (across <= 0 || down <= 0)
+        return QByteArray();
+
+    const int tileSize = _settings.tileSize;
+    QImage image(across * tileSize, down * tileSize, QImage::Format_ARGB32_Premultiplied);
+    QPainter painter(&image);
+    for (int dx = 0; dx < across; dx++)
+    {
+        for (int dy = 0; dy < down; dy++)
+        {
+            const quint32 tileX = x + dx;
+            const quint32 tileY = y + dy;
+            const QRect rect(dx * tileSize, dy * tileSize, tileSize, tileSize);
+
+            //A checkerboard tinted by zoom level, so misplaced or stale tiles are easy to spot
+            const int hue = (z * 37) % 360;
+            const bool dark = ((tileX + tileY) % 2) == 0;
+            painter.fillRect(rect, QColor::fromHsv(hue, 60, dark ? 200 : 235));
+            painter.setPen(Qt::black);
+            painter.drawRect(rect.adjusted(0, 0, -1, -1));
+            painter.drawText(rect,
+                             Qt::AlignCenter,
+                             QString::number(z) % "/" % QString::number(tileX) % "/" % QString::number(tileY)
+                             % "\nv" % QString::number(_settings.tileVersion));
+        }
+    }
+    painter.end();
+
+    QByteArray toRet;
+    QBuffer buffer(&toRet);
+    buffer.open(QIODevice::WriteOnly);
+    image.save(&buffer, "PNG");
+
+    _rendered.insert(key, new QByteArray(toRet), qMax<int>(1, toRet.size() / 1024));
+    return toRet;
+}
+
+void MockTileServer::countRequest()
+{
+    _statistics.requests++;
+}
+
+void MockTileServer::countTile(qint64 bytes)
+{
+    _statistics.tiles++;
+    _statistics.bytesSent += bytes;
+}
+
+void MockTileServer::countNotModified()
+{
+    _statistics.notModified++;
+}
+
+void MockTileServer::countError()
+{
+    _statistics.errors++;
+}
+
+void MockTileServer::countStall()
+{
+    _statistics.stalls++;
+}
+
+void MockTileServer::countDrop()
+{
+    _statistics.drops++;
+}
+
+void MockTileServer::countNotFound()
+{
+    _statistics.notFound++;
+}
+
+//protected
+void MockTileServer::incomingConnection(qintptr socketDescriptor)
+{
+    QTcpSocket * socket = new QTcpSocket();
+    if (!socket->setSocketDescriptor(socketDescriptor))
+    {
+        qWarning() << "Failed to accept connection:" << socket->errorString();
+        delete socket;
+        return;
+    }
+
+    //The connection deletes itself (and the socket) when the socket disconnects
+    new MockTileConnection(socket, this);
+}
+
+//private slot
+void MockTileServer::printStatistics()
+{
+    if (_statistics.requests == _lastPrinted.requests)
+        return;
+
+    const qreal seconds = qMax<qreal>(0.001, _sincePrinted.restart() / 1000.0);
+    qDebug() << "Requests:" << _statistics.requests
+             << "tiles:" << _statistics.tiles
+             << "304s:" << _statistics.notModified
+             << "errors:" << _statistics.errors
+             << "stalls:" << _statistics.stalls
+             << "drops:" << _statistics.drops
+             << "404s:" << _statistics.notFound
+             << "| tiles/sec:" << (_statistics.tiles - _lastPrinted.tiles) / seconds
+             << "KiB/sec:" << (_statistics.bytesSent - _lastPrinted.bytesSent) / 1024.0 / seconds;
+    _lastPrinted = _statistics;
+}
@@ -0,0 +1,98 @@
+#ifndef MOCKTILESERVER_H
+#define MOCKTILESERVER_H
+
+#include <QTcpServer>
+#include <QCache>
+#include <QByteArray>
+#include <QElapsedTimer>
+
+/*!
+ \brief A small HTTP/1.1 server that serves synthetic tiles, with knobs for the kind of trouble real tile
+ servers cause: latency, limited bandwidth, errors, stalled and dropped connections.
+
+ Tiles are served at /{z}/{x}/{y}.png (the OSM layout) and metatiles of size x size tiles as a single image
+ at /meta/{size}/{z}/{x}/{y}.png, where x,y is the metatile's top-left tile.
+*/
+class MockTileServer : public QTcpServer
+{
+    Q_OBJECT
+public:
+    struct Settings
+    {
+        quint16 tileSize;
+
+        //Delay before each response starts, plus up to jitterMsecs more
+        int latencyMsecs;
+        int jitterMsecs;
+
+        //Per connection. 0 means unlimited.
+        qint64 bytesPerSecond;
+
+        //Fractions of requests that get a 503, are never answered, or have their connection closed
+        qreal errorRate;
+        qreal stallRate;
+        qreal dropRate;
+
+        //Cache-Control max-age in seconds. Negative leaves the header out.
+        int maxAge;
+
+        //Whether to send ETags and answer If-None-Match with 304. The version is part of every ETag,
+        //so changing it "updates" all tiles.
+        bool etags;
+        int tileVersion;
+    };
+
+    /*!
+     \brief What happened to the requests we received
+    */
+    struct Statistics
+    {
+        quint64 requests;
+        quint64 tiles;
+        quint64 notModified;
+        quint64 errors;
+        quint64 stalls;
+        quint64 drops;
+        quint64 notFound;
+        quint64 bytesSent;
+    };
+
+public:
+    explicit MockTileServer(const MockTileServer::Settings& settings, QObject *parent = 0);
+    virtual ~MockTileServer();
+
+    const MockTileServer::Settings& settings() const;
+    const MockTileServer::Statistics& statistics() const;
+
+    /*!
+     \brief Returns the PNG for the block of size x size tiles whose top-left tile is x,y on zoom level z.
+     Blocks reaching past the edge of the world are cut off.
+    */
+    QByteArray renderTiles(quint32 x, quint32 y, quint8 z, int size);
+
+    //Called by the connections to keep count
+    void countRequest();
+    void countTile(qint64 bytes);
+    void countNotModified();
+    void countError();
+    void countStall();
+    void countDrop();
+    void countNotFound();
+
+protected:
+    virtual void incomingConnection(qintptr socketDescriptor);
+
+private slots:
+    void printStatistics();
+
+private:
+    Settings _settings;
+    Statistics _statistics;
+    Statistics _lastPrinted;
+    QElapsedTimer _sincePrinted;
+
+    //Rendering the same PNG over and over would make us the bottleneck. Cost is in KiB.
+    QCache<QString, QByteArray> _rendered;
+};
+
+#endif // MOCKTILESERVER_H
@@ -0,0 +1,25 @@
+#-------------------------------------------------
+#
+# Local HTTP tile server serving synthetic tiles, for testing and benchmarking
+# tile sources without touching real tile servers.
+#
+#-------------------------------------------------
+CONFIG += c++17
+CONFIG += warn_on
+CONFIG += console
+CONFIG -= app_bundle
+
+QT       += core gui network
+
+TARGET = MockTileServer
+TEMPLATE = app
+
+
+SOURCES += main.cpp \
+    MockTileServer.cpp \
+    MockTileConnection.cpp
+
+HEADERS  += MockTileServer.h \
+    MockTileConnection.h
+
+DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x050F00
@@ -0,0 +1,73 @@
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QHostAddress>
+#include <QtDebug>
+
+#include "MockTileServer.h"
+
+int main(int argc, char *argv[])
+{
+    //We only draw into QImages, so we don't need a display
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QGuiApplication a(argc, argv);
+    QCoreApplication::setApplicationName("MockTileServer");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Serves synthetic map tiles at /{z}/{x}/{y}.png and metatiles at "
+                                     "/meta/{size}/{z}/{x}/{y}.png, with configurable trouble.");
+    parser.addHelpOption();
+
+    QCommandLineOption portOption("port", "Port to listen on.", "port", "8080");
+    QCommandLineOption listenOption("listen", "Address to listen on.", "address", "127.0.0.1");
+    QCommandLineOption tileSizeOption("tile-size", "Tile size in pixels.", "pixels", "256");
+    QCommandLineOption latencyOption("latency", "Delay before each response.", "msecs", "0");
+    QCommandLineOption jitterOption("jitter", "Up to this much extra random delay.", "msecs", "0");
+    QCommandLineOption bandwidthOption("bandwidth", "Bytes per second per connection, 0 for unlimited.", "bytes", "0");
+    QCommandLineOption errorRateOption("error-rate", "Fraction of requests answered with 503.", "fraction", "0");
+    QCommandLineOption stallRateOption("stall-rate", "Fraction of requests never answered.", "fraction", "0");
+    QCommandLineOption dropRateOption("drop-rate", "Fraction of requests whose connection is closed.", "fraction", "0");
+    QCommandLineOption maxAgeOption("max-age", "Cache-Control max-age, or -1 to leave it out.", "seconds", "86400");
+    QCommandLineOption noETagOption("no-etag", "Don't send ETags or answer If-None-Match.");
+    QCommandLineOption tileVersionOption("tile-version", "Version number baked into tiles and ETags.", "version", "1");
+    parser.addOption(portOption);
+    parser.addOption(listenOption);
+    parser.addOption(tileSizeOption);
+    parser.addOption(latencyOption);
+    parser.addOption(jitterOption);
+    parser.addOption(bandwidthOption);
+    parser.addOption(errorRateOption);
+    parser.addOption(stallRateOption);
+    parser.addOption(dropRateOption);
+    parser.addOption(maxAgeOption);
+    parser.addOption(noETagOption);
+    parser.addOption(tileVersionOption);
+    parser.process(a);
+
+    MockTileServer::Settings settings;
+    settings.tileSize = (quint16)qBound<int>(1, parser.value(tileSizeOption).toInt(), 4096);
+    settings.latencyMsecs = qMax<int>(0, parser.value(latencyOption).toInt());
+    settings.jitterMsecs = qMax<int>(0, parser.value(jitterOption).toInt());
+    settings.bytesPerSecond = qMax<qint64>(0, parser.value(bandwidthOption).toLongLong());
+    settings.errorRate = qBound<qreal>(0.0, parser.value(errorRateOption).toDouble(), 1.0);
+    settings.stallRate = qBound<qreal>(0.0, parser.value(stallRateOption).toDouble(), 1.0);
+    settings.dropRate = qBound<qreal>(0.0, parser.value(dropRateOption).toDouble(), 1.0);
+    settings.maxAge = parser.value(maxAgeOption).toInt();
+    settings.etags = !parser.isSet(noETagOption);
+    settings.tileVersion = parser.value(tileVersionOption).toInt();
+
+    MockTileServer server(settings);
+    const QHostAddress address(parser.value(listenOption));
+    const quint16 port = (quint16)parser.value(portOption).toUInt();
+    if (!server.listen(address, port))
+    {
+        qWarning() << "Failed to listen on" << address.toString() << port << ":" << server.errorString();
+        return 1;
+    }
+
+    qDebug() << "Serving tiles at" << QString("http://%1:%2/{z}/{x}/{y}.png").arg(address.toString()).arg(server.serverPort());
+    qDebug() << "Point MapGraphics at it with MAPGRAPHICS_HOST_REDIRECT=" + QString("http://%1:%2").arg(address.toString()).arg(server.serverPort());
+
+    return a.exec();
+}
@@ -32,6 +32,11 @@ MainWindow::MainWindow(QWidget *parent) :
     QSharedPointer<OSMTileSource> osmTiles(new OSMTileSource(OSMTileSource::OSMTiles), &QObject::deleteLater);
     QSharedPointer<GridTileSource> gridTiles(new GridTileSource(), &QObject::deleteLater);
     QSharedPointer<CompositeTileSource> composite(new CompositeTileSource(), &QObject::deleteLater);
+    osmTiles->setWarmStartEnabled(true);
+
+    //Let users zoom past OSM's deepest zoom level by scaling up its tiles locally. OSM is the basemap,
+    //so the composite goes as deep as it does.
+    osmTiles->setMaxOverzoomLevel(21);
     composite->addSourceBottom(osmTiles);
     composite->addSourceTop(gridTiles);
     view->setTileSource(composite);
@@ -48,6 +53,9 @@ MainWindow::MainWindow(QWidget *parent) :
     view->setZoomLevel(12);
     view->centerOn(-112.202442, 40.9936234);
 
+    //Load the tiles we used most last time, starting with the ones we're about to show
+    composite->preloadHotTiles(QPointF(-112.202442, 40.9936234), view->zoomLevel());
+
     // Create a circle on the map to demonstrate MapGraphicsObject a bit
     // The circle can be clicked/dragged around and should be ~5km in radius
     MapGraphicsObject * circle = new CircleObject(5000, false, QColor(255, 0, 0, 100));
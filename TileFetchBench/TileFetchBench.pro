@@ -0,0 +1,28 @@
+#-------------------------------------------------
+#
+# Fetches blocks of tiles through OSMTileSource and reports how long they took,
+# to compare HTTP versions, connection limits and sharding against a tile server.
+#
+#-------------------------------------------------
+CONFIG += c++17
+CONFIG += warn_on
+CONFIG += console
+CONFIG -= app_bundle
+
+QT       += core gui network
+
+TARGET = TileFetchBench
+TEMPLATE = app
+
+
+SOURCES += main.cpp
+
+DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x050F00
+
+#Linkage for MapGraphics shared library
+win32:CONFIG(release, debug|release): LIBS += -L$$OUT_PWD/../MapGraphics/release/ -lMapGraphics
+else:win32:CONFIG(debug, debug|release): LIBS += -L$$OUT_PWD/../MapGraphics/debug/ -lMapGraphics
+else:unix:!symbian: LIBS += -L$$OUT_PWD/../MapGraphics/ -lMapGraphics
+
+INCLUDEPATH += $$PWD/../MapGraphics
+DEPENDPATH += $$PWD/../MapGraphics
@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Checks that {s} can stand for a port: starts a MockTileServer on each of PORTS and fetches through
+# "http://127.0.0.1:{s}/..." with the ports as subdomains. TileFetchBench fails if any run doesn't send
+# requests to every server. Extra arguments go to TileFetchBench.
+#
+set -e
+
+BENCH=${BENCH:-./TileFetchBench}
+SERVER=${SERVER:-../MockTileServer/MockTileServer}
+PORTS=${PORTS:-"8001 8002 8003"}
+
+pids=""
+trap 'kill $pids 2>/dev/null || true' EXIT
+
+count=0
+for port in $PORTS; do
+    "$SERVER" --port "$port" &
+    pids="$pids $!"
+    count=$((count + 1))
+done
+sleep 1
+
+"$BENCH" --url 'http://127.0.0.1:{s}/{z}/{x}/{y}.png' --subdomains "$(echo $PORTS | tr ' ' ',')" \
+    --http2 off --min-hosts "$count" "$@"
@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Runs TileFetchBench over HTTP/1.1 and HTTP/2 at several round-trip times. netem delays everything on
+# the loopback interface, so this needs root (for tc) and a local server on TILE_URL that answers both
+# HTTP/1.1 and cleartext HTTP/2 (see README.md). Extra arguments go to TileFetchBench.
+#
+set -e
+
+BENCH=${BENCH:-./TileFetchBench}
+TILE_URL=${TILE_URL:-"http://127.0.0.1:8081/{z}/{x}/{y}.png"}
+RTTS=${RTTS:-"0 20 50 100 200"}
+
+trap 'tc qdisc del dev lo root 2>/dev/null || true' EXIT
+
+for rtt in $RTTS; do
+    tc qdisc del dev lo root 2>/dev/null || true
+
+    #Requests and responses both leave through lo, so each direction gets half the round trip
+    if [ "$rtt" -gt 0 ]; then
+        tc qdisc add dev lo root netem delay "$((rtt / 2))ms"
+    fi
+
+    echo "== RTT $rtt ms"
+    "$BENCH" --url "$TILE_URL" --http2 off "$@"
+    "$BENCH" --url "$TILE_URL" --http2 prior "$@"
+done
@@ -0,0 +1,206 @@
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QSet>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QTextStream>
+#include <QTimer>
+#include <QtMath>
+
+#include "tileSources/OSMTileSource.h"
+#include "guts/MapGraphicsNetwork.h"
+
+namespace
+{
+/*!
+ \brief Fetches one block of tiles and waits until they've all arrived (or the timeout passes)
+*/
+class BlockFetch
+{
+public:
+    BlockFetch(MapTileSource * source, const QSet<QString>& cacheIDs) :
+        _source(source), _remaining(cacheIDs)
+    {
+    }
+
+    //Returns how many of the tiles arrived
+    int run(int timeoutMsecs)
+    {
+        const int total = _remaining.size();
+        QEventLoop loop;
+        _loop = &loop;
+        QMetaObject::Connection connection = QObject::connect(_source,
+                                                              &MapTileSource::tileRetrieved,
+                                                              [this](quint32 x, quint32 y, quint8 z)
+        {
+            this->handleTileRetrieved(x, y, z);
+        });
+        QMetaObject::Connection failedConnection = QObject::connect(_source,
+                                                                    &MapTileSource::tileRetrievalFailed,
+                                                                    [this](quint32 x, quint32 y, quint8 z)
+        {
+            this->handleTileFailed(x, y, z);
+        });
+        QTimer::singleShot(timeoutMsecs, &loop, &QEventLoop::quit);
+
+        foreach(const QString& cacheID, _remaining)
+        {
+            quint32 x, y, z;
+            if (MapTileSource::cacheID2xyz(cacheID, &x, &y, &z))
+                _source->requestTile(x, y, z);
+        }
+        if (!_remaining.isEmpty())
+            loop.exec();
+
+        QObject::disconnect(connection);
+        QObject::disconnect(failedConnection);
+        _loop = 0;
+        return total - _remaining.size() - _failed;
+    }
+
+private:
+    void handleTileRetrieved(quint32 x, quint32 y, quint8 z)
+    {
+        const QString cacheID = MapTileSource::createCacheID(x, y, z);
+        if (!_remaining.contains(cacheID))
+            return;
+
+        bool provisional = false;
+        QImage * tile = _source->getFinishedTile(x, y, z, 0, &provisional);
+        delete tile;
+        if (tile == 0 || provisional)
+            return;
+
+        _remaining.remove(cacheID);
+        if (_remaining.isEmpty() && _loop != 0)
+            _loop->quit();
+    }
+
+    //A tile that failed for good (after any retries) won't arrive, so there's no point waiting for it
+    void handleTileFailed(quint32 x, quint32 y, quint8 z)
+    {
+        if (!_remaining.remove(MapTileSource::createCacheID(x, y, z)))
+            return;
+
+        _failed++;
+        if (_remaining.isEmpty() && _loop != 0)
+            _loop->quit();
+    }
+
+    MapTileSource * _source;
+    QSet<QString> _remaining;
+    QEventLoop * _loop = 0;
+    int _failed = 0;
+};
+}
+
+int main(int argc, char *argv[])
+{
+    //Tiles are decoded into QImages, but nothing is shown
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QGuiApplication a(argc, argv);
+    QCoreApplication::setApplicationName("TileFetchBench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Fetches blocks of tiles through OSMTileSource, without caching, and reports "
+                                     "how long they took. Run it against MockTileServer (see README.md).");
+    parser.addHelpOption();
+
+    QCommandLineOption urlOption("url", "Tile URL template.", "template", "http://127.0.0.1:8080/{z}/{x}/{y}.png");
+    QCommandLineOption subdomainsOption("subdomains", "Comma-separated values for {s}.", "list");
+    QCommandLineOption http2Option("http2", "HTTP/2 mode: off, fallback or prior.", "mode", "off");
+    QCommandLineOption tilesOption("tiles", "Tiles per run.", "count", "256");
+    QCommandLineOption zoomOption("zoom", "Zoom level to fetch from.", "level", "12");
+    QCommandLineOption runsOption("runs", "Runs, each fetching a different block of tiles.", "count", "3");
+    QCommandLineOption connectionsOption("max-connections", "Requests in flight per HTTP/1.1 host.", "count");
+    QCommandLineOption streamsOption("max-streams", "Requests in flight per HTTP/2 host.", "count");
+    QCommandLineOption timeoutOption("timeout", "How long a run may take.", "msecs", "60000");
+    QCommandLineOption minHostsOption("min-hosts", "Fail unless every run sends requests to at least this many hosts.",
+                                      "count", "1");
+    parser.addOption(urlOption);
+    parser.addOption(subdomainsOption);
+    parser.addOption(http2Option);
+    parser.addOption(tilesOption);
+    parser.addOption(zoomOption);
+    parser.addOption(runsOption);
+    parser.addOption(connectionsOption);
+    parser.addOption(streamsOption);
+    parser.addOption(timeoutOption);
+    parser.addOption(minHostsOption);
+    parser.process(a);
+
+    QSharedPointer<OSMTileSource> source(new OSMTileSource(OSMTileSource::OSMTiles), &QObject::deleteLater);
+    source->setCacheMode(MapTileSource::NoCaching);
+    source->setUrlTemplate(parser.value(urlOption));
+    if (parser.isSet(subdomainsOption))
+        source->setSubdomains(parser.value(subdomainsOption).split(',', Qt::SkipEmptyParts));
+    if (parser.isSet(connectionsOption))
+        source->setMaxConnectionsPerHost(parser.value(connectionsOption).toInt());
+    if (parser.isSet(streamsOption))
+        source->setMaxStreamsPerHost(parser.value(streamsOption).toInt());
+
+    const QString http2 = parser.value(http2Option);
+    if (http2 == "fallback")
+        source->setHttp2Mode(OSMTileSource::Http2WithFallback);
+    else if (http2 == "prior")
+        source->setHttp2Mode(OSMTileSource::Http2PriorKnowledge);
+    else if (http2 != "off")
+        parser.showHelp(1);
+
+    const int tiles = qMax<int>(1, parser.value(tilesOption).toInt());
+    const quint8 zoom = (quint8)qBound<int>(1, parser.value(zoomOption).toInt(), 20);
+    const int runs = qMax<int>(1, parser.value(runsOption).toInt());
+    const int timeout = qMax<int>(1, parser.value(timeoutOption).toInt());
+    const int minHosts = qMax<int>(1, parser.value(minHostsOption).toInt());
+    const int side = qCeil(qSqrt((qreal)tiles));
+
+    QTextStream out(stdout);
+    out << "Fetching " << tiles << " tiles per run from " << source->urlTemplate()
+        << " (HTTP/2 " << http2 << ")\n";
+
+    MapGraphicsNetwork * network = MapGraphicsNetwork::getInstance();
+    bool complete = true;
+    bool spread = true;
+    for (int run = 0; run < runs; run++)
+    {
+        //A new block every run, side by side, so no run gets tiles another run already fetched. The first run
+        //also pays for opening the connections.
+        QSet<QString> cacheIDs;
+        for (int i = 0; i < tiles; i++)
+            cacheIDs.insert(MapTileSource::createCacheID(run * side + i % side, i / side, zoom));
+
+        network->resetStatistics();
+        QElapsedTimer timer;
+        timer.start();
+        BlockFetch fetch(source.data(), cacheIDs);
+        const int arrived = fetch.run(timeout);
+        const qint64 elapsed = timer.elapsed();
+        complete = complete && arrived == tiles;
+
+        const MapGraphicsNetwork::Statistics statistics = network->statistics();
+        const qreal averageLatency = statistics.requestsFinished == 0
+                ? 0.0 : (qreal)statistics.totalLatencyMsecs / statistics.requestsFinished;
+        out << QString("Run %1: %2/%3 tiles in %4 ms, %5 tiles/s, %6 ms average latency, "
+                       "%7 over HTTP/2, %8 retries, %9 failures\n")
+               .arg(run + 1).arg(arrived).arg(tiles).arg(elapsed)
+               .arg(arrived * 1000.0 / qMax<qint64>(1, elapsed), 0, 'f', 1)
+               .arg(averageLatency, 0, 'f', 1)
+               .arg(statistics.http2Responses).arg(statistics.retries).arg(statistics.failures);
+
+        //Shows how {s} spread the requests, e.g. over several MockTileServers on different ports
+        QStringList hosts = statistics.requestsPerHost.keys();
+        hosts.sort();
+        foreach(const QString& host, hosts)
+            out << "  " << host << ": " << statistics.requestsPerHost.value(host) << " requests\n";
+        spread = spread && hosts.size() >= minHosts;
+        out.flush();
+    }
+
+    if (!spread)
+        out << "Requests went to fewer than " << minHosts << " hosts\n";
+    return (complete && spread) ? 0 : 1;
+}